@@ -30,6 +30,7 @@ void applySettings(System::Object^ form)
 {
 	auto window = (GuiLite::SettingsForm^)form;
 	mtBI::SettingsInfo info;
+	IoctlFunc(mtBI::MessageId::GetSettings, nullptr, &info);
 	info.dhtEnabled = window->checkBoxDht->Checked;
 	auto dirPtr = (char*)System::Runtime::InteropServices::Marshal::StringToHGlobalAnsi(window->directoryTextBox->Text).ToPointer();
 	info.directory = dirPtr;
@@ -232,8 +233,9 @@ void addTorrent()
 	if (openFileDialog->ShowDialog() == System::Windows::Forms::DialogResult::OK)
 	{
 		auto filenamePtr = (char*)System::Runtime::InteropServices::Marshal::StringToHGlobalAnsi(openFileDialog->FileName).ToPointer();
+		mtBI::AddFromFileRequest request = { filenamePtr, false };
 		
-		if (IoctlFunc(mtBI::MessageId::AddFromFile, filenamePtr, hash) == mtt::Status::Success)
+		if (IoctlFunc(mtBI::MessageId::AddFromFile, &request, hash) == mtt::Status::Success)
 		{
 			selected = true;
 			selectionChanged = true;
@@ -638,6 +640,8 @@ void refreshUi()
 				String^ progress;
 				if (info.checking)
 					progress = "Checking " + float(info.checkingProgress).ToString("P");
+				else if (info.preallocating)
+					progress = "Allocating " + float(info.preallocationProgress).ToString("P");
 				else
 				{
 					progress = float(info.selectionProgress).ToString("P");
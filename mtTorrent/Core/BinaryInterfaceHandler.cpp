@@ -6,6 +6,7 @@
 #include "Public/BinaryInterface.h"
 #include "FileTransfer.h"
 #include "utils/HexEncoding.h"
+#include "MemoryGovernor.h"
 
 mtt::Core core;
 
@@ -19,7 +20,8 @@ extern "C"
 			core.deinit();
 		else if (id == mtBI::MessageId::AddFromFile)
 		{
-			auto t = core.addFile((const char*)request);
+			auto info = (mtBI::AddFromFileRequest*) request;
+			auto t = core.addFile(info->filename, info->seedMode);
 
 			if (!t)
 				return mtt::Status::E_InvalidInput;
@@ -86,6 +88,9 @@ extern "C"
 			resp->checking = torrent->checking;
 			if (resp->checking)
 				resp->checkingProgress = torrent->checkingProgress();
+			resp->preallocating = torrent->preallocating;
+			if (resp->preallocating)
+				resp->preallocationProgress = torrent->preallocationProgress();
 			resp->foundPeers = torrent->peers->receivedCount();
 			resp->downloaded = torrent->downloaded();
 			resp->downloadSpeed = torrent->downloadSpeed();
@@ -227,6 +232,8 @@ extern "C"
 			resp->maxConnections = settings.maxTorrentConnections;
 			resp->tcpPort = settings.tcpPort;
 			resp->udpPort = settings.udpPort;
+			resp->maxDownloadSpeed = settings.maxDownloadSpeed;
+			resp->maxUploadSpeed = settings.maxUploadSpeed;
 		}
 		else if (id == mtBI::MessageId::SetSettings)
 		{
@@ -247,6 +254,11 @@ extern "C"
 			settings.maxTorrentConnections = info->maxConnections;
 			settings.tcpPort = info->tcpPort;
 			settings.udpPort = info->udpPort;
+
+			settings.maxDownloadSpeed = info->maxDownloadSpeed;
+			settings.maxUploadSpeed = info->maxUploadSpeed;
+			BandwidthManager::get().globalDownload.setLimit(settings.maxDownloadSpeed);
+			BandwidthManager::get().globalUpload.setLimit(settings.maxUploadSpeed);
 		}
 		else if (id == mtBI::MessageId::GetTorrentFilesSelection)
 		{
@@ -309,6 +321,46 @@ extern "C"
 
 			torrent->peers->connect(Addr(info->addr.data));
 		}
+		else if (id == mtBI::MessageId::GetTorrentTransferLimits)
+		{
+			auto torrent = core.getTorrent((const uint8_t*)request);
+			if (!torrent)
+				return mtt::Status::E_InvalidInput;
+
+			auto resp = (mtBI::TorrentTransferLimits*) output;
+			memcpy(resp->hash, torrent->hash(), 20);
+			resp->maxDownloadSpeed = torrent->downloadLimit.getLimit();
+			resp->maxUploadSpeed = torrent->uploadLimit.getLimit();
+		}
+		else if (id == mtBI::MessageId::SetTorrentTransferLimits)
+		{
+			auto info = (mtBI::TorrentTransferLimits*) request;
+			auto torrent = core.getTorrent(info->hash);
+			if (!torrent)
+				return mtt::Status::E_InvalidInput;
+
+			torrent->setTransferLimits(info->maxDownloadSpeed, info->maxUploadSpeed);
+		}
+		else if (id == mtBI::MessageId::SetTorrentPreallocationMode)
+		{
+			auto info = (mtBI::TorrentPreallocationModeRequest*) request;
+			auto torrent = core.getTorrent(info->hash);
+			if (!torrent || info->mode > (uint32_t)mtt::PreallocationMode::ZeroFill)
+				return mtt::Status::E_InvalidInput;
+
+			torrent->setPreallocationMode((mtt::PreallocationMode)info->mode);
+		}
+		else if (id == mtBI::MessageId::GetMemoryUsage)
+		{
+			auto resp = (mtBI::MemoryUsageInfo*) output;
+			auto& memory = mtt::MemoryGovernor::get();
+			resp->budget = mtt::config::internal_.memory.budget;
+			resp->used = memory.getUsage();
+			resp->downloadPieces = memory.getUsage(mtt::MemoryCategory::DownloadPieces);
+			resp->uploadPieces = memory.getUsage(mtt::MemoryCategory::UploadPieces);
+			resp->readCache = memory.getUsage(mtt::MemoryCategory::ReadCache);
+			resp->writeCache = memory.getUsage(mtt::MemoryCategory::WriteCache);
+		}
 		else
 			return mtt::Status::E_InvalidInput;
 
@@ -6,6 +6,25 @@ namespace mtt
 {
 	namespace config
 	{
+		enum class Durability
+		{
+			//written data is left to system cache
+			None,
+			//files are synced in batches after interval or amount of stored data
+			Periodic,
+			//every stored piece is synced right away
+			Strict
+		};
+
+		enum class FileReuse
+		{
+			Disabled,
+			//complete file of other torrent is copied
+			Copy,
+			//file shares data with other torrent, only when all its pieces match, otherwise copied
+			Hardlink
+		};
+
 		struct External
 		{
 			uint16_t tcpPort;
@@ -15,6 +34,10 @@ namespace mtt
 			bool enableDht = false;
 
 			uint32_t maxTorrentConnections = 30;
+
+			//bytes per second, 0 is unlimited
+			uint32_t maxDownloadSpeed = 0;
+			uint32_t maxUploadSpeed = 0;
 		};
 
 		struct Internal
@@ -32,6 +55,75 @@ namespace mtt
 			}
 			dht;
 
+			struct
+			{
+				//seconds
+				uint32_t chokeRoundInterval = 10;
+				uint32_t optimisticUnchokeInterval = 30;
+
+				uint32_t minUploadSlots = 4;
+				uint32_t maxUploadSlots = 20;
+			}
+			choking;
+
+			struct
+			{
+				//queued requests per peer, more are dropped
+				uint32_t maxPeerRequests = 64;
+				//bytes waiting in peer socket, blocks are read from disk only below this size
+				uint32_t sendQueueWatermark = 64 * 1024;
+				//pieces read to cache ahead of peer downloading sequentially
+				uint32_t readAheadPieces = 2;
+			}
+			upload;
+
+			struct
+			{
+				//keep files open and submit flushed pieces as one batch of overlapped writes, where supported
+				bool overlappedIo = true;
+				//bypass system cache with sector aligned transfers, for bulk seeding which would otherwise evict everything else from it
+				bool directIo = false;
+
+				//received blocks of selected files are written directly to memory mapped files, not used with directIo
+				//opt-in, mapped windows take up to maxMappedWindows * mappingWindowSize of address space per torrent
+				bool memoryMapping = false;
+				//size of mapped view of file, multiple of allocation granularity
+				uint32_t mappingWindowSize = 64 * 1024 * 1024;
+				uint32_t maxMappedWindows = 16;
+
+				//bytes per second read by background verification of pieces added in seed mode, 0 leaves verification to uploads
+				uint32_t seedCheckSpeed = 32 * 1024 * 1024;
+
+				//disk operations of all torrents running at once, others wait in DiskScheduler
+				uint32_t maxDiskJobs = 4;
+				//share of busy disk for each DiskJobClass, in its order
+				uint32_t diskJobShares[6] = { 16, 8, 4, 1, 1, 1 };
+				//torrents checking stored pieces at once
+				uint32_t maxConcurrentChecks = 1;
+
+				//saved state counts only pieces synced to disk, unless durability is None
+				Durability durability = Durability::None;
+				//periodic sync after seconds or stored bytes, whichever comes first
+				uint32_t syncInterval = 30;
+				uint32_t syncBytes = 64 * 1024 * 1024;
+
+				//bytes per second copied when moving files to other volume or importing reused files, 0 is unlimited
+				uint32_t moveSpeed = 64 * 1024 * 1024;
+
+				//files of added torrent found complete with same content in other torrent are reused instead of downloaded
+				FileReuse fileReuse = FileReuse::Disabled;
+			}
+			storage;
+
+			struct
+			{
+				//bytes of piece buffers and caches of all torrents, 0 is unlimited
+				uint64_t budget = 0;
+				//percent of budget usable by read cache
+				uint32_t cacheShare = 75;
+			}
+			memory;
+
 			uint32_t dhtPeersCheckInterval = 60;
 			std::string programFolderPath;
 			std::string stateFolder;
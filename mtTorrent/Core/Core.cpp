@@ -28,6 +28,9 @@ void mtt::Core::init()
 	
 	mtt::config::internal_.stateFolder = "state";
 
+	BandwidthManager::get().globalDownload.setLimit(mtt::config::external.maxDownloadSpeed);
+	BandwidthManager::get().globalUpload.setLimit(mtt::config::external.maxUploadSpeed);
+
 	dht = std::make_shared<dht::Communication>();
 
 	if(mtt::config::external.enableDht)
@@ -84,7 +87,7 @@ void mtt::Core::deinit()
 	list.saveState();
 }
 
-mtt::TorrentPtr mtt::Core::addFile(const char* filename)
+mtt::TorrentPtr mtt::Core::addFile(const char* filename, bool seedMode)
 {
 	auto torrent = Torrent::fromFile(filename);
 
@@ -96,7 +99,14 @@ mtt::TorrentPtr mtt::Core::addFile(const char* filename)
 
 	saveTorrentFile(torrent);
 	torrents.push_back(torrent);
-	torrent->checkFiles();
+
+	if (seedMode)
+		torrent->enableSeedMode();
+	else
+	{
+		torrent->files.storage.setReusableFiles(findReusableFiles(torrent));
+		torrent->checkFiles();
+	}
 
 	return torrent;
 }
@@ -116,6 +126,7 @@ mtt::TorrentPtr mtt::Core::addMagnet(const char* magnet)
 		if (s == Status::Success && state.finished)
 		{
 			saveTorrentFile(torrent);
+			torrent->files.storage.setReusableFiles(findReusableFiles(torrent));
 			torrent->checkFiles();
 		}
 	};
@@ -134,6 +145,15 @@ mtt::TorrentPtr mtt::Core::getTorrent(const uint8_t* hash)
 			return t;
 	}
 
+	//peers of v2 swarm use truncated v2 hash
+	for (auto t : torrents)
+	{
+		auto& info = t->infoFile.info;
+
+		if (info.hasV2 && memcmp(info.hashV2, hash, 20) == 0)
+			return t;
+	}
+
 	return nullptr;
 }
 
@@ -149,6 +169,7 @@ mtt::Status mtt::Core::removeTorrent(const uint8_t* hash, bool deleteFiles)
 			auto path = mtt::config::internal_.programFolderPath + mtt::config::internal_.stateFolder + "\\" + t->hashString();
 			std::remove((path + ".torrent").data());
 			std::remove((path + ".state").data());
+			std::remove((path + ".parts").data());
 
 			torrents.erase(it);
 	
@@ -176,3 +197,64 @@ void mtt::Core::saveTorrentFile(TorrentPtr t)
 	file << t->infoFile.createTorrentFileData();
 }
 
+std::vector<mtt::ReusableFile> mtt::Core::findReusableFiles(TorrentPtr torrent)
+{
+	std::vector<ReusableFile> out;
+
+	if (mtt::config::internal_.storage.fileReuse == mtt::config::FileReuse::Disabled)
+		return out;
+
+	auto& info = torrent->infoFile.info;
+
+	for (uint32_t i = 0; i < info.files.size(); i++)
+	{
+		auto& file = info.files[i];
+
+		//too small to have whole piece to verify
+		if (file.size < info.pieceSize)
+			continue;
+
+		for (auto& other : torrents)
+		{
+			if (other == torrent || !other->filesChecked() || other->seedMode())
+				continue;
+
+			auto& otherInfo = other->infoFile.info;
+			auto& otherSelection = other->files.selection.files;
+
+			//every same sized file is candidate, storage tries them in order until content matches
+			for (uint32_t j = 0; j < otherInfo.files.size(); j++)
+			{
+				auto& otherFile = otherInfo.files[j];
+
+				if (otherFile.size != file.size || j >= otherSelection.size() || !otherSelection[j].selected)
+					continue;
+
+				bool complete = true;
+				for (auto idx = otherFile.startPieceIndex; idx <= otherFile.endPieceIndex && complete; idx++)
+					complete = other->files.progress.hasPiece(idx);
+
+				if (!complete)
+					continue;
+
+				//same pieces inside the file, no need to read it
+				if (otherInfo.pieceSize == info.pieceSize && otherFile.startPiecePos == file.startPiecePos)
+				{
+					bool matching = true;
+					uint32_t compared = 0;
+					for (uint32_t k = file.startPiecePos ? 1 : 0; file.startPieceIndex + k < file.endPieceIndex && matching; k++, compared++)
+						matching = memcmp(info.pieces[file.startPieceIndex + k].hash, otherInfo.pieces[otherFile.startPieceIndex + k].hash, 20) == 0;
+
+					//without whole piece inside there is nothing proving same content
+					if (!matching || compared == 0)
+						continue;
+				}
+
+				out.push_back({ i, other->files.storage.getFilePath(j) });
+			}
+		}
+	}
+
+	return out;
+}
+
@@ -25,7 +25,8 @@ namespace mtt
 		void init();
 		void deinit();
 
-		TorrentPtr addFile(const char* filename);
+		//in seed mode data is expected to be complete and gets verified while seeding, instead of checking it first
+		TorrentPtr addFile(const char* filename, bool seedMode = false);
 		TorrentPtr addMagnet(const char* magnet);
 
 		TorrentPtr getTorrent(const uint8_t* hash);
@@ -35,5 +36,8 @@ namespace mtt
 	private:
 
 		void saveTorrentFile(TorrentPtr t);
+
+		//files of torrent complete in other torrents, by size and piece hashes where aligned same way
+		std::vector<ReusableFile> findReusableFiles(TorrentPtr t);
 	};
 }
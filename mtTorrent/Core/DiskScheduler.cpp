@@ -0,0 +1,132 @@
+#include "DiskScheduler.h"
+#include "Configuration.h"
+#include <algorithm>
+
+static thread_local uint32_t runningJobs = 0;
+
+mtt::DiskScheduler& mtt::DiskScheduler::get()
+{
+	static DiskScheduler scheduler;
+
+	return scheduler;
+}
+
+mtt::DiskScheduler::Job::Job(DiskJobClass t) : type(t), nested(runningJobs > 0), queued(std::chrono::steady_clock::now())
+{
+	//slot of outer job is already taken, waiting for another one could block all of them
+	if (!nested)
+		DiskScheduler::get().start(type);
+
+	runningJobs++;
+}
+
+mtt::DiskScheduler::Job::~Job()
+{
+	runningJobs--;
+
+	if (!nested)
+		DiskScheduler::get().finish(type, queued);
+}
+
+void mtt::DiskScheduler::start(DiskJobClass type)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	auto ticket = nextTicket++;
+	auto& state = classes[(size_t)type];
+
+	//idle class doesnt get credit for time it wasnt waiting
+	if (state.waiting.empty())
+		state.virtualTime = std::max(state.virtualTime, virtualTime);
+
+	state.waiting.push_back(ticket);
+	dispatch();
+
+	cv.wait(lock, [this, ticket]() { return granted.count(ticket) != 0; });
+	granted.erase(ticket);
+}
+
+void mtt::DiskScheduler::finish(DiskJobClass type, std::chrono::steady_clock::time_point queued)
+{
+	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - queued).count();
+
+	uint32_t bucket = 0;
+	while (bucket + 1 < DiskJobStats::BucketsCount && duration >= (1ll << bucket))
+		bucket++;
+
+	std::lock_guard<std::mutex> guard(mutex);
+
+	auto& stats = classes[(size_t)type].stats;
+	stats.jobs++;
+	stats.latency[bucket]++;
+
+	running--;
+	dispatch();
+}
+
+void mtt::DiskScheduler::dispatch()
+{
+	auto& settings = mtt::config::internal_.storage;
+	bool notify = false;
+
+	while (running < std::max(1u, settings.maxDiskJobs))
+	{
+		ClassState* next = nullptr;
+
+		for (size_t i = 0; i < classes.size(); i++)
+		{
+			if (!classes[i].waiting.empty() && (!next || classes[i].virtualTime < next->virtualTime))
+				next = &classes[i];
+		}
+
+		if (!next)
+			break;
+
+		auto share = settings.diskJobShares[next - classes.data()];
+		virtualTime = next->virtualTime;
+		next->virtualTime += 1.0 / std::max(1u, share);
+
+		granted.insert(next->waiting.front());
+		next->waiting.pop_front();
+		running++;
+		notify = true;
+	}
+
+	if (notify)
+		cv.notify_all();
+}
+
+bool mtt::DiskScheduler::startCheck(const bool& cancelled)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (runningChecks >= std::max(1u, mtt::config::internal_.storage.maxConcurrentChecks))
+	{
+		cv.wait_for(lock, std::chrono::milliseconds(100));
+
+		if (cancelled)
+			return false;
+	}
+
+	runningChecks++;
+
+	return true;
+}
+
+void mtt::DiskScheduler::finishCheck()
+{
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+
+		runningChecks--;
+	}
+
+	cv.notify_all();
+}
+
+mtt::DiskJobStats mtt::DiskScheduler::getStats(DiskJobClass type)
+{
+	std::lock_guard<std::mutex> guard(mutex);
+
+	return classes[(size_t)type].stats;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+namespace mtt
+{
+	enum class DiskJobClass
+	{
+		//read someone is waiting for right now, as hash check of just downloaded mapped piece
+		InteractiveRead,
+		UploadRead,
+		DownloadWrite,
+		CheckRead,
+		Preallocation,
+		//copying files of moved storage
+		Relocation,
+		Count
+	};
+
+	struct DiskJobStats
+	{
+		static const uint32_t BucketsCount = 14;
+
+		uint64_t jobs = 0;
+		//queued and running time, bucket i counts jobs under 2^i ms, last one everything longer
+		std::array<uint64_t, BucketsCount> latency = {};
+	};
+
+	/*
+	Admission of disk operations of all torrents. Limited count of jobs runs at once, when disk is busy
+	free slots go to waiting classes by their configured share. Job started inside another job on the same thread runs right away.
+	*/
+	class DiskScheduler
+	{
+	public:
+
+		static DiskScheduler& get();
+
+		//scope of single disk operation, blocks until it can run
+		class Job
+		{
+		public:
+
+			Job(DiskJobClass type);
+			~Job();
+
+		private:
+
+			DiskJobClass type;
+			bool nested;
+			std::chrono::steady_clock::time_point queued;
+		};
+
+		//limits torrents checking stored pieces at once, false when cancelled while waiting
+		bool startCheck(const bool& cancelled);
+		void finishCheck();
+
+		DiskJobStats getStats(DiskJobClass type);
+
+	private:
+
+		void start(DiskJobClass type);
+		void finish(DiskJobClass type, std::chrono::steady_clock::time_point queued);
+		void dispatch();
+
+		std::mutex mutex;
+		std::condition_variable cv;
+
+		struct ClassState
+		{
+			std::deque<uint64_t> waiting;
+			//served jobs weighted by share, lowest waiting class goes next
+			double virtualTime = 0;
+			DiskJobStats stats;
+		};
+		std::array<ClassState, (size_t)DiskJobClass::Count> classes;
+
+		std::set<uint64_t> granted;
+		uint64_t nextTicket = 0;
+		uint32_t running = 0;
+		double virtualTime = 0;
+
+		uint32_t runningChecks = 0;
+	};
+}
@@ -3,6 +3,8 @@
 #include "Torrent.h"
 #include "utils/HexEncoding.h"
 #include "Configuration.h"
+#include "State.h"
+#include "MemoryGovernor.h"
 
 #define DL_LOG(x) WRITE_LOG(LogTypeDownload, x)
 
@@ -11,23 +13,110 @@ const uint32_t MinPendingPeerRequestsBeforeNext = 5;
 const uint32_t MaxPendingPeerRequests = 10;
 const uint32_t MaxPendingPeerRequestsToSpeedRatio = (1024*1024);
 
-mtt::Downloader::Downloader(TorrentPtr t)
+mtt::Downloader::Downloader(TorrentPtr t) : throttled(false)
 {
 	torrent = t;
 
 	log.init("requests");
 }
 
+mtt::Downloader::~Downloader()
+{
+	reset();
+}
+
 void mtt::Downloader::reset()
 {
 	std::lock_guard<std::mutex> guard(requestsMutex);
+
+	for (auto& r : requests)
+		releaseMemory(r);
+
 	requests.clear();
 }
 
+bool mtt::Downloader::wasThrottled()
+{
+	return throttled.exchange(false);
+}
+
+void mtt::Downloader::releaseMemory(RequestInfo& r)
+{
+	if (r.reserved)
+		MemoryGovernor::get().release(MemoryCategory::DownloadPieces, r.reserved);
+
+	r.reserved = 0;
+}
+
+void mtt::Downloader::saveUnfinishedPieces()
+{
+	UnfinishedPiecesState state;
+
+	{
+		std::lock_guard<std::mutex> guard(requestsMutex);
+
+		for (auto& r : requests)
+		{
+			if (r.piece && r.piece->remainingBlocks < r.blocksCount)
+				state.pieces.push_back(r.piece);
+		}
+	}
+
+	state.saveState(torrent->hashString());
+}
+
+void mtt::Downloader::loadUnfinishedPieces()
+{
+	UnfinishedPiecesState state;
+
+	if (!state.loadState(torrent->hashString()))
+		return;
+
+	auto& info = torrent->infoFile.info;
+
+	std::lock_guard<std::mutex> guard(requestsMutex);
+
+	for (auto& piece : state.pieces)
+	{
+		if (piece->index >= info.pieces.size() || !torrent->files.progress.wantedPiece(piece->index))
+			continue;
+
+		if (piece->blocksTodo.size() != info.getPieceBlocksCount(piece->index))
+			continue;
+
+		//buffered piece can continue even when storage is mapped now, mapped one only if its data is still there
+		if (piece->mapped ? !torrent->files.storage.isPieceMapped(piece->index) : piece->data.size() != info.getPieceSize(piece->index))
+			continue;
+
+		bool exists = false;
+		for (auto& r : requests)
+			exists |= r.pieceIdx == piece->index;
+
+		if (exists)
+			continue;
+
+		RequestInfo request;
+		request.pieceIdx = piece->index;
+		request.piece = piece;
+		request.blocksCount = (uint16_t)piece->blocksTodo.size();
+		request.resumed = true;
+
+		//already loaded in memory
+		if (!piece->mapped)
+		{
+			request.reserved = (uint32_t)piece->data.size();
+			MemoryGovernor::get().forceReserve(MemoryCategory::DownloadPieces, request.reserved);
+		}
+
+		requests.push_back(request);
+	}
+}
+
 mtt::Downloader::PieceStatus mtt::Downloader::pieceBlockReceived(PieceBlock& block)
 {
 	bool valid = true;
 	bool finished = false;
+	bool blockValid = true;
 
 	{
 		std::lock_guard<std::mutex> guard(requestsMutex);
@@ -36,13 +125,21 @@ mtt::Downloader::PieceStatus mtt::Downloader::pieceBlockReceived(PieceBlock& blo
 		{
 			if (r.pieceIdx == block.info.index)
 			{
+				if (!r.blockHashes.empty() && !checkBlock(r, block.info.begin, block.data.data(), block.info.length))
+				{
+					blockValid = false;
+					break;
+				}
+
 				if (!r.piece)
 				{
 					r.piece = std::make_shared<DownloadedPiece>();
+					r.piece->mapped = torrent->files.storage.isPieceMapped(r.pieceIdx);
 					r.piece->init(r.pieceIdx, torrent->infoFile.info.getPieceSize(r.pieceIdx), r.blocksCount);
 				}
 
-				r.piece->addBlock(block);
+				if (r.piece->addBlock(block) && r.piece->mapped)
+					torrent->files.storage.writeMappedBlock(block);
 
 				if (r.piece->remainingBlocks == 0)
 				{
@@ -56,6 +153,12 @@ mtt::Downloader::PieceStatus mtt::Downloader::pieceBlockReceived(PieceBlock& blo
 
 	LOG_APPEND("receive " << block.info.index << " " << block.info.begin);
 
+	if (!blockValid)
+	{
+		DL_LOG("Invalid block " << block.info.index << " " << block.info.begin);
+		return BlockInvalid;
+	}
+
 	if (valid && finished && torrent->selectionFinished())
 		onFinish();
 
@@ -71,7 +174,7 @@ void mtt::Downloader::removeBlockRequests(std::vector<mtt::ActivePeer>& peers, P
 	{
 		if (peer.comm == source)
 		{
-			if (status == Invalid)
+			if (status == Invalid || status == BlockInvalid)
 				peer.invalidPieces++;
 			else
 				peer.receivedBlocks++;
@@ -133,38 +236,44 @@ std::vector<uint32_t> mtt::Downloader::getBestNextPieces(ActivePeer* p)
 	std::vector<uint32_t> out;
 	std::vector<uint32_t> requestedElsewhere;
 
-	for(uint32_t idx = 0; idx < p->comm->info.pieces.pieces.size(); idx++)
+	auto& peerPieces = p->comm->info.pieces.pieces;
+	auto& progress = torrent->files.progress;
+
+	for (size_t idx = Bitset::nextInteresting(peerPieces, progress.pieces, progress.selectedPieces, 0); idx != Bitset::npos; idx = Bitset::nextInteresting(peerPieces, progress.pieces, progress.selectedPieces, idx + 1))
 	{
-		if (p->comm->info.pieces.pieces[idx])
+		bool alreadyRequested = false;
+		for (auto& r : p->requestedPieces)
 		{
-			if (torrent->files.progress.wantedPiece(idx))
-			{
-				bool alreadyRequested = false;
-				for (auto& r : p->requestedPieces)
-				{
-					if (r.idx == idx)
-						alreadyRequested = true;
-				}
+			if (r.idx == idx)
+				alreadyRequested = true;
+		}
 
-				if (!alreadyRequested)
+		if (!alreadyRequested)
+		{
+			std::lock_guard<std::mutex> guard(requestsMutex);
+			for (auto& r : requests)
+			{
+				if (r.pieceIdx == idx)
 				{
-					std::lock_guard<std::mutex> guard(requestsMutex);
-					for (auto& r : requests)
+					//resumed piece goes first to first peer which has it
+					if (r.resumed)
 					{
-						if (r.pieceIdx == idx)
-						{
-							if (requestedElsewhere.size() + out.size() < MaxPreparedPieces)
-								requestedElsewhere.push_back(idx);
-
-							alreadyRequested = true;
-							break;
-						}
+						r.resumed = false;
+						out.insert(out.begin(), (uint32_t)idx);
+						alreadyRequested = true;
+						break;
 					}
 
-					if(!alreadyRequested)
-						out.push_back(idx);
+					if (requestedElsewhere.size() + out.size() < MaxPreparedPieces)
+						requestedElsewhere.push_back((uint32_t)idx);
+
+					alreadyRequested = true;
+					break;
 				}
 			}
+
+			if(!alreadyRequested)
+				out.push_back((uint32_t)idx);
 		}
 
 		if(out.size() >= MaxPreparedPieces)
@@ -215,11 +324,32 @@ void mtt::Downloader::sendPieceRequests(ActivePeer* p)
 
 			if (!request)
 			{
+				uint32_t reserved = 0;
+
+				//mapped piece is received directly to file
+				if (!torrent->files.storage.isPieceMapped(currentPiece.idx))
+				{
+					reserved = torrent->infoFile.info.getPieceSize(currentPiece.idx);
+
+					//new piece waits for memory while others are in progress, first one always goes
+					if (!MemoryGovernor::get().reserve(MemoryCategory::DownloadPieces, reserved))
+					{
+						if (!requests.empty())
+						{
+							throttled = true;
+							continue;
+						}
+
+						MemoryGovernor::get().forceReserve(MemoryCategory::DownloadPieces, reserved);
+					}
+				}
+
 				//DL_LOG("Request add " << currentPiece.idx);
 				requests.push_back(RequestInfo());
 				request = &requests.back();
 				request->pieceIdx = currentPiece.idx;
 				request->blocksCount = (uint16_t)torrent->infoFile.info.getPieceBlocksCount(currentPiece.idx);
+				request->reserved = reserved;
 			}
 
 			count += sendPieceRequests(p, &currentPiece, request, maxRequests - count);
@@ -234,6 +364,9 @@ uint32_t mtt::Downloader::sendPieceRequests(ActivePeer* peer, ActivePeer::Reques
 {
 	uint32_t count = 0;
 
+	if (r->blockHashes.empty() && !r->hashesRequested)
+		requestHashes(peer, r);
+
 	uint16_t nextBlock = r->nextBlockRequestIdx;
 	for (uint32_t i = 0; i < r->blocksCount; i++)
 	{
@@ -265,7 +398,8 @@ bool mtt::Downloader::pieceFinished(RequestInfo* r)
 {
 	DL_LOG("Finished piece " << r->pieceIdx);
 
-	bool valid = r->piece->isValid(torrent->infoFile.info.pieces[r->pieceIdx].hash);
+	auto& info = torrent->infoFile.info;
+	bool valid = r->piece->mapped ? torrent->files.storage.checkMappedPiece(r->pieceIdx, info.getPieceSize(r->pieceIdx), info.pieces[r->pieceIdx].hash) : r->piece->isValid(info.pieces[r->pieceIdx].hash);
 
 	if (valid)
 		torrent->files.addPiece(*r->piece.get());
@@ -275,6 +409,7 @@ bool mtt::Downloader::pieceFinished(RequestInfo* r)
 		if (it->pieceIdx == r->pieceIdx)
 		{
 			//DL_LOG("Request rem " << r->pieceIdx);
+			releaseMemory(*it);
 			requests.erase(it);
 			break;
 		}
@@ -283,7 +418,115 @@ bool mtt::Downloader::pieceFinished(RequestInfo* r)
 	return valid;
 }
 
+void mtt::Downloader::requestHashes(ActivePeer* peer, RequestInfo* r)
+{
+	auto& info = torrent->infoFile.info;
+
+	if (info.piecesV2.empty() || !peer->comm->info.supportsV2())
+		return;
+
+	auto& piece = info.piecesV2[r->pieceIdx];
+
+	//single block is checked by piece hash anyway
+	if (piece.leavesCount < 2)
+		return;
+
+	PeerMessage::HashesInfo request;
+	memcpy(request.piecesRoot, piece.piecesRoot, 32);
+	request.baseLayer = 0;
+	request.index = piece.firstLeaf;
+	request.length = piece.leavesCount;
+	request.proofLayers = 0;
+
+	peer->comm->requestHashes(request);
+	r->hashesRequested = true;
+}
+
+void mtt::Downloader::hashesReceived(PeerMessage::HashesInfo& msg)
+{
+	auto& info = torrent->infoFile.info;
+
+	if (info.piecesV2.empty() || msg.baseLayer != 0 || msg.hashes.size() != (size_t)msg.length * 32)
+		return;
+
+	std::lock_guard<std::mutex> guard(requestsMutex);
+
+	for (auto& r : requests)
+	{
+		auto& piece = info.piecesV2[r.pieceIdx];
+
+		if (!r.blockHashes.empty() || piece.leavesCount != msg.length || piece.firstLeaf != msg.index || memcmp(piece.piecesRoot, msg.piecesRoot, 32) != 0)
+			continue;
+
+		std::vector<MerkleTree::Hash> hashes(msg.length);
+		for (uint32_t i = 0; i < msg.length; i++)
+			memcpy(hashes[i].data(), msg.hashes.data() + i * 32, 32);
+
+		//wrong hashes, someone else can be asked
+		if (memcmp(MerkleTree::getRoot(hashes, piece.leavesCount).data(), piece.hash, 32) != 0)
+		{
+			r.hashesRequested = false;
+			break;
+		}
+
+		r.blockHashes = std::move(hashes);
+
+		//blocks received before hashes, mapped ones are left for piece check
+		if (r.piece && !r.piece->mapped)
+		{
+			for (uint32_t i = 0; i < r.piece->blocksTodo.size(); i++)
+			{
+				auto begin = i * BlockRequestMaxSize;
+
+				if (r.piece->blocksTodo[i] && !checkBlock(r, begin, r.piece->data.data() + begin, std::min<uint32_t>(BlockRequestMaxSize, (uint32_t)r.piece->data.size() - begin)))
+				{
+					DL_LOG("Invalid block " << r.pieceIdx << " " << begin);
+					r.piece->blocksTodo[i] = 0;
+					r.piece->remainingBlocks++;
+				}
+			}
+		}
+
+		break;
+	}
+}
+
+void mtt::Downloader::hashesRejected(PeerMessage::HashesInfo& msg)
+{
+	auto& info = torrent->infoFile.info;
+
+	if (info.piecesV2.empty())
+		return;
+
+	std::lock_guard<std::mutex> guard(requestsMutex);
+
+	for (auto& r : requests)
+	{
+		auto& piece = info.piecesV2[r.pieceIdx];
+
+		if (piece.firstLeaf == msg.index && memcmp(piece.piecesRoot, msg.piecesRoot, 32) == 0)
+			r.hashesRequested = false;
+	}
+}
+
+bool mtt::Downloader::checkBlock(RequestInfo& r, uint32_t begin, const uint8_t* data, uint32_t length)
+{
+	auto& piece = torrent->infoFile.info.piecesV2[r.pieceIdx];
+	auto leaf = begin / MerkleTree::BlockSize;
+
+	//padding after end of file
+	if (begin >= piece.dataSize)
+		return true;
+
+	if (leaf >= r.blockHashes.size() || length < std::min(MerkleTree::BlockSize, piece.dataSize - begin))
+		return false;
+
+	return MerkleTree::hashBlock(data, std::min(MerkleTree::BlockSize, piece.dataSize - begin)) == r.blockHashes[leaf];
+}
+
 void mtt::Downloader::onFinish()
 {
-	torrent->files.storage.flush();
+	auto syncStatus = torrent->files.storage.sync(true);
+	if (syncStatus != Status::Success)
+		torrent->lastError = syncStatus;
 }
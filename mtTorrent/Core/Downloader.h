@@ -3,6 +3,8 @@
 #include "Storage.h"
 #include "IPeerListener.h"
 #include "LogFile.h"
+#include "utils/MerkleTree.h"
+#include <atomic>
 
 namespace mtt
 {
@@ -35,14 +37,27 @@ namespace mtt
 	public:
 
 		Downloader(TorrentPtr);
+		~Downloader();
 
-		enum PieceStatus {Ok, Invalid, Finished};
+		//BlockInvalid when block doesnt match v2 hashes, only that block is requested again
+		enum PieceStatus {Ok, Invalid, Finished, BlockInvalid};
 		PieceStatus pieceBlockReceived(PieceBlock& block);
 		void removeBlockRequests(std::vector<ActivePeer>& peers, PieceBlock& block, PieceStatus status, PeerCommunication* source);
 		void evaluateNextRequests(ActivePeer*);
 
+		//BEP 52 block hashes of requested pieces
+		void hashesReceived(PeerMessage::HashesInfo&);
+		void hashesRejected(PeerMessage::HashesInfo&);
+
 		void reset();
 
+		//true once after new pieces were postponed by memory budget, their peers need evaluation again
+		bool wasThrottled();
+
+		//unfinished pieces are kept in state folder while stopped
+		void saveUnfinishedPieces();
+		void loadUnfinishedPieces();
+
 	private:
 
 		struct RequestInfo
@@ -51,14 +66,25 @@ namespace mtt
 			std::shared_ptr<DownloadedPiece> piece;
 			uint16_t nextBlockRequestIdx = 0;
 			uint16_t blocksCount = 0;
+			//loaded from saved state, not requested from anyone yet
+			bool resumed = false;
+			//verified leaves of v2 piece, each block is checked when received
+			std::vector<MerkleTree::Hash> blockHashes;
+			bool hashesRequested = false;
+			//piece buffer counted in MemoryGovernor
+			uint32_t reserved = 0;
 		};
 		std::vector<RequestInfo> requests;
 		std::mutex requestsMutex;
+		std::atomic<bool> throttled;
+		void releaseMemory(RequestInfo&);
 
 		std::vector<uint32_t> getBestNextPieces(ActivePeer*);
 		void sendPieceRequests(ActivePeer*);
 		uint32_t sendPieceRequests(ActivePeer*,ActivePeer::RequestedPiece*, RequestInfo*, uint32_t max);
 		bool pieceFinished(RequestInfo*);
+		void requestHashes(ActivePeer*, RequestInfo*);
+		bool checkBlock(RequestInfo&, uint32_t begin, const uint8_t* data, uint32_t length);
 
 		TorrentPtr torrent;
 
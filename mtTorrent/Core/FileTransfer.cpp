@@ -23,6 +23,8 @@ mtt::FileTransfer::FileTransfer(TorrentPtr t) : downloader(t), uploader(t), torr
 
 void mtt::FileTransfer::start()
 {
+	downloader.loadUnfinishedPieces();
+
 	torrent->peers->start([this](Status s, mtt::PeerSource)
 		{
 			if (s == Status::Success)
@@ -35,8 +37,22 @@ void mtt::FileTransfer::start()
 	refreshTimer = ScheduledTimer::create(torrent->service.io, [this]
 		{
 			evalCurrentPeers();
+
+			{
+				std::lock_guard<std::mutex> guard(peersMutex);
+				uploader.refreshChoking(activePeers);
+			}
+
+			if (downloader.wasThrottled())
+				reevaluate();
+
 			updateMeasures();
 
+			//data not reaching disk is shown as torrent error
+			auto syncStatus = torrent->files.storage.sync(false);
+			if (syncStatus != Status::Success)
+				torrent->lastError = syncStatus;
+
 			refreshTimer->schedule(1);
 		}
 	);
@@ -47,8 +63,12 @@ void mtt::FileTransfer::start()
 void mtt::FileTransfer::stop()
 {
 	torrent->peers->stop();
+	downloader.saveUnfinishedPieces();
 	downloader.reset();
-	torrent->files.storage.flush();
+	uploader.reset();
+	auto syncStatus = torrent->files.storage.sync(true);
+	if (syncStatus != Status::Success)
+		torrent->lastError = syncStatus;
 
 	if(refreshTimer)
 		refreshTimer->disable();
@@ -113,12 +133,24 @@ void mtt::FileTransfer::messageReceived(PeerCommunication* p, PeerMessage& msg)
 	}
 	else if (msg.id == Request)
 	{
-		if (uploader.pieceRequest(p, msg.request))
-		{
-			std::lock_guard<std::mutex> guard(peersMutex);
-			if (auto peer = getActivePeer(p))
-				peer->uploaded += msg.request.length;
-		}
+		uploader.pieceRequest(p, msg.request);
+	}
+	else if (msg.id == Cancel)
+	{
+		uploader.cancelRequest(p, msg.request);
+	}
+	else if (msg.id == Hashes)
+	{
+		downloader.hashesReceived(msg.hashes);
+	}
+	else if (msg.id == HashReject)
+	{
+		downloader.hashesRejected(msg.hashes);
+	}
+	else if (msg.id == HashRequest)
+	{
+		//only piece layers are kept, block hashes would need whole piece read
+		p->rejectHashes(msg.hashes);
 	}
 }
 
@@ -139,6 +171,11 @@ void mtt::FileTransfer::progressUpdated(PeerCommunication* p)
 	evaluateNextRequests(p);
 }
 
+void mtt::FileTransfer::sendQueueLow(PeerCommunication* p)
+{
+	uploader.sendQueueLow(p);
+}
+
 size_t mtt::FileTransfer::getUploadSum()
 {
 	return uploader.uploaded;
@@ -240,6 +277,7 @@ void mtt::FileTransfer::removePeer(PeerCommunication * p)
 		}
 	}
 
+	uploader.removePeer(p);
 	evaluateCurrentPeers();
 }
 
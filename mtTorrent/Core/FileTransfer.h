@@ -27,6 +27,7 @@ namespace mtt
 		virtual void metadataPieceReceived(PeerCommunication*, ext::UtMetadata::Message&) override;
 		virtual void pexReceived(PeerCommunication*, ext::PeerExchange::Message&) override;
 		virtual void progressUpdated(PeerCommunication*) override;
+		virtual void sendQueueLow(PeerCommunication*) override;
 
 		size_t getDownloadSpeed();
 		size_t getUploadSum();
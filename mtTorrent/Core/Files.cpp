@@ -3,8 +3,8 @@
 
 void mtt::Files::init(TorrentInfo& info)
 {
-	storage.init(info);
 	storage.setPath(mtt::config::external.defaultDirectory);
+	storage.init(info);
 
 	for (auto& f : info.files)
 	{
@@ -17,7 +17,9 @@ void mtt::Files::init(TorrentInfo& info)
 void mtt::Files::addPiece(DownloadedPiece& piece)
 {
 	progress.addPiece(piece.index);
-	storage.storePiece(piece);
+
+	if (!discardData)
+		storage.storePiece(piece);
 
 	freshPieces.push_back(piece.index);
 }
@@ -28,7 +30,7 @@ void mtt::Files::select(DownloadSelection& s)
 	progress.select(selection);
 }
 
-mtt::Status mtt::Files::prepareSelection()
+std::shared_ptr<mtt::PreallocationState> mtt::Files::prepareSelection(boost::asio::io_service& io, std::function<void(std::shared_ptr<PreallocationState>)> onFinish)
 {
-	return storage.preallocateSelection(selection);
+	return storage.preallocateSelectionAsync(selection, io, onFinish);
 }
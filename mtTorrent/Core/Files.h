@@ -13,12 +13,15 @@ namespace mtt
 		void init(TorrentInfo&);
 		void addPiece(DownloadedPiece& piece);
 		void select(DownloadSelection&);
-		Status prepareSelection();
+		std::shared_ptr<PreallocationState> prepareSelection(boost::asio::io_service& io, std::function<void(std::shared_ptr<PreallocationState>)> onFinish);
 
 		PiecesProgress progress;
 		DownloadSelection selection;
 		Storage storage;
 
 		std::vector<uint32_t> freshPieces;
+
+		//only progress is kept, for simulated torrents without disk access
+		bool discardData = false;
 	};
 }
@@ -19,5 +19,6 @@ namespace mtt
 		virtual void metadataPieceReceived(PeerCommunication*, ext::UtMetadata::Message&) = 0;
 		virtual void pexReceived(PeerCommunication*, ext::PeerExchange::Message&) = 0;
 		virtual void progressUpdated(PeerCommunication*) = 0;
+		virtual void sendQueueLow(PeerCommunication*) = 0;
 	};
 }
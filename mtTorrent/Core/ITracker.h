@@ -14,6 +14,9 @@ namespace mtt
 
 		TrackerInfo info;
 
+		//hybrid torrent is announced once more with truncated v2 hash, peers of v2 swarm know only that one
+		bool announcingV2 = false;
+
 		std::function<void()> onFail;
 		std::function<void(AnnounceResponse&)> onAnnounceResult;
 
@@ -17,22 +17,28 @@ bool DownloadedPiece::isValid(const uint8_t* expectedHash)
 
 void mtt::DownloadedPiece::init(uint32_t idx, uint32_t pieceSize, uint32_t blocksCount)
 {
-	data.resize(pieceSize);
+	if (!mapped)
+		data.resize(pieceSize);
 	remainingBlocks = blocksCount;
 	blocksTodo.resize(remainingBlocks, 0);
 	index = idx;
 }
 
-void DownloadedPiece::addBlock(PieceBlock& block)
+bool DownloadedPiece::addBlock(PieceBlock& block)
 {
 	auto blockIdx = (block.info.begin + 1)/ BlockRequestMaxSize;
 
 	if (blockIdx < blocksTodo.size() && blocksTodo[blockIdx] == 0)
 	{
-		memcpy(&data[0] + block.info.begin, block.data.data(), block.info.length);
+		if (!mapped)
+			memcpy(&data[0] + block.info.begin, block.data.data(), block.info.length);
 		blocksTodo[blockIdx] = 1;
 		remainingBlocks--;
+
+		return true;
 	}
+
+	return false;
 }
 
 static bool parseTorrentHash(std::string& from, uint8_t* to)
@@ -132,9 +138,22 @@ std::string mtt::TorrentFileInfo::createTorrentFileData()
 		writer.endArray();
 	}
 
+	if (!infoData.empty())
+	{
+		writer.data += "4:info" + infoData;
+
+		if (!pieceLayers.empty())
+			writer.data += "12:piece layers" + pieceLayers;
+
+		writer.endMap();
+
+		return writer.data;
+	}
+
 	writer.startRawMapItem("4:info");
 
-	if (info.files.size() > 1)
+	//single file in directory still needs its path
+	if (info.files.size() > 1 || (info.files.size() == 1 && info.files.front().path.size() > 1))
 	{
 		writer.startRawArrayItem("5:files");
 
@@ -32,6 +32,20 @@ namespace mtt
 		uint8_t hash[20];
 	};
 
+	//BEP 52 hash of piece in hybrid torrent
+	struct PieceInfoV2
+	{
+		//root of merkle subtree of piece blocks
+		uint8_t hash[32];
+		//power of two count of leaves under hash, 0 when piece has no v2 hash
+		uint32_t leavesCount = 0;
+		//first leaf of piece in its file tree
+		uint32_t firstLeaf = 0;
+		//bytes of file data in piece, rest is padding
+		uint32_t dataSize = 0;
+		uint8_t piecesRoot[32];
+	};
+
 	struct PieceBlockInfo
 	{
 		uint32_t index;
@@ -60,6 +74,12 @@ namespace mtt
 		uint32_t lastPieceSize = 0;
 		uint32_t lastPieceLastBlockIndex = 0;
 		uint32_t lastPieceLastBlockSize = 0;
+
+		//hybrid v1/v2 torrent, empty otherwise
+		std::vector<PieceInfoV2> piecesV2;
+		//SHA-256 of info dictionary, first 20 bytes identify v2 swarm
+		uint8_t hashV2[32];
+		bool hasV2 = false;
 	};
 
 	struct TorrentFileInfo
@@ -69,6 +89,10 @@ namespace mtt
 
 		TorrentInfo info;
 
+		//original info dictionary and piece layers, v2 keys are not generated
+		std::string infoData;
+		std::string pieceLayers;
+
 		Status parseMagnetLink(std::string link);
 		std::string createTorrentFileData();
 	};
@@ -103,9 +127,12 @@ namespace mtt
 		uint32_t index = -1;
 		uint32_t remainingBlocks = 0;
 		std::vector<uint8_t> blocksTodo;
+		//blocks are written straight to storage mapping, data stays empty
+		bool mapped = false;
 
 		void init(uint32_t idx, uint32_t pieceSize, uint32_t blocksCount);
-		void addBlock(PieceBlock& block);
+		//returns false for already received block
+		bool addBlock(PieceBlock& block);
 		bool isValid(const uint8_t* expectedHash);
 	};
 
@@ -151,6 +178,51 @@ namespace mtt
 		std::vector<uint8_t> pieces;
 	};
 
+	//cheap identity of file on disk, used to skip recheck of untouched files
+	struct FileFingerprint
+	{
+		uint64_t size = 0;
+		uint64_t modified = 0;
+
+		bool operator==(const FileFingerprint& r) const
+		{
+			return size == r.size && modified == r.modified;
+		}
+	};
+
+	//file with same size and content in storage of other torrent
+	struct ReusableFile
+	{
+		uint32_t fileIdx;
+		std::string sourcePath;
+	};
+
+	enum class PreallocationMode
+	{
+		//file gets its size at first write, without reserving disk space
+		Sparse,
+		//disk space reserved by filesystem without writing
+		Full,
+		//whole file written with zeros
+		ZeroFill
+	};
+
+	struct PreallocationState
+	{
+		uint64_t bytesCount = 0;
+		std::atomic<uint64_t> bytesDone = 0;
+		bool rejected = false;
+		Status result = Status::Success;
+	};
+
+	struct RelocationState
+	{
+		uint64_t bytesCount = 0;
+		std::atomic<uint64_t> bytesDone = 0;
+		bool rejected = false;
+		Status result = Status::Success;
+	};
+
 	enum class PeerSource
 	{
 		Tracker,
@@ -0,0 +1,81 @@
+#include "MemoryGovernor.h"
+#include "Configuration.h"
+
+mtt::MemoryGovernor& mtt::MemoryGovernor::get()
+{
+	static MemoryGovernor governor;
+
+	return governor;
+}
+
+mtt::MemoryGovernor::MemoryGovernor() : total(0)
+{
+	for (auto& u : usage)
+		u = 0;
+}
+
+bool mtt::MemoryGovernor::reserve(MemoryCategory type, uint64_t size)
+{
+	auto limit = getLimit(type);
+	auto current = total.load();
+
+	do
+	{
+		if (limited() && current + size > limit)
+			return false;
+	}
+	while (!total.compare_exchange_weak(current, current + size));
+
+	usage[(size_t)type] += size;
+
+	return true;
+}
+
+void mtt::MemoryGovernor::forceReserve(MemoryCategory type, uint64_t size)
+{
+	total += size;
+	usage[(size_t)type] += size;
+}
+
+void mtt::MemoryGovernor::release(MemoryCategory type, uint64_t size)
+{
+	usage[(size_t)type] -= size;
+	total -= size;
+}
+
+bool mtt::MemoryGovernor::hasSpace(MemoryCategory type, uint64_t size) const
+{
+	return !limited() || total + size <= getLimit(type);
+}
+
+bool mtt::MemoryGovernor::overBudget() const
+{
+	auto budget = mtt::config::internal_.memory.budget;
+
+	return budget && total >= budget;
+}
+
+uint64_t mtt::MemoryGovernor::getUsage(MemoryCategory type) const
+{
+	return usage[(size_t)type];
+}
+
+uint64_t mtt::MemoryGovernor::getUsage() const
+{
+	return total;
+}
+
+bool mtt::MemoryGovernor::limited() const
+{
+	return mtt::config::internal_.memory.budget != 0;
+}
+
+uint64_t mtt::MemoryGovernor::getLimit(MemoryCategory type) const
+{
+	auto budget = mtt::config::internal_.memory.budget;
+
+	if (type == MemoryCategory::ReadCache)
+		return budget * mtt::config::internal_.memory.cacheShare / 100;
+
+	return budget;
+}
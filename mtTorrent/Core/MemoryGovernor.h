@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace mtt
+{
+	enum class MemoryCategory
+	{
+		//buffers of pieces being downloaded
+		DownloadPieces,
+		//pieces loaded for peers being served
+		UploadPieces,
+		//pieces kept in storage cache for next reads
+		ReadCache,
+		//downloaded pieces waiting for batch write
+		WriteCache,
+		Count
+	};
+
+	/*
+	Session wide budget of piece buffers of all torrents. Buffers which can wait (new piece requests, uploads, cache) reserve
+	their size before allocation and are postponed or skipped when budget is used, data already received is always accepted.
+	*/
+	class MemoryGovernor
+	{
+	public:
+
+		static MemoryGovernor& get();
+
+		//false when it would go over budget, nothing is reserved then
+		bool reserve(MemoryCategory type, uint64_t size);
+		//counted even over budget, for data which cant be dropped
+		void forceReserve(MemoryCategory type, uint64_t size);
+		void release(MemoryCategory type, uint64_t size);
+
+		//reserve would succeed now
+		bool hasSpace(MemoryCategory type, uint64_t size) const;
+
+		bool overBudget() const;
+
+		uint64_t getUsage(MemoryCategory type) const;
+		uint64_t getUsage() const;
+
+	private:
+
+		MemoryGovernor();
+
+		//optional usage can take only part of budget, rest is left for required buffers
+		//0 is no space for category, unlimited is only when budget is 0
+		uint64_t getLimit(MemoryCategory type) const;
+		bool limited() const;
+
+		std::array<std::atomic<uint64_t>, (size_t)MemoryCategory::Count> usage;
+		std::atomic<uint64_t> total;
+	};
+}
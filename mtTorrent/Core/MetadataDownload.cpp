@@ -188,6 +188,10 @@ void mtt::MetadataDownload::progressUpdated(PeerCommunication*)
 {
 }
 
+void mtt::MetadataDownload::sendQueueLow(PeerCommunication*)
+{
+}
+
 void mtt::MetadataDownload::requestPiece(std::shared_ptr<PeerCommunication> peer)
 {
 	if (active && !state.finished)
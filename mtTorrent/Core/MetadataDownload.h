@@ -51,6 +51,7 @@ namespace mtt
 		virtual void metadataPieceReceived(PeerCommunication*, ext::UtMetadata::Message&) override;
 		virtual void pexReceived(PeerCommunication*, ext::PeerExchange::Message&) override;
 		virtual void progressUpdated(PeerCommunication*) override;
+		virtual void sendQueueLow(PeerCommunication*) override;
 
 		void requestPiece(std::shared_ptr<PeerCommunication> peer);
 		bool active = false;
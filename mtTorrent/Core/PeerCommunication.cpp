@@ -11,7 +11,7 @@ namespace mtt
 {
 	namespace bt
 	{
-		DataBuffer createHandshake(uint8_t* torrentHash, uint8_t* clientHash)
+		DataBuffer createHandshake(const uint8_t* torrentHash, uint8_t* clientHash, bool v2)
 		{
 			PacketBuilder packet(70);
 			packet.add(19);
@@ -23,6 +23,9 @@ namespace mtt
 			if (mtt::config::external.enableDht)
 				reserved_byte[7] |= 0x80;
 
+			if (v2)
+				reserved_byte[7] |= 0x10;	//BitTorrent v2
+
 			packet.add(reserved_byte, 8);
 
 			packet.add(torrentHash, 20);
@@ -94,6 +97,34 @@ namespace mtt
 
 			return packet.getBuffer();
 		}
+
+		DataBuffer createHashesMessage(PeerMessageId id, const PeerMessage::HashesInfo& info)
+		{
+			uint32_t dataSize = 1 + 32 + 16 + (uint32_t)info.hashes.size();
+			PacketBuilder packet(4 + dataSize);
+			packet.add32(dataSize);
+			packet.add(id);
+			packet.add(info.piecesRoot, 32);
+			packet.add32(info.baseLayer);
+			packet.add32(info.index);
+			packet.add32(info.length);
+			packet.add32(info.proofLayers);
+			packet.add(info.hashes.data(), info.hashes.size());
+
+			return packet.getBuffer();
+		}
+
+		DataBuffer createPieceHeader(PieceBlockInfo& info)
+		{
+			uint32_t dataSize = 1 + 8 + info.length;
+			PacketBuilder packet(4 + 1 + 8);
+			packet.add32(dataSize);
+			packet.add(Piece);
+			packet.add32(info.index);
+			packet.add32(info.begin);
+
+			return packet.getBuffer();
+		}
 	}
 }
 
@@ -108,6 +139,11 @@ bool mtt::PeerInfo::supportsExtensions()
 	return (protocol[5] & 0x10) != 0;
 }
 
+bool mtt::PeerInfo::supportsV2()
+{
+	return (protocol[7] & 0x10) != 0;
+}
+
 bool mtt::PeerInfo::supportsDht()
 {
 	return (protocol[8] & 0x80) != 0;
@@ -133,15 +169,29 @@ void mtt::PeerCommunication::setStream(std::shared_ptr<TcpAsyncStream> s)
 	dataReceived();
 }
 
+void mtt::PeerCommunication::setBandwidthChannels(BandwidthChannel* upload, BandwidthChannel* download)
+{
+	uploadChannel = upload;
+	downloadChannel = download;
+
+	if (stream)
+		stream->setBandwidthChannels(uploadChannel, downloadChannel);
+}
+
 void mtt::PeerCommunication::initializeCallbacks()
 {
+	stream->setBandwidthChannels(uploadChannel, downloadChannel);
+
 	{
 		std::lock_guard<std::mutex> guard(stream->callbackMutex);
 		stream->onConnectCallback = std::bind(&PeerCommunication::connectionOpened, this);
 		stream->onCloseCallback = [this](int code) {connectionClosed(code); };
 		stream->onReceiveCallback = std::bind(&PeerCommunication::dataReceived, this);
+		stream->onWriteQueueLowCallback = [this]() { listener.sendQueueLow(this); };
 	}
 
+	stream->setWriteQueueLowWatermark(mtt::config::internal_.upload.sendQueueWatermark);
+
 	ext.stream = stream;
 
 	ext.pex.onPexMessage = [this](mtt::ext::PeerExchange::Message& msg)
@@ -169,7 +219,7 @@ void mtt::PeerCommunication::sendHandshake()
 	{
 		LOG_MGS("Handshake");
 		state.action = PeerCommunicationState::Handshake;
-		stream->write(mtt::bt::createHandshake(torrent.hash, mtt::config::internal_.hashId));
+		stream->write(mtt::bt::createHandshake(torrent.hash, mtt::config::internal_.hashId, torrent.hasV2));
 	}
 }
 
@@ -240,7 +290,8 @@ mtt::PeerMessage mtt::PeerCommunication::readNextStreamMessage()
 
 mtt::PeerCommunication::~PeerCommunication()
 {
-	stream->close();
+	if (stream)
+		stream->close();
 }
 
 void mtt::PeerCommunication::setInterested(bool enabled)
@@ -310,6 +361,38 @@ void mtt::PeerCommunication::sendPieceBlock(PieceBlock& block)
 	stream->write(mtt::bt::createPiece(block));
 }
 
+void mtt::PeerCommunication::sendPieceBlock(PieceBlockInfo& info, std::shared_ptr<const DataBuffer> pieceData)
+{
+	if (!isEstablished())
+		return;
+
+	LOG_MGS("Piece");
+	stream->write(mtt::bt::createPieceHeader(info), pieceData, info.begin, info.length);
+}
+
+size_t mtt::PeerCommunication::getSendQueueSize()
+{
+	return stream ? stream->getWriteQueueSize() : 0;
+}
+
+void mtt::PeerCommunication::requestHashes(const PeerMessage::HashesInfo& request)
+{
+	if (!isEstablished())
+		return;
+
+	LOG_MGS("HashRequest");
+	stream->write(mtt::bt::createHashesMessage(HashRequest, request));
+}
+
+void mtt::PeerCommunication::rejectHashes(const PeerMessage::HashesInfo& request)
+{
+	if (!isEstablished())
+		return;
+
+	LOG_MGS("HashReject");
+	stream->write(mtt::bt::createHashesMessage(HashReject, request));
+}
+
 void mtt::PeerCommunication::sendBitfield(DataBuffer& bitfield)
 {
 	if (!isEstablished())
@@ -392,11 +475,11 @@ void mtt::PeerCommunication::handleMessage(PeerMessage& message)
 	}
 	else if (message.id == NotInterested)
 	{
-		state.peerInterested = true;
+		state.peerInterested = false;
 	}
 	else if (message.id == Interested)
 	{
-		state.peerInterested = false;
+		state.peerInterested = true;
 	}
 	else if (message.id == Extended)
 	{
@@ -414,8 +497,14 @@ void mtt::PeerCommunication::handleMessage(PeerMessage& message)
 		{
 			if (!state.finishedHandshake)
 			{
-				if(state.action == PeerCommunicationState::Connected)
-					stream->write(mtt::bt::createHandshake(torrent.hash, mtt::config::internal_.hashId));
+				//incoming peer can use truncated v2 hash of hybrid torrent, answer with the same one
+				if (state.action == PeerCommunicationState::Connected)
+				{
+					if (torrent.hasV2 && memcmp(message.handshake.info, torrent.hashV2, 20) == 0)
+						stream->write(mtt::bt::createHandshake(torrent.hashV2, mtt::config::internal_.hashId, true));
+					else
+						stream->write(mtt::bt::createHandshake(torrent.hash, mtt::config::internal_.hashId, torrent.hasV2));
+				}
 
 				state.action = PeerCommunicationState::Established;
 				state.finishedHandshake = true;
@@ -39,6 +39,7 @@ namespace mtt
 
 		bool supportsExtensions();
 		bool supportsDht();
+		bool supportsV2();
 	};
 
 	class PeerCommunication
@@ -47,9 +48,10 @@ namespace mtt
 
 		PeerCommunication(TorrentInfo& torrent, IPeerListener& listener, boost::asio::io_service& io_service);
 		PeerCommunication(TorrentInfo& torrent, IPeerListener& listener);
-		~PeerCommunication();
+		virtual ~PeerCommunication();
 
 		void setStream(std::shared_ptr<TcpAsyncStream> stream);
+		void setBandwidthChannels(BandwidthChannel* upload, BandwidthChannel* download);
 
 		PeerInfo info;
 		PeerCommunicationState state;
@@ -57,16 +59,22 @@ namespace mtt
 		void sendHandshake(Addr& address);
 		void sendHandshake();
 
-		void setInterested(bool enabled);
+		virtual void setInterested(bool enabled);
 		void setChoke(bool enabled);
 
-		void requestPieceBlock(PieceBlockInfo& pieceInfo);
+		virtual void requestPieceBlock(PieceBlockInfo& pieceInfo);
 		bool isEstablished();
 
 		void sendKeepAlive();
 		void sendBitfield(DataBuffer& bitfield);
 		void sendHave(uint32_t pieceIdx);
 		void sendPieceBlock(PieceBlock& block);
+		//sends block directly from shared piece data
+		void sendPieceBlock(PieceBlockInfo& info, std::shared_ptr<const DataBuffer> pieceData);
+		size_t getSendQueueSize();
+
+		void requestHashes(const PeerMessage::HashesInfo& request);
+		void rejectHashes(const PeerMessage::HashesInfo& request);
 
 		void sendPort(uint16_t port);
 
@@ -75,7 +83,7 @@ namespace mtt
 		ext::ExtensionProtocol ext;
 
 		Addr getAddress();
-		std::string getAddressName();
+		virtual std::string getAddressName();
 
 	protected:
 
@@ -84,6 +92,8 @@ namespace mtt
 		TorrentInfo& torrent;
 
 		std::shared_ptr<TcpAsyncStream> stream;
+		BandwidthChannel* uploadChannel = nullptr;
+		BandwidthChannel* downloadChannel = nullptr;
 
 		std::mutex read_mutex;
 		mtt::PeerMessage readNextStreamMessage();
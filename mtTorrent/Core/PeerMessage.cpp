@@ -79,9 +79,29 @@ PeerMessage::PeerMessage(DataBuffer& data)
 			extended.id = reader.pop();
 			extended.data = reader.popBuffer(size - 2);
 		}
+		else if ((id == HashRequest || id == HashReject) && size == 49)
+		{
+			memcpy(hashes.piecesRoot, reader.popBuffer(32).data(), 32);
+			hashes.baseLayer = reader.pop32();
+			hashes.index = reader.pop32();
+			hashes.length = reader.pop32();
+			hashes.proofLayers = reader.pop32();
+		}
+		else if (id == Hashes && size >= 49 && (size - 49) % 32 == 0)
+		{
+			memcpy(hashes.piecesRoot, reader.popBuffer(32).data(), 32);
+			hashes.baseLayer = reader.pop32();
+			hashes.index = reader.pop32();
+			hashes.length = reader.pop32();
+			hashes.proofLayers = reader.pop32();
+			hashes.hashes = reader.popBuffer(size - 49);
+		}
+		else if (id == HashRequest || id == Hashes || id == HashReject)
+			id = Invalid;
 	}
 
-	if (id >= Invalid)
+	//handshake and keepalive are never sent as message id
+	if (id >= Handshake)
 	{
 		id = Invalid;
 		messageSize = 0;
@@ -17,6 +17,9 @@ namespace mtt
 		Cancel,
 		Port,
 		Extended = 20,
+		HashRequest,
+		Hashes,
+		HashReject,
 		Handshake,
 		KeepAlive,
 		Invalid
@@ -43,6 +46,18 @@ namespace mtt
 		uint16_t port;
 		uint16_t messageSize = 0;
 
+		//BEP 52 hash request, hashes and hash reject
+		struct HashesInfo
+		{
+			uint8_t piecesRoot[32];
+			uint32_t baseLayer;
+			uint32_t index;
+			uint32_t length;
+			uint32_t proofLayers;
+			DataBuffer hashes;
+		}
+		hashes;
+
 		PeerMessage(DataBuffer& data);
 
 		struct
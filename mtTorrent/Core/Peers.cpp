@@ -135,6 +135,7 @@ void mtt::Peers::add(std::shared_ptr<TcpAsyncStream> stream)
 {
 	ActivePeer peer;
 	peer.comm = std::make_shared<PeerCommunication>(torrent->infoFile.info, peersListener);
+	peer.comm->setBandwidthChannels(&torrent->uploadLimit, &torrent->downloadLimit);
 
 	{
 		std::lock_guard<std::mutex> guard(peersMutex);
@@ -297,6 +298,7 @@ std::shared_ptr<mtt::PeerCommunication> mtt::Peers::connect(uint32_t idx)
 
 	ActivePeer peer;
 	peer.comm = std::make_shared<PeerCommunication>(torrent->infoFile.info, peersListener, torrent->service.io);
+	peer.comm->setBandwidthChannels(&torrent->uploadLimit, &torrent->downloadLimit);
 	peer.comm->sendHandshake(knownPeer.address);
 	peer.idx = idx;
 	activeConnections.push_back(peer);
@@ -389,6 +391,10 @@ void mtt::Peers::DhtSource::findPeers()
 	{
 		info.state = TrackerState::Announcing;
 		dht::Communication::get().findPeers(torrent->hash(), this);
+
+		//hybrid torrent has peers in v2 swarm too
+		if (torrent->infoFile.info.hasV2)
+			dht::Communication::get().findPeers(torrent->infoFile.info.hashV2, this);
 	}
 }
 
@@ -469,6 +475,13 @@ void mtt::Peers::PeersListener::progressUpdated(mtt::PeerCommunication* p)
 		target->progressUpdated(p);
 }
 
+void mtt::Peers::PeersListener::sendQueueLow(mtt::PeerCommunication* p)
+{
+	std::lock_guard<std::mutex> guard(mtx);
+	if (target)
+		target->sendQueueLow(p);
+}
+
 void mtt::Peers::PeersListener::setTarget(mtt::IPeerListener* t)
 {
 	target = t;
@@ -107,6 +107,7 @@ namespace mtt
 			virtual void metadataPieceReceived(mtt::PeerCommunication*, mtt::ext::UtMetadata::Message&) override;
 			virtual void pexReceived(mtt::PeerCommunication*, mtt::ext::PeerExchange::Message&) override;
 			virtual void progressUpdated(mtt::PeerCommunication*) override;
+			virtual void sendQueueLow(mtt::PeerCommunication*) override;
 			void setTarget(mtt::IPeerListener*);
 
 		private:
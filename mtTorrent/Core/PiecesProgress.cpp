@@ -1,6 +1,5 @@
 #include "PiecesProgress.h"
 
-const uint8_t ReadyValue = 0;
 const uint8_t HasFlag = 1;
 const uint8_t UnselectedFlag = 8;
 
@@ -16,47 +15,48 @@ float mtt::PiecesProgress::getPercentage()
 
 float mtt::PiecesProgress::getSelectedPercentage()
 {
-	return selectedPieces == 0 ? 0 : (selectedReceivedPiecesCount / (float)selectedPieces);
+	return selectedPiecesCount == 0 ? 0 : (selectedReceivedPiecesCount / (float)selectedPiecesCount);
 }
 
 void mtt::PiecesProgress::recheckPieces()
 {
-	receivedPiecesCount = 0;
-	selectedReceivedPiecesCount = 0;
-	selectedPieces = 0;
+	receivedPiecesCount = pieces.count();
 
-	for (auto& p : pieces)
+	if (selectedPieces.empty())
 	{
-		if (p & HasFlag)
-			receivedPiecesCount++;
-
-		if (!(p & UnselectedFlag))
-		{
-			selectedPieces++;
-
-			if (p & HasFlag)
-				selectedReceivedPiecesCount++;
-
-		}
+		selectedPiecesCount = pieces.size();
+		selectedReceivedPiecesCount = receivedPiecesCount;
+	}
+	else
+	{
+		selectedPiecesCount = selectedPieces.count();
+		selectedReceivedPiecesCount = Bitset::countCommon(pieces, selectedPieces);
 	}
 }
 
 void mtt::PiecesProgress::init(size_t size)
 {
-	receivedPiecesCount = 0;
-	selectedReceivedPiecesCount = 0;
+	if (pieces.size() != size)
+	{
+		auto oldSize = selectedPieces.size();
+		pieces.resize(size);
 
-	if(pieces.empty())
-		selectedPieces = size;
+		if (!selectedPieces.empty())
+		{
+			selectedPieces.resize(size);
 
-	if (pieces.size() != size)
-		pieces.resize(size, 0);
+			for (size_t i = oldSize; i < size; i++)
+				selectedPieces.set(i);
+		}
+	}
+
+	recheckPieces();
 }
 
 void mtt::PiecesProgress::select(DownloadSelection& selection)
 {
 	init(selection.files.back().info.endPieceIndex + 1);
-	selectedPieces = 0;
+	selectedPieces.init(pieces.size());
 
 	uint32_t lastWantedPiece = -1;
 	for (auto& f : selection.files)
@@ -67,26 +67,20 @@ void mtt::PiecesProgress::select(DownloadSelection& selection)
 
 		for (; i <= f.info.endPieceIndex; i++)
 		{
-			if (pieces[i] & HasFlag)
-			{
-				receivedPiecesCount++;
-
-				if (f.selected)
-					selectedReceivedPiecesCount++;
-			}
-				
 			if (f.selected)
-			{
-				selectedPieces++;
-				pieces[i] &= ~UnselectedFlag;
-			}
+				selectedPieces.set(i);
 			else
-				pieces[i] |= UnselectedFlag;
+				selectedPieces.reset(i);
 		}
 
 		if(f.selected)
 			lastWantedPiece = f.info.endPieceIndex;
 	}
+
+	if (selectedPieces.count() == selectedPieces.size())
+		selectedPieces.clear();
+
+	recheckPieces();
 }
 
 void mtt::PiecesProgress::addPiece(uint32_t index)
@@ -96,34 +90,46 @@ void mtt::PiecesProgress::addPiece(uint32_t index)
 
 	if (!hasPiece(index))
 	{
-		if (wantedPiece(index))
+		if (selectedPiece(index))
 			selectedReceivedPiecesCount++;
 
-		pieces[index] |= HasFlag;
+		pieces.set(index);
 		receivedPiecesCount++;
 	}
 }
 
+void mtt::PiecesProgress::removePiece(uint32_t index)
+{
+	if (index < pieces.size() && hasPiece(index))
+	{
+		if (selectedPiece(index))
+			selectedReceivedPiecesCount--;
+
+		pieces.reset(index);
+		receivedPiecesCount--;
+	}
+}
+
 bool mtt::PiecesProgress::hasPiece(uint32_t index)
 {
-	return pieces[index] & HasFlag;
+	return pieces.get(index);
 }
 
 bool mtt::PiecesProgress::selectedPiece(uint32_t index)
 {
-	return (pieces[index] & UnselectedFlag) == 0;
+	return selectedPieces.empty() || selectedPieces.get(index);
 }
 
 bool mtt::PiecesProgress::wantedPiece(uint32_t index)
 {
-	return pieces[index] == 0;
+	return !hasPiece(index) && selectedPiece(index);
 }
 
 uint32_t mtt::PiecesProgress::firstEmptyPiece()
 {
 	for (uint32_t id = 0; id < pieces.size(); id++)
 	{
-		if (!pieces[id])
+		if (wantedPiece(id))
 			return id;
 	}
 
@@ -132,49 +138,42 @@ uint32_t mtt::PiecesProgress::firstEmptyPiece()
 
 void mtt::PiecesProgress::fromBitfield(DataBuffer& bitfield, size_t piecesCount)
 {
-	init(piecesCount);
-
-	for (int i = 0; i < piecesCount; i++)
-	{
-		size_t idx = static_cast<size_t>(i / 8.0f);
-		unsigned char bitmask = 128 >> i % 8;
-
-		bool value = (bitfield[idx] & bitmask) != 0;
+	pieces.fromWire(bitfield.data(), bitfield.size(), piecesCount);
+	selectedPieces.clear();
 
-		pieces[i] = value ? HasFlag : ReadyValue;
-		receivedPiecesCount += value;
-	}
+	recheckPieces();
 }
 
 void mtt::PiecesProgress::fromList(std::vector<uint8_t>& piecesList)
 {
 	init(piecesList.size());
+	pieces.init(piecesList.size());
 
 	for (uint32_t i = 0; i < piecesList.size(); i++)
-		if (piecesList[i])
-		{
-			pieces[i] |= HasFlag;
-			receivedPiecesCount++;
+		if (piecesList[i] & HasFlag)
+			pieces.set(i);
 
-			if (selectedPiece(i))
-				selectedReceivedPiecesCount++;
-		}
+	recheckPieces();
 }
 
 DataBuffer mtt::PiecesProgress::toBitfield()
 {
-	DataBuffer buffer;
-	buffer.resize((size_t)ceil(pieces.size() / 8.0f));
+	auto data = pieces.wireData();
 
-	for (int i = 0; i < pieces.size(); i++)
-	{
-		if(!hasPiece(i))
-			continue;
+	return DataBuffer(data, data + pieces.wireSize());
+}
+
+std::vector<uint8_t> mtt::PiecesProgress::toList()
+{
+	std::vector<uint8_t> list(pieces.size());
 
-		size_t idx = static_cast<size_t>(i / 8.0f);
-		unsigned char bitmask = 128 >> i % 8;
-		buffer[idx] |= bitmask;
+	for (uint32_t i = 0; i < list.size(); i++)
+	{
+		if (hasPiece(i))
+			list[i] |= HasFlag;
+		if (!selectedPiece(i))
+			list[i] |= UnselectedFlag;
 	}
 
-	return buffer;
+	return list;
 }
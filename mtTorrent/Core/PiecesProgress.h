@@ -1,5 +1,6 @@
 #pragma once
 #include "Interface.h"
+#include "utils/Bitset.h"
 
 namespace mtt
 {
@@ -12,23 +13,27 @@ namespace mtt
 		void fromBitfield(DataBuffer& bitfield, size_t piecesCount);
 		void fromList(std::vector<uint8_t>& pieces);
 		DataBuffer toBitfield();
+		std::vector<uint8_t> toList();
 
 		bool empty();
 		float getPercentage();
 		float getSelectedPercentage();
 
 		void addPiece(uint32_t index);
+		void removePiece(uint32_t index);
 		bool hasPiece(uint32_t index);
 		bool selectedPiece(uint32_t index);
 		bool wantedPiece(uint32_t index);
 		uint32_t firstEmptyPiece();
 
-		std::vector<uint8_t> pieces;
+		Bitset pieces;
+		//empty when everything is selected
+		Bitset selectedPieces;
 
 	private:
 
 		size_t receivedPiecesCount = 0;
 		size_t selectedReceivedPiecesCount = 0;
-		size_t selectedPieces = 0;
+		size_t selectedPiecesCount = 0;
 	};
 }
@@ -1,5 +1,6 @@
 #include "State.h"
 #include <fstream>
+#include <algorithm>
 #include "Configuration.h"
 #include <boost/filesystem.hpp>
 #include "utils/BencodeWriter.h"
@@ -23,9 +24,15 @@ void mtt::TorrentState::saveState(const std::string& name)
 
 	writer.startArray();
 	writer.addRawItem("12:downloadPath", downloadPath);
+	writer.addRawItem("8:movePath", movePath);
 	writer.addRawItemFromBuffer("6:pieces", (const char*)pieces.data(), pieces.size());
 	writer.addRawItem("13:lastStateTime", lastStateTime);
 	writer.addRawItem("7:started", started);
+	writer.addRawItem("13:preallocation", preallocation);
+	writer.addRawItem("8:seedMode", seedMode);
+	writer.addRawItemFromBuffer("16:unverifiedPieces", (const char*)unverifiedPieces.data(), unverifiedPieces.size());
+	writer.addRawItem("13:downloadLimit", downloadLimit);
+	writer.addRawItem("11:uploadLimit", uploadLimit);
 
 	writer.startRawArrayItem("9:selection");
 	for (auto& f : files)
@@ -33,6 +40,20 @@ void mtt::TorrentState::saveState(const std::string& name)
 		writer.addNumber(f.selected);
 	}
 	writer.endArray();
+
+	writer.startRawArrayItem("9:fileSizes");
+	for (auto& f : files)
+	{
+		writer.addNumber((size_t)f.fingerprint.size);
+	}
+	writer.endArray();
+
+	writer.startRawArrayItem("9:fileTimes");
+	for (auto& f : files)
+	{
+		writer.addNumber((size_t)f.fingerprint.modified);
+	}
+	writer.endArray();
 	writer.endArray();
 
 	file << writer.data;
@@ -56,12 +77,21 @@ bool mtt::TorrentState::loadState(const std::string& name)
 	if (auto root = parser.getRoot())
 	{
 		downloadPath = root->getTxt("downloadPath");
+		movePath = root->getTxt("movePath");
 		lastStateTime = (uint32_t)root->getBigInt("lastStateTime");
 		started = root->getInt("started");
+		preallocation = (uint32_t)root->getInt("preallocation");
+		seedMode = root->getInt("seedMode") != 0;
+		downloadLimit = (uint32_t)root->getBigInt("downloadLimit");
+		uploadLimit = (uint32_t)root->getBigInt("uploadLimit");
 		if (auto pItem = root->getTxtItem("pieces"))
 		{
 			pieces.assign(pItem->data, pItem->data + pItem->size);
 		}
+		if (auto uItem = root->getTxtItem("unverifiedPieces"))
+		{
+			unverifiedPieces.assign(uItem->data, uItem->data + uItem->size);
+		}
 		if (auto fList = root->getListItem("selection"))
 		{
 			files.clear();
@@ -70,11 +100,106 @@ bool mtt::TorrentState::loadState(const std::string& name)
 				files.push_back({f.getInt() != 0});
 			}
 		}
+
+		auto sizesList = root->getListItem("fileSizes");
+		auto timesList = root->getListItem("fileTimes");
+		if (sizesList && timesList)
+		{
+			std::vector<size_t> sizes, times;
+			for (auto& s : *sizesList)
+				sizes.push_back(s.getBigInt());
+			for (auto& t : *timesList)
+				times.push_back(t.getBigInt());
+
+			if (sizes.size() == files.size() && times.size() == files.size())
+			{
+				for (size_t i = 0; i < files.size(); i++)
+				{
+					files[i].fingerprint.size = sizes[i];
+					files[i].fingerprint.modified = times[i];
+				}
+
+				fastResume = true;
+			}
+		}
 	}
 
 	return true;
 }
 
+const uint32_t UnfinishedPiecesVersion = 1;
+
+void mtt::UnfinishedPiecesState::saveState(const std::string& name)
+{
+	auto path = mtt::config::internal_.programFolderPath + mtt::config::internal_.stateFolder + "\\" + name + ".parts";
+
+	if (pieces.empty())
+	{
+		std::remove(path.data());
+		return;
+	}
+
+	std::ofstream file(path, std::ios::binary);
+
+	if (!file)
+		return;
+
+	auto writeNumber = [&file](uint32_t n) { file.write((const char*)&n, sizeof(n)); };
+
+	writeNumber(UnfinishedPiecesVersion);
+	writeNumber((uint32_t)pieces.size());
+
+	for (auto& p : pieces)
+	{
+		writeNumber(p->index);
+		writeNumber((uint32_t)p->blocksTodo.size());
+		file.write((const char*)p->blocksTodo.data(), p->blocksTodo.size());
+		file.put(p->mapped ? 1 : 0);
+
+		//mapped piece data is already in files
+		writeNumber((uint32_t)p->data.size());
+		file.write((const char*)p->data.data(), p->data.size());
+	}
+}
+
+bool mtt::UnfinishedPiecesState::loadState(const std::string& name)
+{
+	auto path = mtt::config::internal_.programFolderPath + mtt::config::internal_.stateFolder + "\\" + name + ".parts";
+	std::ifstream file(path, std::ios::binary);
+
+	if (!file)
+		return false;
+
+	auto readNumber = [&file]() { uint32_t n = 0; file.read((char*)&n, sizeof(n)); return n; };
+
+	if (readNumber() != UnfinishedPiecesVersion)
+		return false;
+
+	auto count = readNumber();
+
+	for (uint32_t i = 0; i < count && file; i++)
+	{
+		auto piece = std::make_shared<DownloadedPiece>();
+		piece->index = readNumber();
+
+		piece->blocksTodo.resize(std::min(readNumber(), 0xFFFFu));
+		file.read((char*)piece->blocksTodo.data(), piece->blocksTodo.size());
+		piece->remainingBlocks = (uint32_t)std::count(piece->blocksTodo.begin(), piece->blocksTodo.end(), 0);
+		piece->mapped = file.get() == 1;
+
+		piece->data.resize(std::min(readNumber(), 64u * 1024 * 1024));
+		file.read((char*)piece->data.data(), piece->data.size());
+
+		if (file)
+			pieces.push_back(piece);
+	}
+
+	file.close();
+	std::remove(path.data());
+
+	return true;
+}
+
 void mtt::TorrentsList::saveState()
 {
 	auto folderPath = mtt::config::internal_.programFolderPath + mtt::config::internal_.stateFolder + "\\list";
@@ -1,6 +1,8 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <memory>
+#include "Interface.h"
 
 namespace mtt
 {
@@ -9,16 +11,37 @@ namespace mtt
 		TorrentState(std::vector<uint8_t>&);
 
 		std::string downloadPath;
+		//target of unfinished move of files
+		std::string movePath;
 
 		struct File
 		{
 			bool selected;
+			FileFingerprint fingerprint;
 		};
 		std::vector<File> files;
 
 		std::vector<uint8_t>& pieces;
 		uint32_t lastStateTime = 0;
 		bool started = false;
+		uint32_t preallocation = 0;
+		//files fingerprints were stored with pieces
+		bool fastResume = false;
+		bool seedMode = false;
+		//bitfield of pieces not verified yet in seed mode
+		std::vector<uint8_t> unverifiedPieces;
+		//bytes per second, 0 is unlimited
+		uint32_t downloadLimit = 0;
+		uint32_t uploadLimit = 0;
+
+		void saveState(const std::string& name);
+		bool loadState(const std::string& name);
+	};
+
+	//received blocks of unfinished pieces, kept between torrent restarts
+	struct UnfinishedPiecesState
+	{
+		std::vector<std::shared_ptr<DownloadedPiece>> pieces;
 
 		void saveState(const std::string& name);
 		bool loadState(const std::string& name);
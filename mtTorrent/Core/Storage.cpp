@@ -3,22 +3,63 @@
 #include <boost/filesystem.hpp>
 #include <iostream>
 #include "utils/ServiceThreadpool.h"
+#include "Configuration.h"
+#include <openssl/sha.h>
+#include <map>
+#include <set>
+#include "utils/HexEncoding.h"
+#include "MemoryGovernor.h"
+#include <algorithm>
+#include <thread>
+
+//moved file is copied under this name until it switches
+const std::string MoveSuffix = ".mtmove";
+const uint64_t MoveChunkSize = 4 * 1024 * 1024;
+//rounds of copying ranges written during move, before the last one with transfers paused
+const uint32_t MoveDirtyRounds = 3;
 
 mtt::Storage::Storage(TorrentInfo& info)
 {
-	init(info);
 	path = ".//";
+	init(info);
 }
 
 mtt::Storage::~Storage()
 {
 	flush();
+	clearCache();
 }
 
 void mtt::Storage::init(TorrentInfo& info)
 {
 	pieceSize = info.pieceSize;
 	files = info.files;
+	partFileName = "." + hexToString(info.hash, 20) + ".parts";
+
+	{
+		std::lock_guard<std::mutex> guard(mappingMutex);
+
+		mappedWindows.clear();
+		mappedFiles.clear();
+		mappedFiles.resize(files.size());
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(allocationMutex);
+
+		pendingAllocation.assign(files.size(), 0);
+		partFiles.assign(files.size(), 0);
+	}
+
+	movePath.clear();
+	movedFiles.assign(files.size(), 0);
+	movedPartFile = false;
+
+	if (!backend)
+	{
+		auto& settings = mtt::config::internal_.storage;
+		backend = StorageBackend::create(settings.directIo ? StorageBackendType::Direct : (settings.overlappedIo ? StorageBackendType::Overlapped : StorageBackendType::Stream));
+	}
 
 	DownloadSelection selection;
 	for (auto&f : info.files)
@@ -35,16 +76,39 @@ void mtt::Storage::setPath(std::string p)
 
 	if (!path.empty() && path.back() != '\\')
 		path += '\\';
+
+	std::lock_guard<std::mutex> guard(mappingMutex);
+
+	for (uint32_t i = 0; i < mappedFiles.size(); i++)
+		closeMappedFile(i);
 }
 
 void mtt::Storage::storePiece(DownloadedPiece& piece)
 {
-	std::lock_guard<std::mutex> guard(storageMutex);
+	if (piece.mapped)
+	{
+		//already in place, just start writeback
+		flushMappedPiece(piece.index, true);
+	}
+	else
+	{
+		bool batchFull = false;
+
+		//received data cant be dropped, budget only makes it go to disk sooner
+		MemoryGovernor::get().forceReserve(MemoryCategory::WriteCache, piece.data.size());
+
+		{
+			std::lock_guard<std::mutex> guard(storageMutex);
 
-	unsavedPieces.getNext() = piece;
+			unsavedPieces.push_back(std::make_shared<DownloadedPiece>(piece));
+			batchFull = unsavedPieces.size() >= UnsavedPiecesBatch || MemoryGovernor::get().overBudget();
+		}
+
+		if (batchFull)
+			flushAllFiles();
+	}
 
-	if (unsavedPieces.count == unsavedPieces.data.size())
-		flushAllFiles();
+	addUnsyncedPiece(piece.index);
 }
 
 mtt::PieceBlock mtt::Storage::getPieceBlock(PieceBlockInfo& block)
@@ -52,362 +116,1638 @@ mtt::PieceBlock mtt::Storage::getPieceBlock(PieceBlockInfo& block)
 	PieceBlock out;
 	out.info = block;
 
-	std::lock_guard<std::mutex> guard(cacheMutex);
-
-	auto& piece = loadPiece(block.index);
+	auto data = loadPiece(block.index);
 
-	if (piece.data.size() >= block.begin + block.length)
+	if (data->size() >= block.begin + block.length)
 	{
 		out.data.resize(block.length);
-		memcpy(out.data.data(), piece.data.data() + block.begin, block.length);
+		memcpy(out.data.data(), data->data() + block.begin, block.length);
 	}
 
 	return out;
 }
 
-mtt::Storage::CachedPiece& mtt::Storage::loadPiece(uint32_t pieceId)
+std::shared_ptr<const DataBuffer> mtt::Storage::getPieceData(uint32_t index)
+{
+	return loadPiece(index);
+}
+
+void mtt::Storage::preloadPiece(uint32_t index)
+{
+	//read ahead is useless when it cant stay in cache
+	if (!MemoryGovernor::get().hasSpace(MemoryCategory::ReadCache, getPieceDataSize(index)))
+		return;
+
+	loadPiece(index);
+}
+
+std::shared_ptr<DataBuffer> mtt::Storage::loadPiece(uint32_t pieceId)
 {
+	auto& shard = cacheShards[pieceId % cacheShards.size()];
+
 	{
-		std::lock_guard<std::mutex> guard(storageMutex);
+		std::lock_guard<std::mutex> guard(shard.mutex);
 
-		for (uint32_t i = 0; i < unsavedPieces.count; i++)
+		for (uint32_t i = 0; i < shard.pieces.count; i++)
 		{
-			auto& p = unsavedPieces.data[i];
-
-			if (p.index == pieceId)
-			{
-				auto& c = cachedPieces.getNext();
-				c.data = p.data;
-				c.index = p.index;
-			}
+			if (shard.pieces.data[i].index == pieceId)
+				return shard.pieces.data[i].data;
 		}
 	}
 
-	for (uint32_t i = 0; i < cachedPieces.count; i++)
+	//read without any lock, new buffer as previous one may still be referenced by pending uploads
+	auto data = getUnsavedPieceData(pieceId);
+
+	if (!data)
 	{
-		if (cachedPieces.data[i].index == pieceId)
-			return cachedPieces.data[i];
+		data = std::make_shared<DataBuffer>(getPieceDataSize(pieceId));
+		readPiece(pieceId, *data, DiskJobClass::UploadRead);
 	}
 
-	auto& piece = cachedPieces.getNext();
-	piece.index = pieceId;
-	piece.data.resize(pieceSize);
+	std::lock_guard<std::mutex> guard(shard.mutex);
 
-	for (auto& f : files)
+	//loaded meanwhile by other thread
+	for (uint32_t i = 0; i < shard.pieces.count; i++)
 	{
-		if (f.startPieceIndex <= piece.index && f.endPieceIndex >= piece.index)
-		{
-			loadPiece(f, piece);
-		}
+		if (shard.pieces.data[i].index == pieceId)
+			return shard.pieces.data[i].data;
 	}
 
-	if(files.back().endPieceIndex == pieceId)
-		piece.data.resize(files.back().endPiecePos);
+	//served without caching when budget is used
+	if (!MemoryGovernor::get().reserve(MemoryCategory::ReadCache, data->size()))
+		return data;
+
+	auto& piece = shard.pieces.getNext();
+	releaseCache(piece);
+	piece.index = pieceId;
+	piece.data = data;
+	piece.reserved = data->size();
 
-	return piece;
+	return data;
 }
 
-void mtt::Storage::loadPiece(File& file, CachedPiece& piece)
+void mtt::Storage::releaseCache(CachedPiece& piece)
 {
-	size_t fileDataPos = (piece.index == file.startPieceIndex) ? 0 : pieceSize - file.startPiecePos;
-	if (piece.index > file.startPieceIndex + 1)
-		fileDataPos += (piece.index - file.startPieceIndex - 1)*(size_t)pieceSize;
-
-	uint32_t bufferDataPos = (piece.index == file.startPieceIndex) ? file.startPiecePos : 0;
+	if (piece.reserved)
+		MemoryGovernor::get().release(MemoryCategory::ReadCache, piece.reserved);
 
-	auto dataSize = (uint32_t)std::min((size_t)pieceSize, file.size);
-	if (file.startPieceIndex == piece.index)
-		dataSize = std::min(pieceSize - file.startPiecePos, dataSize);
-	else if (file.endPieceIndex == piece.index)
-		dataSize = std::min(file.endPiecePos, dataSize);
+	piece.reserved = 0;
+	piece.data.reset();
+}
 
-	if (dataSize > 0)
+void mtt::Storage::clearCache()
+{
+	for (auto& shard : cacheShards)
 	{
-		auto path = getFullpath(file);
-		std::ifstream fileOut(path, std::ios_base::binary | std::ios_base::in);
+		std::lock_guard<std::mutex> guard(shard.mutex);
 
-		fileOut.seekg(fileDataPos);
-		fileOut.read((char*)piece.data.data() + bufferDataPos, dataSize);
+		for (auto& piece : shard.pieces.data)
+			releaseCache(piece);
+
+		shard.pieces.reset();
 	}
 }
 
-mtt::Status mtt::Storage::preallocateSelection(DownloadSelection& selection)
+std::shared_ptr<DataBuffer> mtt::Storage::getUnsavedPieceData(uint32_t index)
 {
-	{
-		std::lock_guard<std::mutex> guard(storageMutex);
+	std::lock_guard<std::mutex> guard(storageMutex);
 
-		for (auto& f : selection.files)
+	for (auto& batch : { &unsavedPieces, &writingPieces })
+	{
+		for (auto& p : *batch)
 		{
-			if (f.selected)
-			{
-				auto s = preallocate(f.info);
-				if (s != Status::Success)
-					return s;
-			}
+			if (p->index == index)
+				return std::make_shared<DataBuffer>(p->data);
 		}
 	}
 
-	{
-		std::lock_guard<std::mutex> guard(cacheMutex);
+	return nullptr;
+}
 
-		cachedPieces.reset();
-	}
+bool mtt::Storage::readPiece(uint32_t index, DataBuffer& buffer, DiskJobClass type)
+{
+	DiskScheduler::Job job(type);
+	std::shared_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
 
-	return Status::Success;
+	bool mappedRead = forMappedData(index, 0, (uint32_t)buffer.size(), [&](uint8_t* data, uint32_t dataPos, size_t size)
+		{
+			memcpy(buffer.data() + dataPos, data, size);
+		});
+
+	if (mappedRead)
+		return true;
+
+	bool success = true;
+
+	for (auto& span : getDataSpans(index, 0, (uint32_t)buffer.size()))
+		success &= backend->read(getSpanPath(span.fileIdx), { { span.filePos, buffer.data() + span.dataPos, span.size } });
+
+	return success;
 }
 
-void mtt::Storage::flush()
+bool mtt::Storage::checkStoredPiece(uint32_t index, const uint8_t* expectedHash)
 {
-	std::lock_guard<std::mutex> guard(storageMutex);
+	//read past cache, pieces being uploaded stay there
+	DataBuffer buffer(getPieceDataSize(index));
 
-	flushAllFiles();
+	if (!readPiece(index, buffer, DiskJobClass::CheckRead))
+		return false;
+
+	uint8_t hash[SHA_DIGEST_LENGTH];
+	SHA1(buffer.data(), buffer.size(), hash);
+
+	return memcmp(hash, expectedHash, SHA_DIGEST_LENGTH) == 0;
 }
 
-mtt::Status mtt::Storage::deleteAll()
+void mtt::Storage::setPreallocationMode(PreallocationMode mode)
 {
-	std::lock_guard<std::mutex> guard(storageMutex);
+	preallocationMode = mode;
+}
 
-	for (auto& f : files)
-	{
-		auto path = getFullpath(f);
+mtt::PreallocationMode mtt::Storage::getPreallocationMode()
+{
+	return preallocationMode;
+}
 
-		std::remove(path.data());
-	}
+mtt::Status mtt::Storage::preallocateSelection(DownloadSelection& selection)
+{
+	PreallocationState state;
+	auto s = selectFiles(selection, state);
 
-	return Status::Success;
+	if (s == Status::Success && preallocationMode != PreallocationMode::Sparse)
+		s = preallocatePending(state);
+
+	return s;
 }
 
-void mtt::Storage::flushAllFiles()
+std::shared_ptr<mtt::PreallocationState> mtt::Storage::preallocateSelectionAsync(DownloadSelection& selection, boost::asio::io_service& io, std::function<void(std::shared_ptr<PreallocationState>)> onFinish)
 {
-	for (auto& f : files)
+	auto state = std::make_shared<mtt::PreallocationState>();
+	state->result = selectFiles(selection, *state);
+
+	io.post([state, onFinish, this]()
 	{
-		flush(f);
-	}
+		if (state->result == Status::Success && preallocationMode != PreallocationMode::Sparse)
+			state->result = preallocatePending(*state);
+
+		onFinish(state);
+	});
 
-	unsavedPieces.reset();
+	return state;
 }
 
-void mtt::Storage::flush(File& file)
+mtt::Status mtt::Storage::selectFiles(DownloadSelection& selection, PreallocationState& state)
 {
-	std::vector<DownloadedPiece*> filePieces;
-	for (uint32_t i = 0; i < unsavedPieces.count; i++)
+	//unsaved pieces go where current layout expects them
+	flushAllFiles();
+
+	std::unique_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
+
 	{
-		auto& piece = unsavedPieces.data[i];
-		if (file.startPieceIndex <= piece.index && file.endPieceIndex >= piece.index)
-			filePieces.push_back(&piece);
-	}
+		std::unique_lock<std::mutex> guard(allocationMutex);
 
-	if (filePieces.empty())
-		return;
+		//running allocation finishes with layout it started with
+		allocationCv.wait(guard, [this]() { return std::find(pendingAllocation.begin(), pendingAllocation.end(), AllocationRunning) == pendingAllocation.end(); });
 
-	auto path = getFullpath(file);
-	createPath(path);
+		std::vector<uint8_t> pending(files.size(), 0);
+		std::vector<uint8_t> inPartFile(files.size(), 0);
+		uint64_t missingSize = 0;
 
-	boost::filesystem::path dir(path);
-	bool fileExists = boost::filesystem::exists(dir);
-	size_t existingSize = fileExists ? boost::filesystem::file_size(dir) : 0;
+		for (uint32_t i = 0; i < selection.files.size() && i < files.size(); i++)
+		{
+			boost::system::error_code ec;
+			auto existingSize = boost::filesystem::file_size(getFullpath(i), ec);
 
-	if (fileExists && existingSize == file.size)
-	{
-		std::ofstream fileOut(path, std::ios_base::binary | std::ios_base::in);
+			if (ec)
+				existingSize = 0;
+			else if (existingSize == files[i].size)
+				continue;
 
-		if (fileOut)
-			for (auto& p : filePieces)
+			//unselected files are never created, their share of boundary pieces is kept in part file
+			if (!selection.files[i].selected)
 			{
-				auto pieceDataPos = file.startPieceIndex == p->index ? file.startPiecePos : 0;
-				auto fileDataPos = file.startPieceIndex == p->index ? 0 : (pieceSize - file.startPiecePos + (p->index - file.startPieceIndex - 1) * pieceSize);
-				auto pieceDataSize = std::min(file.size, p->data.size() - pieceDataPos);
+				inPartFile[i] = 1;
+				continue;
+			}
 
-				if (file.endPieceIndex == p->index)
-					pieceDataSize = std::min(pieceDataSize, (size_t)file.endPiecePos);
+			pending[i] = AllocationPending;
 
-				fileOut.seekp(fileDataPos);
-				fileOut.write((const char*)p->data.data() + pieceDataPos, pieceDataSize);
-			}
+			if (existingSize < files[i].size)
+				missingSize += files[i].size - existingSize;
+		}
+
+		if (missingSize)
+		{
+			boost::system::error_code ec;
+			auto spaceInfo = boost::filesystem::space(path, ec);
+			if (!ec && spaceInfo.available < missingSize)
+				return Status::E_NotEnoughSpace;
+		}
+
+		for (uint32_t i = 0; i < files.size() && i < partFiles.size(); i++)
+		{
+			if (partFiles[i] && !inPartFile[i])
+				moveFromPartFile(i);
+		}
+
+		pendingAllocation = pending;
+		partFiles = inPartFile;
+
+		if (preallocationMode != PreallocationMode::Sparse)
+			state.bytesCount = missingSize;
 	}
-	else
+
 	{
-		std::ofstream tempFileOut(path, fileExists ? (std::ios_base::binary | std::ios_base::in) : std::ios_base::binary);
+		std::lock_guard<std::mutex> guard(mappingMutex);
 
-		if(tempFileOut)
-			for (auto& p : filePieces)
-			{
-				if (p->index == file.startPieceIndex)
-				{
-					tempFileOut.write((const char*)p->data.data() + file.startPiecePos, std::min(file.size, p->data.size() - file.startPiecePos));
-				}
-				else if (p->index == file.endPieceIndex)
-				{
-					tempFileOut.seekp(pieceSize - file.startPiecePos);
-					tempFileOut.write((const char*)p->data.data(), file.endPiecePos);
-				}
+		//only selected files have full size on disk, pieces touching others go through buffered path
+		for (uint32_t i = 0; i < selection.files.size() && i < mappedFiles.size(); i++)
+		{
+			auto& settings = mtt::config::internal_.storage;
+			auto enable = settings.memoryMapping && !settings.directIo && selection.files[i].selected && files[i].size > 0;
 
-			}
+			if (!enable)
+				closeMappedFile(i);
+
+			mappedFiles[i].enabled = enable;
+		}
 	}
+
+	clearCache();
+
+	return Status::Success;
 }
 
-DataBuffer mtt::Storage::checkStoredPieces(std::vector<PieceInfo>& piecesInfo)
+mtt::Status mtt::Storage::preallocatePending(PreallocationState& state)
 {
-	PiecesCheck check;
-	checkStoredPieces(check, piecesInfo);
-	return check.pieces;
+	for (uint32_t i = 0; i < files.size() && !state.rejected; i++)
+	{
+		DiskScheduler::Job job(DiskJobClass::Preallocation);
+
+		auto s = allocateFile(i, &state);
+
+		if (s != Status::Success && s != Status::I_Stopped)
+			return s;
+	}
+
+	return Status::Success;
 }
 
-void mtt::Storage::checkStoredPieces(PiecesCheck& checkState, const std::vector<PieceInfo>& piecesInfo)
+mtt::Status mtt::Storage::allocateFile(uint32_t fileIdx, PreallocationState* state)
 {
-	checkState.pieces.resize(piecesInfo.size());
-	size_t currentPieceIdx = 0;
+	std::unique_lock<std::mutex> lock(allocationMutex);
 
-	if (files.empty())
-		return;
+	//allocated by other thread right now, ready after that
+	allocationCv.wait(lock, [&]() { return fileIdx >= pendingAllocation.size() || pendingAllocation[fileIdx] != AllocationRunning; });
 
-	auto currentFile = &files.front();
-	auto lastFile = &files.back();
-	
-	std::ifstream fileIn;
-	DataBuffer readBuffer(pieceSize);
-	uint8_t shaBuffer[20] = { 0 };
+	if (fileIdx >= pendingAllocation.size() || !pendingAllocation[fileIdx])
+		return Status::Success;
+
+	pendingAllocation[fileIdx] = AllocationRunning;
+	lock.unlock();
+
+	//zero fill takes long, data spans and other files stay accessible meanwhile
+	auto s = preallocate(fileIdx, state);
+
+	lock.lock();
+	pendingAllocation[fileIdx] = s == Status::Success ? 0 : AllocationPending;
+	lock.unlock();
 
-	while (currentPieceIdx < piecesInfo.size())
+	allocationCv.notify_all();
+
+	return s;
+}
+
+void mtt::Storage::flush()
+{
 	{
-		auto fullpath = getFullpath(*currentFile);
-		boost::filesystem::path dir(fullpath);
+		std::vector<std::shared_ptr<boost::interprocess::mapped_region>> regions;
 
-		if (boost::filesystem::exists(dir))
 		{
-			fileIn.open(fullpath, std::ios_base::binary);
+			std::lock_guard<std::mutex> guard(mappingMutex);
 
-			if (fileIn)
-			{
-				size_t existingSize = boost::filesystem::file_size(dir);
+			for (auto& w : mappedWindows)
+				regions.push_back(w.region);
+		}
 
-				if (existingSize == currentFile->size)
-				{
-					auto readSize = pieceSize - currentFile->startPiecePos;
-					auto readBufferPos = currentFile->startPiecePos;
+		DiskScheduler::Job job(DiskJobClass::DownloadWrite);
 
-					fileIn.read((char*)readBuffer.data() + readBufferPos, readSize);
+		for (auto& r : regions)
+			r->flush();
+	}
 
-					while (fileIn && !checkState.rejected && currentPieceIdx <= currentFile->endPieceIndex)
-					{
-						SHA1(readBuffer.data(), pieceSize, shaBuffer);
-						checkState.pieces[currentPieceIdx] = memcmp(shaBuffer, piecesInfo[currentPieceIdx].hash, 20) == 0;
-						fileIn.read((char*)readBuffer.data(), pieceSize);
+	flushAllFiles();
+}
 
-						checkState.piecesChecked = (uint32_t)++currentPieceIdx;
-					}
+mtt::Status mtt::Storage::sync(bool force)
+{
+	std::vector<uint32_t> pieces;
 
-					if (currentPieceIdx == currentFile->endPieceIndex && currentFile == lastFile)
-					{
-						SHA1(readBuffer.data(), currentFile->endPiecePos, shaBuffer);
-						checkState.pieces[currentPieceIdx] = memcmp(shaBuffer, piecesInfo[currentPieceIdx].hash, 20) == 0;
-						++currentPieceIdx;
-					}
-				}
-				else
-				{
-					auto startPieceSize = pieceSize - currentFile->startPiecePos;
-					auto endPieceSize = currentFile->endPiecePos;
-					auto tempFileSize = startPieceSize + endPieceSize;
+	{
+		std::lock_guard<std::mutex> guard(syncMutex);
 
-					if (existingSize == tempFileSize || existingSize == startPieceSize)
-					{
-						fileIn.read((char*)readBuffer.data() + currentFile->startPiecePos, startPieceSize);
+		if (!force && (unsyncedPieces.empty() || std::chrono::steady_clock::now() - lastSync < std::chrono::seconds(mtt::config::internal_.storage.syncInterval)))
+		{
+			auto status = writeError;
+			writeError = Status::Success;
+			return status;
+		}
 
-						SHA1(readBuffer.data(), pieceSize, shaBuffer);
-						checkState.pieces[currentFile->startPieceIndex] = memcmp(shaBuffer, piecesInfo[currentFile->startPieceIndex].hash, 20) == 0;
+		pieces.swap(unsyncedPieces);
+		syncingPieces.insert(syncingPieces.end(), pieces.begin(), pieces.end());
+		unsyncedBytes = 0;
+		lastSync = std::chrono::steady_clock::now();
+	}
 
-						if(existingSize == tempFileSize)
-							fileIn.read((char*)readBuffer.data(), endPieceSize);
-					}
-				}
-			}
+	flush();
 
-			fileIn.close();
+	if (!pieces.empty())
+	{
+		{
+			//batches written by other threads have to land before sync
+			std::unique_lock<std::mutex> lock(storageMutex);
+			writtenCv.wait(lock, [&]()
+				{
+					for (auto& p : writingPieces)
+						if (std::find(pieces.begin(), pieces.end(), p->index) != pieces.end())
+							return false;
+					return true;
+				});
 		}
 
-		if (currentPieceIdx < currentFile->endPieceIndex)
-			currentPieceIdx = currentFile->endPieceIndex;
+		//one sync per file for whole group of pieces
+		std::map<uint32_t, std::vector<uint32_t>> syncFiles;
+		{
+			std::shared_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
 
-		if (currentFile == lastFile)
-			currentPieceIdx = currentFile->endPieceIndex + 1;
+			for (auto idx : pieces)
+				for (auto& span : getDataSpans(idx, 0, getPieceDataSize(idx)))
+					syncFiles[span.fileIdx].push_back(idx);
+		}
 
-		checkState.piecesChecked = (uint32_t)currentPieceIdx;
+		std::set<uint32_t> failed;
 
-		if (checkState.rejected)
-			return;
+		for (auto& f : syncFiles)
+		{
+			DiskScheduler::Job job(DiskJobClass::DownloadWrite);
+			std::shared_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
+			std::lock_guard<std::mutex> fileGuard(getFileLock(f.first));
 
-		if(++currentFile > lastFile)
-			break;
+			if (!StorageBackend::syncFile(getSpanPath(f.first)))
+				failed.insert(f.second.begin(), f.second.end());
+		}
+
+		std::lock_guard<std::mutex> guard(syncMutex);
+
+		for (auto idx : pieces)
+		{
+			auto it = std::find(syncingPieces.begin(), syncingPieces.end(), idx);
+			if (it != syncingPieces.end())
+				syncingPieces.erase(it);
+		}
+
+		//retried with next sync
+		if (!failed.empty())
+		{
+			unsyncedPieces.insert(unsyncedPieces.end(), failed.begin(), failed.end());
+			writeError = Status::E_WriteProblem;
+		}
 	}
+
+	std::lock_guard<std::mutex> guard(syncMutex);
+	auto status = writeError;
+	writeError = Status::Success;
+
+	return status;
 }
 
-std::shared_ptr<mtt::PiecesCheck> mtt::Storage::checkStoredPiecesAsync(std::vector<PieceInfo>& piecesInfo, boost::asio::io_service& io, std::function<void(std::shared_ptr<PiecesCheck>)> onFinish)
+std::vector<uint32_t> mtt::Storage::getUnsyncedPieces()
 {
-	auto request = std::make_shared<mtt::PiecesCheck>();
-	request->piecesCount = (uint32_t)piecesInfo.size();
+	std::lock_guard<std::mutex> guard(syncMutex);
+
+	auto pieces = unsyncedPieces;
+	pieces.insert(pieces.end(), syncingPieces.begin(), syncingPieces.end());
+	pieces.insert(pieces.end(), failedPieces.begin(), failedPieces.end());
+
+	return pieces;
+}
+
+void mtt::Storage::addUnsyncedPiece(uint32_t index)
+{
+	auto& settings = mtt::config::internal_.storage;
+
+	if (settings.durability == mtt::config::Durability::None)
+		return;
+
+	bool syncNow = false;
 
-	io.post([piecesInfo, onFinish, request, this]()
 	{
-		checkStoredPieces(*request.get(), piecesInfo);
+		std::lock_guard<std::mutex> guard(syncMutex);
 
-		onFinish(request);
-	});
+		unsyncedPieces.push_back(index);
+		unsyncedBytes += getPieceDataSize(index);
 
-	return request;
+		syncNow = settings.durability == mtt::config::Durability::Strict || unsyncedBytes >= settings.syncBytes;
+	}
+
+	if (syncNow)
+		sync(true);
 }
 
-mtt::Status mtt::Storage::preallocate(File& file)
+mtt::Status mtt::Storage::deleteAll()
 {
-	auto fullpath = getFullpath(file);
-	createPath(fullpath);
-	boost::filesystem::path dir(fullpath);
-	if (!boost::filesystem::exists(dir) || boost::filesystem::file_size(dir) != file.size)
+	std::unique_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
+
+	if (backend)
+		backend->closeFiles();
+
 	{
-		auto spaceInfo = boost::filesystem::space(path);
-		if (spaceInfo.available < file.size)
-			return Status::E_NotEnoughSpace;
+		std::lock_guard<std::mutex> guard(mappingMutex);
+
+		for (uint32_t i = 0; i < mappedFiles.size(); i++)
+		{
+			closeMappedFile(i);
+			mappedFiles[i].enabled = false;
+		}
+	}
 
-		std::ofstream fileOut(fullpath, std::ios_base::binary);
-		fileOut.seekp(file.size - 1);
-		fileOut.put(0);
+	for (uint32_t i = 0; i < files.size(); i++)
+	{
+		std::remove(getFullpath(i).data());
 
-		if (fileOut.fail())
-			return Status::E_AllocationProblem;
+		//copy of interrupted move
+		if (!movePath.empty())
+			std::remove((movePath + getRelativePath(i) + MoveSuffix).data());
 	}
 
+	std::remove(getSpanPath(PartFileIdx).data());
+
 	return Status::Success;
 }
 
-std::string mtt::Storage::getFullpath(File& file)
+void mtt::Storage::flushAllFiles()
 {
-	std::string filePath;
+	std::vector<std::shared_ptr<DownloadedPiece>> pieces;
 
-	for (auto& p : file.path)
 	{
-		if (!filePath.empty())
-			filePath += "\\";
+		std::lock_guard<std::mutex> guard(storageMutex);
 
-		filePath += p;
+		//written batch stays readable from memory until it is on disk
+		pieces.swap(unsavedPieces);
+		writingPieces.insert(writingPieces.end(), pieces.begin(), pieces.end());
+	}
+
+	if (pieces.empty())
+		return;
+
+	std::set<uint32_t> failed;
+
+	{
+		//spans stay valid until whole batch is written
+		DiskScheduler::Job job(DiskJobClass::DownloadWrite);
+		std::shared_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
+
+		writeBatch(pieces, failed);
+	}
+
+	if (!failed.empty())
+	{
+		std::lock_guard<std::mutex> guard(syncMutex);
+
+		//not saved as finished, downloaded again after restart
+		failedPieces.insert(failedPieces.end(), failed.begin(), failed.end());
+		writeError = Status::E_WriteProblem;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(storageMutex);
+
+		for (auto& piece : pieces)
+		{
+			auto it = std::find(writingPieces.begin(), writingPieces.end(), piece);
+			if (it != writingPieces.end())
+				writingPieces.erase(it);
+
+			MemoryGovernor::get().release(MemoryCategory::WriteCache, piece->data.size());
+		}
 	}
 
-	return path + filePath;
+	writtenCv.notify_all();
 }
 
-void mtt::Storage::createPath(std::string& path)
+void mtt::Storage::writeBatch(const std::vector<std::shared_ptr<DownloadedPiece>>& pieces, std::set<uint32_t>& failed)
 {
-	auto i = path.find_last_of('\\');
+	std::map<uint32_t, std::vector<FileBlock>> fileBlocks;
+	std::map<uint32_t, std::vector<uint32_t>> filePieces;
 
-	if (i != std::string::npos)
+	for (auto& piece : pieces)
 	{
-		std::string dirPath = path.substr(0, i);
-		boost::filesystem::path dir(dirPath);
-		if (!boost::filesystem::exists(dir))
+		for (auto& span : getDataSpans(piece->index, 0, (uint32_t)piece->data.size()))
 		{
-			boost::system::error_code ec;
-			if (!boost::filesystem::create_directory(dir, ec))
-				return;
+			fileBlocks[span.fileIdx].push_back({ span.filePos, piece->data.data() + span.dataPos, span.size });
+			filePieces[span.fileIdx].push_back(piece->index);
 		}
 	}
+
+	for (auto& f : fileBlocks)
+	{
+		//other files are written in parallel
+		std::lock_guard<std::mutex> fileGuard(getFileLock(f.first));
+
+		auto path = getSpanPath(f.first);
+
+		if (f.first == PartFileIdx)
+			createPartFile();
+		else
+			allocateFile(f.first, nullptr);
+
+		createPath(path);
+
+		//pieces of file in this flush go to disk as one batch in order of position, jobs waiting in DiskScheduler keep their order
+		std::sort(f.second.begin(), f.second.end(), [](const FileBlock& l, const FileBlock& r) { return l.pos < r.pos; });
+		if (!backend->write(path, f.second))
+			failed.insert(filePieces[f.first].begin(), filePieces[f.first].end());
+
+		for (auto& b : f.second)
+			markMoveDirty(f.first, b.pos, b.size);
+	}
+}
+
+DataBuffer mtt::Storage::checkStoredPieces(std::vector<PieceInfo>& piecesInfo)
+{
+	PiecesCheck check;
+	checkStoredPieces(check, piecesInfo, {});
+	return check.pieces;
+}
+
+void mtt::Storage::checkStoredPieces(PiecesCheck& checkState, const std::vector<PieceInfo>& piecesInfo, const std::vector<bool>& changedFiles)
+{
+	checkState.pieces.resize(piecesInfo.size());
+
+	if (files.empty())
+		return;
+
+	std::vector<bool> checkedPieces(piecesInfo.size(), changedFiles.empty());
+	for (uint32_t i = 0; i < changedFiles.size() && i < files.size(); i++)
+	{
+		if (changedFiles[i])
+		{
+			for (auto idx = files[i].startPieceIndex; idx <= files[i].endPieceIndex && idx < checkedPieces.size(); idx++)
+				checkedPieces[idx] = true;
+		}
+	}
+
+	if (!DiskScheduler::get().startCheck(checkState.rejected))
+		return;
+
+	importReusableFiles(piecesInfo, checkState.rejected);
+
+	//pieces touching files not on disk cant be complete
+	std::vector<uint8_t> missingFiles(files.size(), 0);
+	for (uint32_t i = 0; i < files.size(); i++)
+		missingFiles[i] = files[i].size > 0 && !boost::filesystem::exists(getFullpath(i));
+
+	bool missingPartFile = !boost::filesystem::exists(getSpanPath(PartFileIdx));
+
+	DataBuffer readBuffer(pieceSize);
+	uint8_t shaBuffer[20] = { 0 };
+
+	for (uint32_t idx = 0; idx < piecesInfo.size() && !checkState.rejected; idx++)
+	{
+		if (!checkedPieces[idx])
+		{
+			checkState.piecesChecked = idx + 1;
+			continue;
+		}
+
+		checkState.pieces[idx] = 0;
+
+		auto dataSize = getPieceDataSize(idx);
+		std::vector<DataSpan> spans;
+		{
+			std::shared_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
+			spans = getDataSpans(idx, 0, dataSize);
+		}
+		bool available = !spans.empty();
+
+		for (auto& span : spans)
+		{
+			if (span.fileIdx == PartFileIdx ? missingPartFile : missingFiles[span.fileIdx])
+				available = false;
+		}
+
+		if (available)
+		{
+			DiskScheduler::Job job(DiskJobClass::CheckRead);
+			std::shared_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
+
+			//layout could change since availability check
+			spans = getDataSpans(idx, 0, dataSize);
+
+			for (auto it = spans.begin(); it != spans.end() && available; it++)
+				available = backend->read(getSpanPath(it->fileIdx), { { it->filePos, readBuffer.data() + it->dataPos, it->size } });
+		}
+
+		if (available)
+		{
+			SHA1(readBuffer.data(), dataSize, shaBuffer);
+			checkState.pieces[idx] = memcmp(shaBuffer, piecesInfo[idx].hash, 20) == 0;
+		}
+
+		checkState.piecesChecked = idx + 1;
+	}
+
+	DiskScheduler::get().finishCheck();
+}
+
+std::shared_ptr<mtt::PiecesCheck> mtt::Storage::checkStoredPiecesAsync(std::vector<PieceInfo>& piecesInfo, boost::asio::io_service& io, std::function<void(std::shared_ptr<PiecesCheck>)> onFinish)
+{
+	auto request = std::make_shared<mtt::PiecesCheck>();
+	request->piecesCount = (uint32_t)piecesInfo.size();
+
+	io.post([piecesInfo, onFinish, request, this]()
+	{
+		checkStoredPieces(*request.get(), piecesInfo, {});
+
+		onFinish(request);
+	});
+
+	return request;
+}
+
+std::shared_ptr<mtt::PiecesCheck> mtt::Storage::checkChangedPiecesAsync(std::vector<PieceInfo>& piecesInfo, const std::vector<uint8_t>& storedPieces, const std::vector<bool>& changedFiles, boost::asio::io_service& io, std::function<void(std::shared_ptr<PiecesCheck>)> onFinish)
+{
+	auto request = std::make_shared<mtt::PiecesCheck>();
+	request->piecesCount = (uint32_t)piecesInfo.size();
+	request->pieces = storedPieces;
+
+	io.post([piecesInfo, changedFiles, onFinish, request, this]()
+	{
+		checkStoredPieces(*request.get(), piecesInfo, changedFiles);
+
+		onFinish(request);
+	});
+
+	return request;
+}
+
+void mtt::Storage::setReusableFiles(const std::vector<ReusableFile>& files)
+{
+	std::lock_guard<std::mutex> guard(storageMutex);
+
+	reusableFiles = files;
+}
+
+std::string mtt::Storage::getFilePath(uint32_t fileIdx)
+{
+	return fileIdx < files.size() ? getFullpath(fileIdx) : std::string();
+}
+
+std::pair<uint32_t, uint32_t> mtt::Storage::getFilePieces(uint32_t fileIdx)
+{
+	auto& file = files[fileIdx];
+
+	uint32_t first = file.startPiecePos == 0 ? file.startPieceIndex : file.startPieceIndex + 1;
+	uint32_t last = file.endPiecePos == getPieceDataSize(file.endPieceIndex) ? file.endPieceIndex : file.endPieceIndex - 1;
+
+	return { first, last };
+}
+
+bool mtt::Storage::checkFilePiece(const std::string& filePath, uint32_t fileIdx, uint32_t pieceIdx, const uint8_t* expectedHash)
+{
+	auto& file = files[fileIdx];
+	uint64_t fileStart = (uint64_t)file.startPieceIndex * pieceSize + file.startPiecePos;
+
+	DataBuffer buffer(getPieceDataSize(pieceIdx));
+	if (!backend->read(filePath, { { (uint64_t)pieceIdx * pieceSize - fileStart, buffer.data(), buffer.size() } }))
+		return false;
+
+	uint8_t shaBuffer[20];
+	SHA1(buffer.data(), buffer.size(), shaBuffer);
+
+	return memcmp(shaBuffer, expectedHash, 20) == 0;
+}
+
+bool mtt::Storage::copyFileThrottled(const std::string& from, const std::string& to, uint64_t size, const bool& rejected)
+{
+	auto& settings = mtt::config::internal_.storage;
+	auto start = std::chrono::steady_clock::now();
+	DataBuffer buffer;
+
+	for (uint64_t pos = 0; pos < size; pos += buffer.size())
+	{
+		if (rejected)
+			return false;
+
+		{
+			DiskScheduler::Job job(DiskJobClass::Relocation);
+
+			buffer.resize((size_t)std::min<uint64_t>(MoveChunkSize, size - pos));
+
+			if (!backend->read(from, { { pos, buffer.data(), buffer.size() } }) || !backend->write(to, { { pos, buffer.data(), buffer.size() } }))
+				return false;
+		}
+
+		if (settings.moveSpeed)
+		{
+			auto expected = std::chrono::milliseconds((pos + buffer.size()) * 1000 / settings.moveSpeed);
+			auto elapsed = std::chrono::steady_clock::now() - start;
+
+			if (elapsed < expected)
+				std::this_thread::sleep_for(expected - elapsed);
+		}
+	}
+
+	return true;
+}
+
+void mtt::Storage::importReusableFiles(const std::vector<PieceInfo>& piecesInfo, const bool& rejected)
+{
+	std::vector<ReusableFile> sources;
+
+	{
+		std::lock_guard<std::mutex> guard(storageMutex);
+
+		sources.swap(reusableFiles);
+	}
+
+	//file can have more candidates, next one is tried when previous doesnt match
+	std::set<uint32_t> reused;
+
+	for (auto& source : sources)
+	{
+		if (rejected)
+			break;
+
+		if (source.fileIdx >= files.size() || reused.count(source.fileIdx))
+			continue;
+
+		auto pieces = getFilePieces(source.fileIdx);
+		if (pieces.first > pieces.second || pieces.second >= piecesInfo.size())
+			continue;
+
+		auto& file = files[source.fileIdx];
+		auto target = getFullpath(source.fileIdx);
+		boost::system::error_code ec;
+		bool linked = false;
+
+		{
+			DiskScheduler::Job job(DiskJobClass::CheckRead);
+			std::shared_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
+
+			//own data already valid
+			if (checkFilePiece(target, source.fileIdx, pieces.first, piecesInfo[pieces.first].hash))
+			{
+				reused.insert(source.fileIdx);
+				continue;
+			}
+
+			//source doesnt have content expected by this torrent
+			if (!checkFilePiece(source.sourcePath, source.fileIdx, pieces.first, piecesInfo[pieces.first].hash))
+				continue;
+
+			createPath(target);
+
+			//shared data has to be complete, later download of any piece would also change other torrent
+			if (mtt::config::internal_.storage.fileReuse == mtt::config::FileReuse::Hardlink && file.startPiecePos == 0 && pieces.second == file.endPieceIndex)
+			{
+				bool matching = true;
+				for (auto idx = pieces.first + 1; idx <= pieces.second && matching; idx++)
+					matching = checkFilePiece(source.sourcePath, source.fileIdx, idx, piecesInfo[idx].hash);
+
+				if (matching)
+				{
+					{
+						std::lock_guard<std::mutex> guard(mappingMutex);
+						closeMappedFile(source.fileIdx);
+					}
+					backend->closeFiles();
+
+					boost::filesystem::remove(target, ec);
+					boost::filesystem::create_hard_link(source.sourcePath, target, ec);
+					linked = !ec;
+				}
+			}
+		}
+
+		if (!linked)
+		{
+			//copied in chunks like moved files, own file is replaced only by complete copy
+			auto copyPath = target + MoveSuffix;
+
+			if (!copyFileThrottled(source.sourcePath, copyPath, file.size, rejected))
+			{
+				boost::filesystem::remove(copyPath, ec);
+				continue;
+			}
+
+			DiskScheduler::Job job(DiskJobClass::Relocation);
+			std::unique_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
+
+			{
+				std::lock_guard<std::mutex> guard(mappingMutex);
+				closeMappedFile(source.fileIdx);
+			}
+			backend->closeFiles();
+
+			boost::filesystem::rename(copyPath, target, ec);
+
+			if (ec)
+			{
+				boost::filesystem::remove(copyPath, ec);
+				continue;
+			}
+		}
+
+		if (boost::filesystem::file_size(target, ec) != file.size || ec)
+			continue;
+
+		reused.insert(source.fileIdx);
+
+		//file present with full size isnt kept in part file anymore, same as after selection
+		std::unique_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
+		std::lock_guard<std::mutex> guard(allocationMutex);
+
+		if (source.fileIdx < partFiles.size())
+			partFiles[source.fileIdx] = 0;
+	}
+}
+
+std::string mtt::Storage::getPath()
+{
+	return path;
+}
+
+std::string mtt::Storage::getMovePath()
+{
+	std::shared_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
+
+	return movePath;
+}
+
+void mtt::Storage::restoreMove(std::string target)
+{
+	if (!target.empty() && target.back() != '\\')
+		target += '\\';
+
+	std::unique_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
+
+	movePath = target;
+	movedFiles.assign(files.size(), 0);
+
+	for (uint32_t i = 0; i < files.size(); i++)
+		movedFiles[i] = !boost::filesystem::exists(path + getRelativePath(i)) && boost::filesystem::exists(movePath + getRelativePath(i));
+
+	movedPartFile = !boost::filesystem::exists(path + partFileName) && boost::filesystem::exists(movePath + partFileName);
+}
+
+std::shared_ptr<mtt::RelocationState> mtt::Storage::moveAsync(const std::string& target, boost::asio::io_service& io, std::function<void(std::shared_ptr<RelocationState>)> onFinish)
+{
+	auto state = std::make_shared<mtt::RelocationState>();
+
+	io.post([state, target, onFinish, this]()
+	{
+		state->result = move(target, *state);
+
+		onFinish(state);
+	});
+
+	return state;
+}
+
+mtt::Status mtt::Storage::move(std::string target, RelocationState& state)
+{
+	if (!target.empty() && target.back() != '\\')
+		target += '\\';
+
+	{
+		std::unique_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
+
+		if (target == path)
+			return Status::Success;
+
+		bool anyMoved = movedPartFile || std::find(movedFiles.begin(), movedFiles.end(), 1) != movedFiles.end();
+
+		//files of unfinished move cant go to other place
+		if (anyMoved && target != movePath)
+			return Status::E_InvalidInput;
+
+		movePath = target;
+		movedFiles.resize(files.size(), 0);
+	}
+
+	boost::system::error_code ec;
+	std::vector<uint32_t> moving;
+
+	for (uint32_t i = 0; i <= files.size(); i++)
+	{
+		auto fileIdx = i < files.size() ? i : PartFileIdx;
+
+		if (fileIdx == PartFileIdx ? movedPartFile : movedFiles[fileIdx])
+			continue;
+
+		moving.push_back(fileIdx);
+
+		auto size = boost::filesystem::file_size(getSpanPath(fileIdx), ec);
+		if (!ec)
+			state.bytesCount += size;
+	}
+
+	for (auto fileIdx : moving)
+	{
+		auto status = moveFile(fileIdx, state);
+
+		if (status != Status::Success)
+			return status;
+	}
+
+	//old directories are removed when left empty
+	std::set<std::string> directories;
+
+	{
+		std::unique_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
+
+		for (uint32_t i = 0; i < files.size(); i++)
+		{
+			auto relativePath = getRelativePath(i);
+			auto pos = relativePath.find_last_of('\\');
+
+			while (pos != std::string::npos)
+			{
+				relativePath.resize(pos);
+				directories.insert(path + relativePath);
+				pos = relativePath.find_last_of('\\');
+			}
+		}
+
+		path = movePath;
+		movePath.clear();
+		movedFiles.assign(files.size(), 0);
+		movedPartFile = false;
+	}
+
+	for (auto it = directories.rbegin(); it != directories.rend(); it++)
+		if (boost::filesystem::is_empty(*it, ec))
+			boost::filesystem::remove(*it, ec);
+
+	return Status::Success;
+}
+
+mtt::Status mtt::Storage::moveFile(uint32_t fileIdx, RelocationState& state)
+{
+	auto relativePath = fileIdx == PartFileIdx ? partFileName : getRelativePath(fileIdx);
+	auto source = path + relativePath;
+	auto target = movePath + relativePath;
+	auto copyPath = target + MoveSuffix;
+
+	auto switchFile = [&]()
+	{
+		if (fileIdx == PartFileIdx)
+			movedPartFile = true;
+		else
+			movedFiles[fileIdx] = 1;
+	};
+
+	boost::system::error_code ec;
+	createPath(target);
+
+	{
+		//same filesystem, nothing to copy
+		DiskScheduler::Job job(DiskJobClass::Relocation);
+		std::unique_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
+
+		if (!boost::filesystem::exists(source))
+		{
+			switchFile();
+			return Status::Success;
+		}
+
+		auto size = boost::filesystem::file_size(source, ec);
+
+		if (fileIdx != PartFileIdx)
+		{
+			std::lock_guard<std::mutex> guard(mappingMutex);
+			closeMappedFile(fileIdx);
+		}
+		backend->closeFiles();
+
+		boost::filesystem::rename(source, target, ec);
+
+		if (!ec)
+		{
+			switchFile();
+			state.bytesDone += size;
+			return Status::Success;
+		}
+	}
+
+	//written data goes to old file and is mapped no more, until it switches
+	bool mapped = false;
+	if (fileIdx != PartFileIdx)
+	{
+		std::lock_guard<std::mutex> guard(mappingMutex);
+		mapped = mappedFiles[fileIdx].enabled;
+		mappedFiles[fileIdx].enabled = false;
+		closeMappedFile(fileIdx);
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(moveMutex);
+		movingFile = fileIdx;
+		moveDirty.clear();
+	}
+
+	auto finishMove = [&](Status status)
+	{
+		{
+			std::lock_guard<std::mutex> guard(moveMutex);
+			movingFile = NoFile;
+			moveDirty.clear();
+		}
+
+		if (mapped)
+		{
+			std::lock_guard<std::mutex> guard(mappingMutex);
+			mappedFiles[fileIdx].enabled = true;
+		}
+
+		return status;
+	};
+
+	auto copyRanges = [&](const std::vector<std::pair<uint64_t, uint64_t>>& ranges)
+	{
+		DataBuffer buffer;
+
+		for (auto& r : ranges)
+		{
+			for (auto pos = r.first; pos < r.second; pos += buffer.size())
+			{
+				buffer.resize((size_t)std::min<uint64_t>(MoveChunkSize, r.second - pos));
+
+				if (!backend->read(source, { { pos, buffer.data(), buffer.size() } }) || !backend->write(copyPath, { { pos, buffer.data(), buffer.size() } }))
+					return false;
+			}
+		}
+
+		return true;
+	};
+
+	//copy left by interrupted move is valid only if old file wasnt written since
+	uint64_t copied = 0;
+	if (boost::filesystem::exists(copyPath) && boost::filesystem::last_write_time(copyPath, ec) >= boost::filesystem::last_write_time(source, ec))
+	{
+		copied = boost::filesystem::file_size(copyPath, ec);
+		if (ec)
+			copied = 0;
+	}
+	else
+		boost::filesystem::remove(copyPath, ec);
+
+	state.bytesDone += copied;
+
+	auto& settings = mtt::config::internal_.storage;
+	auto start = std::chrono::steady_clock::now();
+	uint64_t copiedNow = 0;
+
+	for (;;)
+	{
+		if (state.rejected)
+			return finishMove(Status::I_Stopped);
+
+		uint64_t size = 0;
+		bool success = true;
+
+		{
+			DiskScheduler::Job job(DiskJobClass::Relocation);
+			std::shared_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
+
+			size = boost::filesystem::file_size(source, ec);
+			if (copied < size)
+			{
+				auto end = std::min(size, copied + MoveChunkSize);
+				success = copyRanges({ { copied, end } });
+
+				state.bytesDone += end - copied;
+				copiedNow += end - copied;
+				copied = end;
+			}
+		}
+
+		if (!success)
+			return finishMove(Status::E_WriteProblem);
+
+		if (copied >= size)
+			break;
+
+		if (settings.moveSpeed)
+		{
+			auto expected = std::chrono::milliseconds(copiedNow * 1000 / settings.moveSpeed);
+			auto elapsed = std::chrono::steady_clock::now() - start;
+
+			if (elapsed < expected)
+				std::this_thread::sleep_for(expected - elapsed);
+		}
+	}
+
+	//ranges written meanwhile are copied again, last ones with all transfers of storage paused
+	for (uint32_t round = 0; round < MoveDirtyRounds; round++)
+	{
+		std::vector<std::pair<uint64_t, uint64_t>> dirty;
+		{
+			std::lock_guard<std::mutex> guard(moveMutex);
+			dirty.swap(moveDirty);
+		}
+
+		if (dirty.empty())
+			break;
+
+		DiskScheduler::Job job(DiskJobClass::Relocation);
+		std::shared_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
+
+		if (!copyRanges(dirty))
+			return finishMove(Status::E_WriteProblem);
+	}
+
+	{
+		DiskScheduler::Job job(DiskJobClass::Relocation);
+		std::unique_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
+
+		std::vector<std::pair<uint64_t, uint64_t>> dirty;
+		{
+			std::lock_guard<std::mutex> guard(moveMutex);
+			dirty.swap(moveDirty);
+		}
+
+		//grown by allocation meanwhile
+		auto size = boost::filesystem::file_size(source, ec);
+		if (copied < size)
+			dirty.push_back({ copied, size });
+
+		if (!copyRanges(dirty))
+			return finishMove(Status::E_WriteProblem);
+
+		backend->closeFiles();
+		StorageBackend::syncFile(copyPath);
+
+		boost::filesystem::rename(copyPath, target, ec);
+		if (ec)
+			return finishMove(Status::E_WriteProblem);
+
+		switchFile();
+		boost::filesystem::remove(source, ec);
+	}
+
+	return finishMove(Status::Success);
+}
+
+void mtt::Storage::markMoveDirty(uint32_t fileIdx, uint64_t pos, uint64_t size)
+{
+	std::lock_guard<std::mutex> guard(moveMutex);
+
+	if (movingFile == fileIdx)
+		moveDirty.push_back({ pos, pos + size });
+}
+
+std::vector<mtt::FileFingerprint> mtt::Storage::getFileFingerprints()
+{
+	std::vector<FileFingerprint> out(files.size());
+
+	for (uint32_t i = 0; i < files.size(); i++)
+	{
+		auto fullpath = getFullpath(i);
+
+		boost::system::error_code ec;
+		auto size = boost::filesystem::file_size(fullpath, ec);
+		if (ec)
+			continue;
+
+		auto modified = boost::filesystem::last_write_time(fullpath, ec);
+		if (ec)
+			continue;
+
+		out[i].size = size;
+		out[i].modified = (uint64_t)modified;
+	}
+
+	return out;
+}
+
+std::vector<mtt::Storage::DataSpan> mtt::Storage::getDataSpans(uint32_t index, uint32_t begin, uint32_t size)
+{
+	std::vector<DataSpan> spans;
+
+	uint64_t dataStart = (uint64_t)index * pieceSize + begin;
+	uint64_t dataEnd = dataStart + size;
+
+	for (uint32_t i = 0; i < files.size(); i++)
+	{
+		auto& f = files[i];
+		uint64_t fileStart = (uint64_t)f.startPieceIndex * pieceSize + f.startPiecePos;
+		uint64_t fileEnd = fileStart + f.size;
+
+		if (fileEnd <= dataStart || fileStart >= dataEnd)
+			continue;
+
+		auto start = std::max(dataStart, fileStart);
+		auto end = std::min(dataEnd, fileEnd);
+		auto dataPos = (uint32_t)(start - dataStart + begin);
+
+		//part file mirrors whole torrent data, so position is same as in torrent
+		if (i < partFiles.size() && partFiles[i])
+		{
+			if (!spans.empty() && spans.back().fileIdx == PartFileIdx && spans.back().filePos + spans.back().size == start)
+				spans.back().size += (size_t)(end - start);
+			else
+				spans.push_back({ PartFileIdx, start, dataPos, (size_t)(end - start) });
+		}
+		else
+			spans.push_back({ i, start - fileStart, dataPos, (size_t)(end - start) });
+	}
+
+	return spans;
+}
+
+std::string mtt::Storage::getSpanPath(uint32_t fileIdx)
+{
+	if (fileIdx == PartFileIdx)
+		return (movedPartFile ? movePath : path) + partFileName;
+
+	return getFullpath(fileIdx);
+}
+
+void mtt::Storage::createPartFile()
+{
+	auto partPath = getSpanPath(PartFileIdx);
+
+	if (!boost::filesystem::exists(partPath))
+	{
+		createPath(partPath);
+
+		//only written ranges take space
+		StorageBackend::allocateFile(partPath, 0, true);
+	}
+}
+
+void mtt::Storage::moveFromPartFile(uint32_t fileIdx)
+{
+	auto partPath = getSpanPath(PartFileIdx);
+
+	if (!boost::filesystem::exists(partPath))
+		return;
+
+	auto& f = files[fileIdx];
+	uint64_t fileStart = (uint64_t)f.startPieceIndex * pieceSize + f.startPiecePos;
+	uint64_t fileEnd = fileStart + f.size;
+
+	auto filePath = getFullpath(fileIdx);
+	createPath(filePath);
+
+	//only boundary pieces shared with selected files could be downloaded
+	std::vector<uint32_t> boundaryPieces = { f.startPieceIndex };
+	if (f.endPieceIndex != f.startPieceIndex)
+		boundaryPieces.push_back(f.endPieceIndex);
+
+	DataBuffer buffer;
+
+	for (auto idx : boundaryPieces)
+	{
+		uint64_t pieceStart = (uint64_t)idx * pieceSize;
+		auto start = std::max(fileStart, pieceStart);
+		auto end = std::min(fileEnd, pieceStart + getPieceDataSize(idx));
+
+		if (start >= end)
+			continue;
+
+		buffer.resize((size_t)(end - start));
+
+		if (backend->read(partPath, { { start, buffer.data(), buffer.size() } }))
+		{
+			backend->write(filePath, { { start - fileStart, buffer.data(), buffer.size() } });
+			markMoveDirty(fileIdx, start - fileStart, buffer.size());
+		}
+	}
+}
+
+mtt::Status mtt::Storage::preallocate(uint32_t fileIdx, PreallocationState* state)
+{
+	auto& file = files[fileIdx];
+	auto fullpath = getFullpath(fileIdx);
+	createPath(fullpath);
+
+	boost::system::error_code ec;
+	auto existingSize = boost::filesystem::file_size(fullpath, ec);
+	if (ec)
+		existingSize = 0;
+
+	if (preallocationMode == PreallocationMode::ZeroFill && existingSize < file.size)
+	{
+		//data already written stays
+		std::ofstream fileOut(fullpath, ec ? std::ios_base::binary : (std::ios_base::binary | std::ios_base::in));
+		fileOut.seekp(existingSize);
+
+		DataBuffer zeroes(std::min((size_t)(1024 * 1024), file.size));
+		auto pos = existingSize;
+
+		while (pos < file.size && fileOut)
+		{
+			if (state && state->rejected)
+				return Status::I_Stopped;
+
+			auto size = std::min((size_t)(file.size - pos), zeroes.size());
+			fileOut.write((const char*)zeroes.data(), size);
+			pos += size;
+
+			if (state)
+				state->bytesDone += size;
+		}
+
+		if (fileOut.fail())
+			return Status::E_AllocationProblem;
+	}
+	else
+	{
+		if (!StorageBackend::allocateFile(fullpath, file.size, preallocationMode == PreallocationMode::Sparse))
+			return Status::E_AllocationProblem;
+
+		if (state && preallocationMode != PreallocationMode::Sparse && existingSize < file.size)
+			state->bytesDone += file.size - existingSize;
+	}
+
+	return Status::Success;
+}
+
+std::string mtt::Storage::getFullpath(uint32_t fileIdx)
+{
+	return (fileIdx < movedFiles.size() && movedFiles[fileIdx] ? movePath : path) + getRelativePath(fileIdx);
+}
+
+std::string mtt::Storage::getRelativePath(uint32_t fileIdx)
+{
+	std::string filePath;
+
+	for (auto& p : files[fileIdx].path)
+	{
+		if (!filePath.empty())
+			filePath += "\\";
+
+		filePath += p;
+	}
+
+	return filePath;
+}
+
+void mtt::Storage::createPath(std::string& path)
+{
+	auto i = path.find_last_of('\\');
+
+	if (i != std::string::npos)
+	{
+		std::string dirPath = path.substr(0, i);
+		boost::filesystem::path dir(dirPath);
+		if (!boost::filesystem::exists(dir))
+		{
+			boost::system::error_code ec;
+			if (!boost::filesystem::create_directory(dir, ec))
+				return;
+		}
+	}
+}
+
+bool mtt::Storage::isPieceMapped(uint32_t index)
+{
+	std::lock_guard<std::mutex> guard(mappingMutex);
+
+	bool covered = false;
+
+	for (uint32_t i = 0; i < files.size() && i < mappedFiles.size(); i++)
+	{
+		auto& f = files[i];
+
+		if (f.startPieceIndex <= index && f.endPieceIndex >= index && f.size > 0)
+		{
+			if (!mappedFiles[i].enabled)
+				return false;
+
+			covered = true;
+		}
+	}
+
+	return covered;
+}
+
+void mtt::Storage::writeMappedBlock(PieceBlock& block)
+{
+	{
+		std::shared_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
+
+		bool mapped = forMappedData(block.info.index, block.info.begin, (uint32_t)block.data.size(), [&](uint8_t* data, uint32_t dataPos, size_t size)
+			{
+				memcpy(data, block.data.data() + dataPos - block.info.begin, size);
+			});
+
+		if (mapped)
+		{
+			//window pinned before mapping of moving file was closed
+			for (auto& span : getDataSpans(block.info.index, block.info.begin, (uint32_t)block.data.size()))
+				markMoveDirty(span.fileIdx, span.filePos, span.size);
+
+			return;
+		}
+	}
+
+	//mapping was disabled meanwhile, block goes to file directly
+	writeBlock(block);
+}
+
+void mtt::Storage::writeBlock(PieceBlock& block)
+{
+	DiskScheduler::Job job(DiskJobClass::DownloadWrite);
+	std::shared_lock<std::shared_timed_mutex> layoutGuard(layoutMutex);
+
+	for (auto& span : getDataSpans(block.info.index, block.info.begin, (uint32_t)block.data.size()))
+	{
+		std::lock_guard<std::mutex> fileGuard(getFileLock(span.fileIdx));
+
+		auto path = getSpanPath(span.fileIdx);
+
+		if (span.fileIdx == PartFileIdx)
+			createPartFile();
+		else
+			allocateFile(span.fileIdx, nullptr);
+
+		createPath(path);
+		backend->write(path, { { span.filePos, block.data.data() + span.dataPos - block.info.begin, span.size } });
+		markMoveDirty(span.fileIdx, span.filePos, span.size);
+	}
+}
+
+bool mtt::Storage::checkMappedPiece(uint32_t index, uint32_t size, const uint8_t* expectedHash)
+{
+	//piece can span more files and windows, hashed at once like other pieces
+	DataBuffer buffer(size);
+
+	//downloader waits for result before piece is announced, blocks written while mapping was disabled are read from file
+	if (!readPiece(index, buffer, DiskJobClass::InteractiveRead))
+		return false;
+
+	uint8_t hash[SHA_DIGEST_LENGTH];
+	SHA1(buffer.data(), buffer.size(), hash);
+
+	return memcmp(hash, expectedHash, SHA_DIGEST_LENGTH) == 0;
+}
+
+mtt::Storage::MappedWindow* mtt::Storage::getMappedWindow(uint32_t fileIdx, uint64_t pos)
+{
+	const uint64_t windowSize = mtt::config::internal_.storage.mappingWindowSize;
+	auto start = pos - pos % windowSize;
+
+	for (auto& w : mappedWindows)
+	{
+		if (w.fileIdx == fileIdx && w.start == start)
+		{
+			w.lastUse = ++mappedWindowsUse;
+			return &w;
+		}
+	}
+
+	auto& mappedFile = mappedFiles[fileIdx];
+
+	//mapping needs file with full size, allocated by caller before mappingMutex
+	boost::system::error_code ec;
+	auto fileSize = boost::filesystem::file_size(getFullpath(fileIdx), ec);
+
+	if (ec || fileSize < files[fileIdx].size)
+	{
+		closeMappedFile(fileIdx);
+		mappedFile.enabled = false;
+		return nullptr;
+	}
+
+	try
+	{
+		if (!mappedFile.mapping)
+			mappedFile.mapping = std::make_unique<boost::interprocess::file_mapping>(getFullpath(fileIdx).data(), boost::interprocess::read_write);
+
+		auto size = (size_t)std::min(windowSize, files[fileIdx].size - start);
+		auto region = std::make_shared<boost::interprocess::mapped_region>(*mappedFile.mapping, boost::interprocess::read_write, start, size);
+
+		if (mappedWindows.size() >= mtt::config::internal_.storage.maxMappedWindows)
+		{
+			auto oldest = std::min_element(mappedWindows.begin(), mappedWindows.end(), [](const MappedWindow& l, const MappedWindow& r) { return l.lastUse < r.lastUse; });
+			mappedWindows.erase(oldest);
+		}
+
+		mappedWindows.push_back({ fileIdx, start, std::move(region), ++mappedWindowsUse });
+		return &mappedWindows.back();
+	}
+	catch (const boost::interprocess::interprocess_exception&)
+	{
+		//file cant be mapped, use buffered path from now on
+		closeMappedFile(fileIdx);
+		mappedFile.enabled = false;
+	}
+
+	return nullptr;
+}
+
+template<typename F>
+bool mtt::Storage::forMappedData(uint32_t index, uint32_t begin, uint32_t size, F func)
+{
+	uint64_t dataStart = (uint64_t)index * pieceSize + begin;
+	uint64_t dataEnd = dataStart + size;
+
+	for (uint32_t i = 0; i < files.size() && i < mappedFiles.size(); i++)
+	{
+		auto& f = files[i];
+		uint64_t fileStart = (uint64_t)f.startPieceIndex * pieceSize + f.startPiecePos;
+		uint64_t fileEnd = fileStart + f.size;
+
+		if (fileEnd <= dataStart || fileStart >= dataEnd)
+			continue;
+
+		auto pos = std::max(dataStart, fileStart);
+		auto end = std::min(dataEnd, fileEnd);
+
+		{
+			std::lock_guard<std::mutex> guard(mappingMutex);
+
+			if (!mappedFiles[i].enabled)
+				return false;
+		}
+
+		//mapping needs file with full size, allocated without blocking other mapped files
+		if (allocateFile(i, nullptr) != Status::Success)
+			return false;
+
+		while (pos < end)
+		{
+			std::shared_ptr<boost::interprocess::mapped_region> region;
+			uint64_t windowStart = 0;
+
+			{
+				std::lock_guard<std::mutex> guard(mappingMutex);
+
+				if (!mappedFiles[i].enabled)
+					return false;
+
+				auto window = getMappedWindow(i, pos - fileStart);
+
+				if (!window)
+					return false;
+
+				//region stays valid for this copy even if window gets evicted meanwhile
+				region = window->region;
+				windowStart = window->start;
+			}
+
+			auto windowPos = (size_t)(pos - fileStart - windowStart);
+			auto length = (size_t)std::min<uint64_t>(end - pos, region->get_size() - windowPos);
+
+			func((uint8_t*)region->get_address() + windowPos, (uint32_t)(pos - dataStart + begin), length);
+			pos += length;
+		}
+	}
+
+	return true;
+}
+
+void mtt::Storage::flushMappedPiece(uint32_t index, bool async)
+{
+	std::lock_guard<std::mutex> guard(mappingMutex);
+
+	uint64_t dataStart = (uint64_t)index * pieceSize;
+	uint64_t dataEnd = dataStart + getPieceDataSize(index);
+
+	for (auto& w : mappedWindows)
+	{
+		auto& f = files[w.fileIdx];
+		uint64_t windowStart = (uint64_t)f.startPieceIndex * pieceSize + f.startPiecePos + w.start;
+		uint64_t windowEnd = windowStart + w.region->get_size();
+
+		if (windowEnd <= dataStart || windowStart >= dataEnd)
+			continue;
+
+		auto start = std::max(dataStart, windowStart);
+		auto end = std::min(dataEnd, windowEnd);
+		w.region->flush((size_t)(start - windowStart), (size_t)(end - start), async);
+	}
+}
+
+void mtt::Storage::closeMappedFile(uint32_t fileIdx)
+{
+	for (auto it = mappedWindows.begin(); it != mappedWindows.end();)
+	{
+		if (it->fileIdx == fileIdx)
+			it = mappedWindows.erase(it);
+		else
+			it++;
+	}
+
+	mappedFiles[fileIdx].mapping.reset();
+}
+
+uint32_t mtt::Storage::getPieceDataSize(uint32_t index)
+{
+	return (!files.empty() && files.back().endPieceIndex == index) ? files.back().endPiecePos : pieceSize;
 }
 
@@ -1,7 +1,16 @@
 #pragma once
 
 #include "Interface.h"
+#include "StorageBackend.h"
+#include "DiskScheduler.h"
 #include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <array>
+#include <set>
+#include <chrono>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 namespace mtt
 {
@@ -18,26 +27,121 @@ namespace mtt
 
 		void storePiece(DownloadedPiece& piece);
 		PieceBlock getPieceBlock(PieceBlockInfo& piece);
+		//whole piece data shared with cache, stays valid after eviction
+		std::shared_ptr<const DataBuffer> getPieceData(uint32_t index);
+		void preloadPiece(uint32_t index);
 
+		//piece lies fully in selected files which are memory mapped, blocks can be written without piece buffer
+		bool isPieceMapped(uint32_t index);
+		void writeMappedBlock(PieceBlock& block);
+		bool checkMappedPiece(uint32_t index, uint32_t size, const uint8_t* expectedHash);
+		//hash check of single piece on disk, without caching its data
+		bool checkStoredPiece(uint32_t index, const uint8_t* expectedHash);
+
+		void setPreallocationMode(PreallocationMode mode);
+		PreallocationMode getPreallocationMode();
+
+		//selected files get their full size, in sparse mode only when first written
 		Status preallocateSelection(DownloadSelection& files);
+		std::shared_ptr<PreallocationState> preallocateSelectionAsync(DownloadSelection& files, boost::asio::io_service& io, std::function<void(std::shared_ptr<PreallocationState>)> onFinish);
 		DataBuffer checkStoredPieces(std::vector<PieceInfo>& piecesInfo);
 		std::shared_ptr<PiecesCheck> checkStoredPiecesAsync(std::vector<PieceInfo>& piecesInfo, boost::asio::io_service& io, std::function<void(std::shared_ptr<PiecesCheck>)> onFinish);
+		//only pieces of changed files are read, others keep stored state
+		std::shared_ptr<PiecesCheck> checkChangedPiecesAsync(std::vector<PieceInfo>& piecesInfo, const std::vector<uint8_t>& storedPieces, const std::vector<bool>& changedFiles, boost::asio::io_service& io, std::function<void(std::shared_ptr<PiecesCheck>)> onFinish);
+		//size and last write time of each file, zero when missing
+		std::vector<FileFingerprint> getFileFingerprints();
+		//imported by next check when its sampled piece matches and file doesnt have valid data yet
+		void setReusableFiles(const std::vector<ReusableFile>& files);
+		std::string getFilePath(uint32_t fileIdx);
 		void flush();
 
+		//make stored pieces durable according to storage.durability, periodic sync waits for its interval unless forced
+		//returns error of failed write or sync since last call, its pieces stay unsynced
+		Status sync(bool force);
+		//stored pieces which can still be lost with system cache
+		std::vector<uint32_t> getUnsyncedPieces();
+
 		Status deleteAll();
 
+		std::string getPath();
+		//files are copied to new path in background through DiskScheduler, old ones stay in use until each file switches
+		//same filesystem moves are only renamed, interrupted move continues with files left
+		std::shared_ptr<RelocationState> moveAsync(const std::string& path, boost::asio::io_service& io, std::function<void(std::shared_ptr<RelocationState>)> onFinish);
+		//target of unfinished move, empty when none
+		std::string getMovePath();
+		//files of interrupted move found in target path are used from there
+		void restoreMove(std::string path);
+
 	private:
 
-		void checkStoredPieces(PiecesCheck& checkState, const std::vector<PieceInfo>& piecesInfo);
+		void checkStoredPieces(PiecesCheck& checkState, const std::vector<PieceInfo>& piecesInfo, const std::vector<bool>& changedFiles);
 
-		std::string getFullpath(File& file);
+		std::vector<ReusableFile> reusableFiles;
+		void importReusableFiles(const std::vector<PieceInfo>& piecesInfo, const bool& rejected);
+		//chunks are separate Relocation jobs limited by storage.moveSpeed, false when failed or rejected
+		bool copyFileThrottled(const std::string& from, const std::string& to, uint64_t size, const bool& rejected);
+		//pieces lying whole inside file, empty when first > last
+		std::pair<uint32_t, uint32_t> getFilePieces(uint32_t fileIdx);
+		bool checkFilePiece(const std::string& filePath, uint32_t fileIdx, uint32_t pieceIdx, const uint8_t* expectedHash);
+
+		std::string getFullpath(uint32_t fileIdx);
+		std::string getRelativePath(uint32_t fileIdx);
 		void createPath(std::string& path);
 
 		void flushAllFiles();
-		void flush(File& file);
-		Status preallocate(File& file);
+		//write pieces grouped by file, caller holds layoutMutex
+		void writeBatch(const std::vector<std::shared_ptr<DownloadedPiece>>& pieces, std::set<uint32_t>& failed);
+
+		Status selectFiles(DownloadSelection& files, PreallocationState& state);
+		Status preallocatePending(PreallocationState& state);
+		//allocate file if still waiting for it, needed before first write
+		Status allocateFile(uint32_t fileIdx, PreallocationState* state);
+		Status preallocate(uint32_t fileIdx, PreallocationState* state);
+
+		PreallocationMode preallocationMode = PreallocationMode::Sparse;
+		//file is allocated without holding allocationMutex, others wait for it on allocationCv
+		static const uint8_t AllocationPending = 1;
+		static const uint8_t AllocationRunning = 2;
+		std::vector<uint8_t> pendingAllocation;
+		std::mutex allocationMutex;
+		std::condition_variable allocationCv;
+
+		//unselected files missing on disk, their data goes to part file
+		std::vector<uint8_t> partFiles;
+		std::string partFileName;
+
+		static const uint32_t PartFileIdx = (uint32_t)-1;
+
+		//part of piece data stored in file or part file
+		struct DataSpan
+		{
+			uint32_t fileIdx;
+			uint64_t filePos;
+			uint32_t dataPos;
+			size_t size;
+		};
+		//caller holds layoutMutex, part files change only with exclusive lock
+		std::vector<DataSpan> getDataSpans(uint32_t index, uint32_t begin, uint32_t size);
+		std::string getSpanPath(uint32_t fileIdx);
+		void createPartFile();
+		void moveFromPartFile(uint32_t fileIdx);
 
 		std::string path;
+		std::unique_ptr<StorageBackend> backend;
+
+		Status move(std::string path, RelocationState& state);
+		Status moveFile(uint32_t fileIdx, RelocationState& state);
+		//files already switched to movePath
+		std::string movePath;
+		std::vector<uint8_t> movedFiles;
+		bool movedPartFile = false;
+
+		//ranges written to file being copied, copied again before switch
+		static const uint32_t NoFile = (uint32_t)-2;
+		uint32_t movingFile = NoFile;
+		std::vector<std::pair<uint64_t, uint64_t>> moveDirty;
+		std::mutex moveMutex;
+		void markMoveDirty(uint32_t fileIdx, uint64_t pos, uint64_t size);
 
 		template<typename T, uint32_t max>
 		struct CachedData
@@ -60,19 +164,78 @@ namespace mtt
 			}
 		};
 
-		CachedData<DownloadedPiece, 6> unsavedPieces;
+		//stored pieces waiting for batch write and batches being written
+		std::vector<std::shared_ptr<DownloadedPiece>> unsavedPieces;
+		std::vector<std::shared_ptr<DownloadedPiece>> writingPieces;
+		static const uint32_t UnsavedPiecesBatch = 6;
 		std::mutex storageMutex;
+		std::condition_variable writtenCv;
+		std::shared_ptr<DataBuffer> getUnsavedPieceData(uint32_t index);
+
+		//writes of one file are serialized, sector edges may be shared by neighbouring blocks
+		std::array<std::mutex, 16> fileLocks;
+		std::mutex& getFileLock(uint32_t fileIdx) { return fileLocks[fileIdx % fileLocks.size()]; }
+
+		//shared by data transfers, exclusive when files layout changes
+		std::shared_timed_mutex layoutMutex;
+
+		std::vector<uint32_t> unsyncedPieces;
+		//taken by running sync, still not durable
+		std::vector<uint32_t> syncingPieces;
+		uint64_t unsyncedBytes = 0;
+		//pieces which failed to be written, never durable
+		std::vector<uint32_t> failedPieces;
+		Status writeError = Status::Success;
+		std::chrono::steady_clock::time_point lastSync = std::chrono::steady_clock::now();
+		std::mutex syncMutex;
+		void addUnsyncedPiece(uint32_t index);
 
 		struct CachedPiece
 		{
 			uint32_t index;
-			DataBuffer data;
+			std::shared_ptr<DataBuffer> data;
+			//counted in MemoryGovernor until replaced
+			uint64_t reserved = 0;
 		};
-		CachedData<CachedPiece, 16> cachedPieces;
-		std::mutex cacheMutex;
+		//split by piece index, loads of pieces in other shards dont wait
+		struct CacheShard
+		{
+			CachedData<CachedPiece, 4> pieces;
+			std::mutex mutex;
+		};
+		std::array<CacheShard, 4> cacheShards;
+		void releaseCache(CachedPiece&);
+		void clearCache();
+
+		std::shared_ptr<DataBuffer> loadPiece(uint32_t pieceId);
+		bool readPiece(uint32_t index, DataBuffer& buffer, DiskJobClass type);
 
-		CachedPiece& loadPiece(uint32_t pieceId);
-		void loadPiece(File& file, CachedPiece& piece);
+		struct MappedFile
+		{
+			bool enabled = false;
+			std::unique_ptr<boost::interprocess::file_mapping> mapping;
+		};
+		std::vector<MappedFile> mappedFiles;
+
+		struct MappedWindow
+		{
+			uint32_t fileIdx;
+			uint64_t start;
+			std::shared_ptr<boost::interprocess::mapped_region> region;
+			uint64_t lastUse;
+		};
+		std::vector<MappedWindow> mappedWindows;
+		uint64_t mappedWindowsUse = 0;
+		std::mutex mappingMutex;
+
+		MappedWindow* getMappedWindow(uint32_t fileIdx, uint64_t pos);
+		template<typename F>
+		bool forMappedData(uint32_t index, uint32_t begin, uint32_t size, F func);
+		void flushMappedPiece(uint32_t index, bool async);
+		//block of mapped piece which couldnt be written to mapping
+		void writeBlock(PieceBlock& block);
+		void closeMappedFile(uint32_t fileIdx);
+		uint32_t getPieceDataSize(uint32_t index);
 
 		std::vector<File> files;
 		uint32_t pieceSize;
@@ -0,0 +1,571 @@
+#include "StorageBackend.h"
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cstdlib>
+#endif
+
+namespace mtt
+{
+	class StreamStorageBackend : public StorageBackend
+	{
+	public:
+
+		virtual bool read(const std::string& path, const std::vector<FileBlock>& blocks) override
+		{
+			std::ifstream file(path, std::ios_base::binary | std::ios_base::in);
+
+			for (auto& b : blocks)
+			{
+				file.seekg(b.pos);
+				file.read((char*)b.data, b.size);
+			}
+
+			return !file.fail();
+		}
+
+		virtual bool write(const std::string& path, const std::vector<FileBlock>& blocks) override
+		{
+			std::ofstream file(path, std::ios_base::binary | std::ios_base::in);
+
+			if (!file)
+				file.open(path, std::ios_base::binary);
+
+			for (auto& b : blocks)
+			{
+				file.seekp(b.pos);
+				file.write((const char*)b.data, b.size);
+			}
+
+			return !file.fail();
+		}
+
+		virtual void closeFiles() override
+		{
+		}
+	};
+
+#ifdef _WIN32
+	/*
+	All blocks of a call are submitted at once as overlapped operations on a cached handle and then awaited together,
+	so a flush of several pieces costs one open instead of one per flush and the disk gets the whole batch queued.
+	Least recently used handles are closed over limit, files only read are opened read only.
+	*/
+	class OverlappedStorageBackend : public StorageBackend
+	{
+	public:
+
+		~OverlappedStorageBackend()
+		{
+			closeFiles();
+		}
+
+		virtual bool read(const std::string& path, const std::vector<FileBlock>& blocks) override
+		{
+			return transfer(path, blocks, false);
+		}
+
+		virtual bool write(const std::string& path, const std::vector<FileBlock>& blocks) override
+		{
+			return transfer(path, blocks, true);
+		}
+
+		virtual void closeFiles() override
+		{
+			std::lock_guard<std::mutex> guard(handlesMutex);
+
+			//transfers in progress keep their handle until finished
+			handles.clear();
+		}
+
+	private:
+
+		static const size_t MaxOpenHandles = 32;
+
+		bool transfer(const std::string& path, const std::vector<FileBlock>& blocks, bool write)
+		{
+			auto fileHandle = getHandle(path, write);
+
+			if (!fileHandle)
+				return false;
+
+			auto handle = fileHandle.get();
+
+			std::vector<OVERLAPPED> ops(blocks.size());
+			bool success = true;
+
+			for (size_t i = 0; i < blocks.size(); i++)
+			{
+				auto& o = ops[i];
+				memset(&o, 0, sizeof(OVERLAPPED));
+				o.Offset = (DWORD)blocks[i].pos;
+				o.OffsetHigh = (DWORD)(blocks[i].pos >> 32);
+				o.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+
+				BOOL result = write ? WriteFile(handle, blocks[i].data, (DWORD)blocks[i].size, nullptr, &o) : ReadFile(handle, blocks[i].data, (DWORD)blocks[i].size, nullptr, &o);
+
+				if (!result && GetLastError() != ERROR_IO_PENDING)
+				{
+					success = false;
+					CloseHandle(o.hEvent);
+					o.hEvent = nullptr;
+				}
+			}
+
+			for (auto& o : ops)
+			{
+				if (!o.hEvent)
+					continue;
+
+				DWORD transferred = 0;
+				if (!GetOverlappedResult(handle, &o, &transferred, TRUE))
+					success = false;
+
+				CloseHandle(o.hEvent);
+			}
+
+			return success;
+		}
+
+		std::shared_ptr<void> getHandle(const std::string& path, bool write)
+		{
+			std::lock_guard<std::mutex> guard(handlesMutex);
+
+			auto it = handles.find(path);
+			if (it != handles.end() && (it->second.writable || !write))
+			{
+				it->second.lastUse = ++useCounter;
+				return it->second.handle;
+			}
+
+			auto handle = CreateFileA(path.data(), write ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+				write ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, nullptr);
+
+			if (handle == INVALID_HANDLE_VALUE)
+				return nullptr;
+
+			if (it == handles.end() && handles.size() >= MaxOpenHandles)
+			{
+				auto oldest = std::min_element(handles.begin(), handles.end(), [](const std::pair<const std::string, OpenHandle>& l, const std::pair<const std::string, OpenHandle>& r) { return l.second.lastUse < r.second.lastUse; });
+				handles.erase(oldest);
+			}
+
+			//read only handle is replaced when file gets written
+			auto& cached = handles[path];
+			cached.handle = std::shared_ptr<void>(handle, CloseHandle);
+			cached.writable = write;
+			cached.lastUse = ++useCounter;
+
+			return cached.handle;
+		}
+
+		struct OpenHandle
+		{
+			std::shared_ptr<void> handle;
+			bool writable = false;
+			uint64_t lastUse = 0;
+		};
+		std::map<std::string, OpenHandle> handles;
+		uint64_t useCounter = 0;
+		std::mutex handlesMutex;
+	};
+#endif
+
+	//sector aligned buffers reused between transfers
+	class AlignedBufferPool
+	{
+	public:
+
+		static const size_t Alignment = 4096;
+		static const size_t BufferSize = 1024 * 1024;
+		static const size_t MaxFreeBuffers = 8;
+
+		~AlignedBufferPool()
+		{
+			for (auto b : freeBuffers)
+				release(b);
+		}
+
+		uint8_t* get()
+		{
+			{
+				std::lock_guard<std::mutex> guard(poolMutex);
+
+				if (!freeBuffers.empty())
+				{
+					auto b = freeBuffers.back();
+					freeBuffers.pop_back();
+					return b;
+				}
+			}
+
+#ifdef _WIN32
+			return (uint8_t*)_aligned_malloc(BufferSize, Alignment);
+#else
+			void* b = nullptr;
+			return posix_memalign(&b, Alignment, BufferSize) == 0 ? (uint8_t*)b : nullptr;
+#endif
+		}
+
+		void put(uint8_t* b)
+		{
+			{
+				std::lock_guard<std::mutex> guard(poolMutex);
+
+				if (freeBuffers.size() < MaxFreeBuffers)
+				{
+					freeBuffers.push_back(b);
+					return;
+				}
+			}
+
+			release(b);
+		}
+
+	private:
+
+		void release(uint8_t* b)
+		{
+#ifdef _WIN32
+			_aligned_free(b);
+#else
+			free(b);
+#endif
+		}
+
+		std::vector<uint8_t*> freeBuffers;
+		std::mutex poolMutex;
+	};
+
+	/*
+	Files opened without system caching, Storage piece caches are the only caching layer.
+	Unaligned blocks are extended to whole sectors, partially written edge sectors are read first.
+	*/
+	class DirectStorageBackend : public StorageBackend
+	{
+	public:
+
+		~DirectStorageBackend()
+		{
+			closeFiles();
+		}
+
+		virtual bool read(const std::string& path, const std::vector<FileBlock>& blocks) override
+		{
+			auto file = getFile(path, false);
+
+			if (file == InvalidFile)
+				return false;
+
+			auto buffer = pool.get();
+			bool success = buffer != nullptr;
+
+			for (auto& b : blocks)
+			{
+				size_t done = 0;
+
+				while (success && done < b.size)
+				{
+					auto pos = b.pos + done;
+					auto alignedPos = pos - pos % Alignment;
+					auto length = std::min(b.size - done, BufferSize - (size_t)(pos - alignedPos) - Alignment);
+					auto alignedSize = alignUp(pos + length) - alignedPos;
+
+					auto readSize = readAt(file, alignedPos, buffer, alignedSize);
+					auto available = readSize > (pos - alignedPos) ? std::min(length, (size_t)(readSize - (pos - alignedPos))) : 0;
+
+					memcpy(b.data + done, buffer + (pos - alignedPos), available);
+					success = available == length;
+					done += length;
+				}
+			}
+
+			if (buffer)
+				pool.put(buffer);
+
+			return success;
+		}
+
+		virtual bool write(const std::string& path, const std::vector<FileBlock>& blocks) override
+		{
+			auto file = getFile(path, true);
+
+			if (file == InvalidFile)
+				return false;
+
+			auto buffer = pool.get();
+			bool success = buffer != nullptr;
+			auto fileSize = getFileSize(file);
+			auto writtenEnd = fileSize;
+			uint64_t alignedEnd = 0;
+
+			for (auto& b : blocks)
+			{
+				size_t done = 0;
+
+				while (success && done < b.size)
+				{
+					auto pos = b.pos + done;
+					auto alignedPos = pos - pos % Alignment;
+					auto length = std::min(b.size - done, BufferSize - (size_t)(pos - alignedPos) - Alignment);
+					auto end = pos + length;
+					auto alignedSize = alignUp(end) - alignedPos;
+
+					//keep existing data around block in edge sectors
+					if (pos != alignedPos)
+						readSector(file, alignedPos, buffer);
+					if (end % Alignment && (alignedSize > Alignment || pos == alignedPos))
+						readSector(file, alignedPos + alignedSize - Alignment, buffer + alignedSize - Alignment);
+
+					memcpy(buffer + (pos - alignedPos), b.data + done, length);
+					success = writeAt(file, alignedPos, buffer, alignedSize);
+
+					writtenEnd = std::max(writtenEnd, end);
+					alignedEnd = std::max(alignedEnd, alignedPos + alignedSize);
+					done += length;
+				}
+			}
+
+			//cut sector padding past real end of data
+			if (alignedEnd > writtenEnd)
+				setFileSize(file, writtenEnd);
+
+			if (buffer)
+				pool.put(buffer);
+
+			return success;
+		}
+
+		virtual void closeFiles() override
+		{
+			std::lock_guard<std::mutex> guard(filesMutex);
+
+			for (auto& f : openFiles)
+				closeFile(f.second);
+
+			openFiles.clear();
+		}
+
+	private:
+
+		static const size_t Alignment = AlignedBufferPool::Alignment;
+		static const size_t BufferSize = AlignedBufferPool::BufferSize;
+
+		static uint64_t alignUp(uint64_t pos)
+		{
+			return (pos + Alignment - 1) / Alignment * Alignment;
+		}
+
+#ifdef _WIN32
+		using FileHandle = HANDLE;
+		const FileHandle InvalidFile = INVALID_HANDLE_VALUE;
+
+		FileHandle openFile(const std::string& path, bool create)
+		{
+			return CreateFileA(path.data(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+				create ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, nullptr);
+		}
+
+		void closeFile(FileHandle file)
+		{
+			CloseHandle(file);
+		}
+
+		size_t readAt(FileHandle file, uint64_t pos, uint8_t* buffer, size_t size)
+		{
+			OVERLAPPED o = {};
+			o.Offset = (DWORD)pos;
+			o.OffsetHigh = (DWORD)(pos >> 32);
+
+			DWORD readSize = 0;
+			if (!ReadFile(file, buffer, (DWORD)size, &readSize, &o))
+				return 0;
+
+			return readSize;
+		}
+
+		bool writeAt(FileHandle file, uint64_t pos, const uint8_t* buffer, size_t size)
+		{
+			OVERLAPPED o = {};
+			o.Offset = (DWORD)pos;
+			o.OffsetHigh = (DWORD)(pos >> 32);
+
+			DWORD written = 0;
+			return WriteFile(file, buffer, (DWORD)size, &written, &o) && written == size;
+		}
+
+		uint64_t getFileSize(FileHandle file)
+		{
+			LARGE_INTEGER size;
+			return GetFileSizeEx(file, &size) ? (uint64_t)size.QuadPart : 0;
+		}
+
+		void setFileSize(FileHandle file, uint64_t size)
+		{
+			FILE_END_OF_FILE_INFO info;
+			info.EndOfFile.QuadPart = (LONGLONG)size;
+			SetFileInformationByHandle(file, FileEndOfFileInfo, &info, sizeof(info));
+		}
+#else
+		using FileHandle = int;
+		const FileHandle InvalidFile = -1;
+
+		FileHandle openFile(const std::string& path, bool create)
+		{
+			return open(path.data(), O_RDWR | O_DIRECT | (create ? O_CREAT : 0), 0644);
+		}
+
+		void closeFile(FileHandle file)
+		{
+			close(file);
+		}
+
+		size_t readAt(FileHandle file, uint64_t pos, uint8_t* buffer, size_t size)
+		{
+			auto readSize = pread(file, buffer, size, (off_t)pos);
+			return readSize > 0 ? (size_t)readSize : 0;
+		}
+
+		bool writeAt(FileHandle file, uint64_t pos, const uint8_t* buffer, size_t size)
+		{
+			return pwrite(file, buffer, size, (off_t)pos) == (ssize_t)size;
+		}
+
+		uint64_t getFileSize(FileHandle file)
+		{
+			struct stat info;
+			return fstat(file, &info) == 0 ? (uint64_t)info.st_size : 0;
+		}
+
+		void setFileSize(FileHandle file, uint64_t size)
+		{
+			if (ftruncate(file, (off_t)size) != 0)
+				return;
+		}
+#endif
+
+		void readSector(FileHandle file, uint64_t pos, uint8_t* buffer)
+		{
+			auto readSize = readAt(file, pos, buffer, Alignment);
+			memset(buffer + readSize, 0, Alignment - readSize);
+		}
+
+		FileHandle getFile(const std::string& path, bool create)
+		{
+			std::lock_guard<std::mutex> guard(filesMutex);
+
+			auto it = openFiles.find(path);
+			if (it != openFiles.end())
+				return it->second;
+
+			auto file = openFile(path, create);
+
+			if (file != InvalidFile)
+				openFiles[path] = file;
+
+			return file;
+		}
+
+		std::map<std::string, FileHandle> openFiles;
+		std::mutex filesMutex;
+
+		AlignedBufferPool pool;
+	};
+}
+
+std::unique_ptr<mtt::StorageBackend> mtt::StorageBackend::create(StorageBackendType type)
+{
+	if (type == StorageBackendType::Direct)
+		return std::make_unique<DirectStorageBackend>();
+
+#ifdef _WIN32
+	if (type == StorageBackendType::Overlapped)
+		return std::make_unique<OverlappedStorageBackend>();
+#endif
+
+	return std::make_unique<StreamStorageBackend>();
+}
+
+bool mtt::StorageBackend::allocateFile(const std::string& path, uint64_t size, bool sparse)
+{
+#ifdef _WIN32
+	auto handle = CreateFileA(path.data(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (handle == INVALID_HANDLE_VALUE)
+		return false;
+
+	bool success = true;
+
+	if (sparse)
+	{
+		DWORD returned = 0;
+		DeviceIoControl(handle, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &returned, nullptr);
+	}
+	else
+	{
+		FILE_ALLOCATION_INFO allocation;
+		allocation.AllocationSize.QuadPart = (LONGLONG)size;
+		success = SetFileInformationByHandle(handle, FileAllocationInfo, &allocation, sizeof(allocation)) != 0;
+	}
+
+	FILE_END_OF_FILE_INFO end;
+	end.EndOfFile.QuadPart = (LONGLONG)size;
+	success = success && SetFileInformationByHandle(handle, FileEndOfFileInfo, &end, sizeof(end));
+
+	CloseHandle(handle);
+
+	return success;
+#else
+	int file = open(path.data(), O_RDWR | O_CREAT, 0644);
+
+	if (file == -1)
+		return false;
+
+	bool success = ftruncate(file, (off_t)size) == 0;
+
+	if (success && !sparse && size)
+		success = posix_fallocate(file, 0, (off_t)size) == 0;
+
+	close(file);
+
+	return success;
+#endif
+}
+
+bool mtt::StorageBackend::syncFile(const std::string& path)
+{
+#ifdef _WIN32
+	auto handle = CreateFileA(path.data(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (handle == INVALID_HANDLE_VALUE)
+		return false;
+
+	bool success = FlushFileBuffers(handle) != 0;
+
+	CloseHandle(handle);
+
+	return success;
+#else
+	int file = open(path.data(), O_RDWR);
+
+	if (file == -1)
+		return false;
+
+	bool success = fsync(file) == 0;
+
+	close(file);
+
+	return success;
+#endif
+}
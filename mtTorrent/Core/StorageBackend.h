@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+namespace mtt
+{
+	enum class StorageBackendType
+	{
+		//fstream per operation
+		Stream,
+		//kept open handles with batched overlapped operations
+		Overlapped,
+		//bypass system page cache, sector aligned transfers through pooled buffers
+		Direct
+	};
+
+	struct FileBlock
+	{
+		uint64_t pos;
+		uint8_t* data;
+		size_t size;
+	};
+
+	/*
+	File access used by Storage, all blocks of one call belong to the same file and can be processed together.
+	Missing file is created on write.
+	*/
+	class StorageBackend
+	{
+	public:
+
+		virtual ~StorageBackend() {}
+
+		virtual bool read(const std::string& path, const std::vector<FileBlock>& blocks) = 0;
+		virtual bool write(const std::string& path, const std::vector<FileBlock>& blocks) = 0;
+
+		//release any kept file handles, needed before files are moved or deleted
+		virtual void closeFiles() = 0;
+
+		static std::unique_ptr<StorageBackend> create(StorageBackendType type);
+
+		//set file size without writing data, sparse file gets disk space only when written, otherwise space is reserved
+		static bool allocateFile(const std::string& path, uint64_t size, bool sparse);
+		//write cached data of file to disk and wait for it
+		static bool syncFile(const std::string& path);
+	};
+}
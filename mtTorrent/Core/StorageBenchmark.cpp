@@ -0,0 +1,303 @@
+#include "StorageBenchmark.h"
+#include "Storage.h"
+#include <boost/filesystem.hpp>
+#include <openssl/sha.h>
+#include <algorithm>
+#include <sstream>
+#include <chrono>
+#include <cmath>
+
+mtt::StorageBenchmark::StorageBenchmark(const StorageBenchmarkSettings& s) : settings(s), random(s.randomSeed)
+{
+}
+
+template<typename F>
+void mtt::StorageBenchmark::measure(const char* name, uint32_t operations, F func)
+{
+	measure(name, operations, [](uint32_t) {}, func);
+}
+
+template<typename P, typename F>
+void mtt::StorageBenchmark::measure(const char* name, uint32_t operations, P prepare, F func)
+{
+	StorageBenchmarkResult::Measurement m;
+	m.name = name;
+	m.operations = operations;
+
+	latencies.clear();
+	latencies.reserve(operations);
+
+	for (uint32_t i = 0; i < operations; i++)
+	{
+		prepare(i);
+
+		auto start = std::chrono::high_resolution_clock::now();
+
+		m.bytes += func(i);
+
+		latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+		m.seconds += latencies.back() / 1000;
+	}
+
+	if (!latencies.empty())
+	{
+		std::sort(latencies.begin(), latencies.end());
+
+		auto percentile = [this](double p) { return latencies[(size_t)(p * (latencies.size() - 1))]; };
+		m.latencyP50 = percentile(0.5);
+		m.latencyP90 = percentile(0.9);
+		m.latencyP99 = percentile(0.99);
+		m.latencyMax = latencies.back();
+	}
+
+	result.measurements.push_back(m);
+}
+
+mtt::StorageBenchmarkResult mtt::StorageBenchmark::run()
+{
+	result.settings = settings;
+	createTorrent();
+
+	auto& storageConfig = mtt::config::internal_.storage;
+	auto originalConfig = storageConfig;
+	storageConfig.directIo = settings.directIo;
+	storageConfig.overlappedIo = settings.overlappedIo;
+	storageConfig.memoryMapping = settings.memoryMapping;
+	storageConfig.durability = settings.durability;
+
+	//scheduler stats are global, only jobs of this run are reported
+	std::array<DiskJobStats, (size_t)DiskJobClass::Count> startStats;
+	for (size_t i = 0; i < startStats.size(); i++)
+		startStats[i] = DiskScheduler::get().getStats((DiskJobClass)i);
+
+	auto path = settings.path;
+	bool tempPath = path.empty();
+	if (tempPath)
+		path = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("mtt-benchmark-%%%%%%%%")).string();
+
+	boost::system::error_code ec;
+	boost::filesystem::create_directories(path, ec);
+
+	DownloadSelection selection;
+	for (auto& f : info.files)
+		selection.files.push_back({ true, f });
+
+	Storage storage(info);
+	storage.setPath(path);
+	storage.setPreallocationMode(settings.preallocation);
+
+	auto piecesCount = (uint32_t)info.pieces.size();
+
+	measure("preallocate", 1, [&](uint32_t)
+		{
+			storage.preallocateSelection(selection);
+			return (uint64_t)info.fullSize;
+		});
+
+	DownloadedPiece piece;
+	std::vector<PieceBlock> pieceBlocks;
+	measure("write", piecesCount + 1,
+		[&](uint32_t i)
+		{
+			if (i == piecesCount)
+				return;
+
+			piece.mapped = storage.isPieceMapped(i);
+			piece.data.resize(info.getPieceSize(i));
+			fillPieceData(i, piece.data);
+			pieceBlocks.clear();
+
+			//mapped piece is stored as received blocks, without piece buffer
+			if (piece.mapped)
+			{
+				for (auto& blockInfo : info.makePieceBlocksInfo(i))
+				{
+					pieceBlocks.emplace_back();
+					pieceBlocks.back().info = blockInfo;
+					pieceBlocks.back().data.assign(piece.data.begin() + blockInfo.begin, piece.data.begin() + blockInfo.begin + blockInfo.length);
+				}
+
+				piece.data.clear();
+			}
+
+			piece.init(i, info.getPieceSize(i), info.getPieceBlocksCount(i));
+		},
+		[&](uint32_t i) -> uint64_t
+		{
+			//last operation writes remaining batched pieces
+			if (i == piecesCount)
+			{
+				storage.flush();
+				storage.sync(true);
+				return 0;
+			}
+
+			for (auto& block : pieceBlocks)
+				storage.writeMappedBlock(block);
+
+			storage.storePiece(piece);
+
+			return info.getPieceSize(i);
+		});
+
+	auto readBlock = [&](PieceBlockInfo& blockInfo) -> uint64_t
+	{
+		auto block = storage.getPieceBlock(blockInfo);
+
+		if (block.data.size() != blockInfo.length)
+			result.dataValid = false;
+
+		return block.data.size();
+	};
+
+	std::vector<PieceBlockInfo> blocks;
+	for (uint32_t i = 0; i < piecesCount; i++)
+	{
+		auto pieceBlocks = info.makePieceBlocksInfo(i);
+		blocks.insert(blocks.end(), pieceBlocks.begin(), pieceBlocks.end());
+	}
+
+	measure("sequential_read", (uint32_t)blocks.size(), [&](uint32_t i) { return readBlock(blocks[i]); });
+
+	std::uniform_int_distribution<size_t> randomBlock(0, blocks.size() - 1);
+	measure("random_read", settings.randomReads, [&](uint32_t) { return readBlock(blocks[randomBlock(random)]); });
+
+	measure("recheck", 1, [&](uint32_t)
+		{
+			auto pieces = storage.checkStoredPieces(info.pieces);
+
+			if (std::find(pieces.begin(), pieces.end(), 0) != pieces.end())
+				result.dataValid = false;
+
+			return (uint64_t)info.fullSize;
+		});
+
+	for (size_t i = 0; i < startStats.size(); i++)
+	{
+		auto stats = DiskScheduler::get().getStats((DiskJobClass)i);
+		stats.jobs -= startStats[i].jobs;
+
+		for (size_t b = 0; b < stats.latency.size(); b++)
+			stats.latency[b] -= startStats[i].latency[b];
+
+		result.diskJobs[i] = stats;
+	}
+
+	storage.deleteAll();
+
+	if (tempPath)
+		boost::filesystem::remove_all(path, ec);
+
+	storageConfig = originalConfig;
+
+	return result;
+}
+
+void mtt::StorageBenchmark::createTorrent()
+{
+	info.name = "benchmark";
+	memset(info.hash, 0xbe, sizeof(info.hash));
+	info.pieceSize = settings.pieceSize;
+	info.fullSize = (size_t)settings.totalSize;
+
+	auto filesCount = std::max(1u, settings.filesCount);
+
+	double weightsSum = 0;
+	for (uint32_t i = 0; i < filesCount; i++)
+		weightsSum += std::pow(settings.fileSizeRatio, i);
+
+	uint64_t offset = 0;
+	for (uint32_t i = 0; i < filesCount; i++)
+	{
+		uint64_t size = (i + 1 == filesCount) ? info.fullSize - offset : (uint64_t)(info.fullSize * std::pow(settings.fileSizeRatio, i) / weightsSum);
+		size = std::max<uint64_t>(size, 1);
+
+		auto end = offset + size;
+		auto endPiece = (uint32_t)((end - 1) / info.pieceSize);
+
+		info.files.push_back({ { "file" + std::to_string(i) + ".bin" }, (size_t)size, (uint32_t)(offset / info.pieceSize), (uint32_t)(offset % info.pieceSize),
+			endPiece, (uint32_t)(end - (uint64_t)endPiece * info.pieceSize) });
+
+		offset = end;
+	}
+	info.fullSize = (size_t)offset;
+
+	info.lastPieceIndex = info.files.back().endPieceIndex;
+	info.lastPieceSize = info.files.back().endPiecePos;
+	info.lastPieceLastBlockIndex = (info.lastPieceSize - 1) / BlockRequestMaxSize;
+	info.lastPieceLastBlockSize = info.lastPieceSize - (info.lastPieceLastBlockIndex * BlockRequestMaxSize);
+
+	auto piecesCount = info.lastPieceIndex + 1;
+	info.pieces.resize(piecesCount);
+	info.expectedBitfieldSize = piecesCount / 8 + (piecesCount % 8 > 0 ? 1 : 0);
+
+	DataBuffer pieceData;
+	for (uint32_t i = 0; i < piecesCount; i++)
+	{
+		pieceData.resize(info.getPieceSize(i));
+		fillPieceData(i, pieceData);
+
+		SHA1(pieceData.data(), pieceData.size(), info.pieces[i].hash);
+	}
+}
+
+void mtt::StorageBenchmark::fillPieceData(uint32_t idx, DataBuffer& data)
+{
+	//cheap to generate so it doesnt distort write times, unique for each piece
+	uint64_t value = (idx + 1) * 0x9E3779B97F4A7C15ull;
+	size_t i = 0;
+
+	for (; i + sizeof(value) <= data.size(); i += sizeof(value))
+	{
+		memcpy(data.data() + i, &value, sizeof(value));
+		value += 0x632BE59BD9B4E019ull;
+	}
+
+	for (; i < data.size(); i++)
+		data[i] = (uint8_t)(value >> (8 * (i % 8)));
+}
+
+std::string mtt::StorageBenchmarkResult::toJson() const
+{
+	std::ostringstream out;
+	out << "{\"settings\":{\"pieceSize\":" << settings.pieceSize << ",\"totalSize\":" << settings.totalSize << ",\"filesCount\":" << settings.filesCount
+		<< ",\"fileSizeRatio\":" << settings.fileSizeRatio << ",\"preallocation\":" << (int)settings.preallocation << ",\"randomReads\":" << settings.randomReads
+		<< ",\"randomSeed\":" << settings.randomSeed << ",\"directIo\":" << (settings.directIo ? "true" : "false") << ",\"overlappedIo\":" << (settings.overlappedIo ? "true" : "false")
+		<< ",\"memoryMapping\":" << (settings.memoryMapping ? "true" : "false") << ",\"durability\":" << (int)settings.durability << "},\"dataValid\":" << (dataValid ? "true" : "false") << ",\"measurements\":[";
+
+	for (size_t i = 0; i < measurements.size(); i++)
+	{
+		auto& m = measurements[i];
+		auto seconds = std::max(m.seconds, 1e-9);
+
+		if (i)
+			out << ",";
+
+		out << "{\"name\":\"" << m.name << "\",\"bytes\":" << m.bytes << ",\"operations\":" << m.operations << ",\"seconds\":" << m.seconds
+			<< ",\"MBps\":" << m.bytes / (1024.0 * 1024) / seconds << ",\"opsPerSecond\":" << m.operations / seconds
+			<< ",\"latencyMs\":{\"p50\":" << m.latencyP50 << ",\"p90\":" << m.latencyP90 << ",\"p99\":" << m.latencyP99 << ",\"max\":" << m.latencyMax << "}}";
+	}
+
+	//bucket i counts jobs under 2^i ms, last one everything longer
+	const char* jobClassNames[] = { "interactiveRead", "uploadRead", "downloadWrite", "checkRead", "preallocation", "relocation" };
+	static_assert(sizeof(jobClassNames) / sizeof(*jobClassNames) == (size_t)DiskJobClass::Count, "missing DiskJobClass name");
+
+	out << "],\"diskJobs\":{";
+
+	for (size_t i = 0; i < diskJobs.size(); i++)
+	{
+		if (i)
+			out << ",";
+
+		out << "\"" << jobClassNames[i] << "\":{\"jobs\":" << diskJobs[i].jobs << ",\"latencyBuckets\":[";
+
+		for (size_t b = 0; b < diskJobs[i].latency.size(); b++)
+			out << (b ? "," : "") << diskJobs[i].latency[b];
+
+		out << "]}";
+	}
+
+	out << "}}";
+
+	return out.str();
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "Interface.h"
+#include "DiskScheduler.h"
+#include "Configuration.h"
+#include <random>
+
+namespace mtt
+{
+	struct StorageBenchmarkSettings
+	{
+		//empty creates unique directory in system temp
+		std::string path;
+
+		uint32_t pieceSize = 1024 * 1024;
+		uint64_t totalSize = 1024ull * 1024 * 1024;
+		uint32_t filesCount = 4;
+		//each next file is this many times bigger than previous one, 1 makes all files equal
+		float fileSizeRatio = 1.f;
+
+		PreallocationMode preallocation = PreallocationMode::Full;
+
+		//storage config used during run, restored after
+		bool directIo = false;
+		bool overlappedIo = true;
+		bool memoryMapping = false;
+		config::Durability durability = config::Durability::None;
+
+		uint32_t randomReads = 16384;
+		uint32_t randomSeed = 1;
+	};
+
+	struct StorageBenchmarkResult
+	{
+		StorageBenchmarkSettings settings;
+
+		struct Measurement
+		{
+			std::string name;
+			uint64_t bytes = 0;
+			uint64_t operations = 0;
+			double seconds = 0;
+
+			//milliseconds of single operation
+			double latencyP50 = 0;
+			double latencyP90 = 0;
+			double latencyP99 = 0;
+			double latencyMax = 0;
+		};
+		std::vector<Measurement> measurements;
+
+		bool dataValid = true;
+
+		//DiskScheduler jobs of each DiskJobClass during run, with queued and running latency histogram
+		std::array<DiskJobStats, (size_t)DiskJobClass::Count> diskJobs = {};
+
+		//one json object, throughput in MB/s and ops/s
+		std::string toJson() const;
+	};
+
+	/*
+	Measures Storage on synthetic torrent in real directory: preallocation, piece writes, sequential and random block reads and recheck.
+	Directory content is deleted when finished.
+	*/
+	class StorageBenchmark
+	{
+	public:
+
+		StorageBenchmark(const StorageBenchmarkSettings&);
+
+		StorageBenchmarkResult run();
+
+	private:
+
+		void createTorrent();
+		void fillPieceData(uint32_t idx, DataBuffer& data);
+
+		template<typename F>
+		void measure(const char* name, uint32_t operations, F func);
+		//prepare(i) runs before time of operation i is measured
+		template<typename P, typename F>
+		void measure(const char* name, uint32_t operations, P prepare, F func);
+
+		StorageBenchmarkSettings settings;
+		StorageBenchmarkResult result;
+		std::mt19937 random;
+
+		TorrentInfo info;
+		std::vector<double> latencies;
+	};
+}
@@ -0,0 +1,354 @@
+#include "SwarmSimulator.h"
+#include "Torrent.h"
+#include "Peers.h"
+#include "FileTransfer.h"
+#include "MetadataDownload.h"
+#include <chrono>
+
+const uint64_t TimeUnit = 1000 * 1000;
+
+mtt::SwarmSimulator::SimulatedPeer::SimulatedPeer(SwarmSimulator& s, uint32_t i) : PeerCommunication(s.torrent->infoFile.info, s.listener), id(i), sim(s)
+{
+	state.action = PeerCommunicationState::Established;
+	state.finishedHandshake = true;
+}
+
+void mtt::SwarmSimulator::SimulatedPeer::setInterested(bool enabled)
+{
+	if (state.amInterested == enabled)
+		return;
+
+	state.amInterested = enabled;
+
+	if (enabled)
+		sim.onInterested(this);
+}
+
+void mtt::SwarmSimulator::SimulatedPeer::requestPieceBlock(PieceBlockInfo& pieceInfo)
+{
+	sim.onRequest(this, pieceInfo);
+}
+
+std::string mtt::SwarmSimulator::SimulatedPeer::getAddressName()
+{
+	return "sim" + std::to_string(id);
+}
+
+template<typename F>
+void mtt::SwarmSimulator::measurePicker(F func)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	func();
+
+	result.pickerTimeMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	result.pickerCalls++;
+}
+
+mtt::SwarmSimulator::SwarmSimulator(const SwarmSimulationSettings& s) : settings(s), random(s.randomSeed)
+{
+}
+
+mtt::SwarmSimulator::~SwarmSimulator()
+{
+	activePeers.clear();
+	peers.clear();
+}
+
+mtt::SwarmSimulationResult mtt::SwarmSimulator::run()
+{
+	createTorrent();
+	downloader = std::make_unique<Downloader>(torrent);
+
+	for (uint32_t i = 0; i < settings.peersCount; i++)
+		addPeer();
+
+	schedule(settings.chokeRoundInterval * TimeUnit, [this]() { chokeRound(); });
+	schedule(TimeUnit, [this]() { tick(); });
+
+	const uint64_t maxTime = settings.maxSimulatedTime * TimeUnit;
+
+	while (!events.empty())
+	{
+		auto e = events.top();
+		events.pop();
+
+		if (e.time > maxTime)
+			break;
+
+		now = e.time;
+		e.action();
+
+		if (torrent->selectionFinished())
+		{
+			result.finished = true;
+			result.completionTime = now / (double)TimeUnit;
+			break;
+		}
+	}
+
+	if (queueSamplesCount)
+		result.averageRequestQueue = queueSamplesSum / (float)queueSamplesCount;
+
+	return result;
+}
+
+void mtt::SwarmSimulator::schedule(uint64_t time, std::function<void()> action)
+{
+	events.push({ time, eventsCounter++, action });
+}
+
+void mtt::SwarmSimulator::createTorrent()
+{
+	torrent = std::make_shared<Torrent>();
+
+	auto& info = torrent->infoFile.info;
+	info.name = "simulation";
+	info.pieceSize = settings.pieceSize;
+	info.fullSize = (size_t)settings.pieceSize * settings.piecesCount;
+	info.pieces.resize(settings.piecesCount);
+	info.expectedBitfieldSize = settings.piecesCount / 8 + (settings.piecesCount % 8 > 0 ? 1 : 0);
+
+	info.lastPieceIndex = settings.piecesCount - 1;
+	info.lastPieceSize = settings.pieceSize;
+	info.lastPieceLastBlockIndex = (info.lastPieceSize - 1) / BlockRequestMaxSize;
+	info.lastPieceLastBlockSize = info.lastPieceSize - (info.lastPieceLastBlockIndex * BlockRequestMaxSize);
+	info.files.push_back({ { info.name }, info.fullSize, 0, 0, info.lastPieceIndex, info.lastPieceSize });
+
+	DataBuffer pieceData(settings.pieceSize);
+	for (uint32_t i = 0; i < settings.piecesCount; i++)
+	{
+		for (auto& block : info.makePieceBlocksInfo(i))
+			fillBlockData(i, block.begin, pieceData.data() + block.begin, block.length);
+
+		SHA1(pieceData.data(), pieceData.size(), info.pieces[i].hash);
+	}
+
+	torrent->files.progress.init(settings.piecesCount);
+	torrent->files.discardData = true;
+
+	received.resize(settings.piecesCount);
+	for (auto& r : received)
+		r.blocks.resize(info.getPieceBlocksCount(0));
+}
+
+void mtt::SwarmSimulator::fillBlockData(uint32_t idx, uint32_t begin, uint8_t* data, uint32_t size)
+{
+	uint32_t value = (idx * 2654435761U) ^ (begin + 1);
+
+	for (uint32_t i = 0; i < size; i++)
+	{
+		value ^= value << 13;
+		value ^= value >> 17;
+		value ^= value << 5;
+		data[i] = (uint8_t)value;
+	}
+}
+
+void mtt::SwarmSimulator::addPeer()
+{
+	auto id = (uint32_t)peers.size();
+	peers.push_back(std::make_unique<SimulatedPeer>(*this, id));
+	auto peer = peers.back().get();
+
+	std::uniform_int_distribution<uint32_t> bandwidth(settings.minPeerBandwidth, settings.maxPeerBandwidth);
+	std::uniform_int_distribution<uint32_t> latency(settings.minPeerLatency, settings.maxPeerLatency);
+	std::uniform_real_distribution<float> chance(0, 1);
+	std::uniform_real_distribution<float> progress(settings.minPeerProgress, settings.maxPeerProgress);
+
+	peer->bandwidth = bandwidth(random);
+	peer->latency = latency(random) * (TimeUnit / 1000);
+
+	peer->info.pieces.init(settings.piecesCount);
+	if (chance(random) < settings.seedersRatio)
+	{
+		for (uint32_t i = 0; i < settings.piecesCount; i++)
+			peer->info.pieces.addPiece(i);
+	}
+	else
+	{
+		auto peerProgress = progress(random);
+		for (uint32_t i = 0; i < settings.piecesCount; i++)
+			if (chance(random) < peerProgress)
+				peer->info.pieces.addPiece(i);
+	}
+
+	if (settings.averagePeerLifetime)
+	{
+		std::exponential_distribution<double> lifetime(1.0 / settings.averagePeerLifetime);
+		auto leaveTime = now + (uint64_t)(lifetime(random) * TimeUnit) + TimeUnit;
+		schedule(leaveTime, [this, peer]() { removePeer(peer); });
+	}
+
+	result.peersJoined++;
+	lastDownloaded.push_back(0);
+
+	schedule(now + peer->latency, [this, peer]()
+		{
+			if (!peer->online)
+				return;
+
+			activePeers.push_back({ peer,{} });
+			activePeers.back().connectionTime = activePeers.back().lastActivityTime = (uint32_t)(now / TimeUnit);
+
+			measurePicker([&]() { downloader->evaluateNextRequests(&activePeers.back()); });
+		});
+}
+
+void mtt::SwarmSimulator::removePeer(SimulatedPeer* peer)
+{
+	peer->online = false;
+	peer->state.action = PeerCommunicationState::Disconnected;
+	peer->pendingRequests = 0;
+	result.peersLeft++;
+
+	for (auto it = activePeers.begin(); it != activePeers.end(); it++)
+	{
+		if (it->comm == peer)
+		{
+			activePeers.erase(it);
+			break;
+		}
+	}
+
+	addPeer();
+}
+
+void mtt::SwarmSimulator::onInterested(SimulatedPeer* peer)
+{
+	std::uniform_real_distribution<float> chance(0, 1);
+
+	if (chance(random) >= settings.unchokeChance)
+		return;
+
+	schedule(now + 2 * peer->latency, [this, peer]()
+		{
+			if (!peer->online || !peer->state.peerChoking)
+				return;
+
+			peer->state.peerChoking = false;
+
+			if (auto active = getActivePeer(peer))
+			{
+				active->lastActivityTime = (uint32_t)(now / TimeUnit);
+				measurePicker([&]() { downloader->evaluateNextRequests(active); });
+			}
+		});
+}
+
+void mtt::SwarmSimulator::onRequest(SimulatedPeer* peer, PieceBlockInfo& info)
+{
+	//requests received while choking are dropped, same as when peer chokes with requests in its queue
+	if (peer->state.peerChoking)
+		return;
+
+	peer->pendingRequests++;
+
+	auto arrival = now + peer->latency;
+	auto generation = peer->chokeGeneration;
+
+	auto start = std::max(arrival, peer->uploadFreeTime);
+	auto finish = start + (info.length * TimeUnit) / peer->bandwidth;
+	peer->uploadFreeTime = finish;
+
+	schedule(finish + peer->latency, [this, peer, info, generation]() mutable
+		{
+			if (!peer->online || peer->chokeGeneration != generation)
+				return;
+
+			peer->pendingRequests--;
+			onBlock(peer, info);
+		});
+}
+
+void mtt::SwarmSimulator::onBlock(SimulatedPeer* peer, PieceBlockInfo& info)
+{
+	result.receivedBytes += info.length;
+
+	auto blockIdx = info.begin / BlockRequestMaxSize;
+	auto& receivedBlocks = received[info.index].blocks;
+	if (torrent->files.progress.hasPiece(info.index))
+		result.wastedBytes += info.length;
+	else if (receivedBlocks[blockIdx])
+		result.duplicateBytes += info.length;
+	receivedBlocks[blockIdx] = true;
+
+	PieceBlock block;
+	block.info = info;
+	block.data.resize(info.length);
+	fillBlockData(info.index, info.begin, block.data.data(), info.length);
+
+	//finished piece is hashed here, not part of picker time
+	auto status = downloader->pieceBlockReceived(block);
+
+	if (status == Downloader::Invalid)
+		receivedBlocks.assign(receivedBlocks.size(), false);
+	else if (status == Downloader::BlockInvalid)
+		receivedBlocks[blockIdx] = false;
+
+	measurePicker([&]() { downloader->removeBlockRequests(activePeers, block, status, peer); });
+
+	if (auto active = getActivePeer(peer))
+	{
+		active->downloaded += info.length;
+		active->lastActivityTime = (uint32_t)(now / TimeUnit);
+	}
+}
+
+void mtt::SwarmSimulator::chokeRound()
+{
+	std::uniform_real_distribution<float> chance(0, 1);
+
+	for (auto& active : activePeers)
+	{
+		auto peer = static_cast<SimulatedPeer*>(active.comm);
+
+		if (peer->state.peerChoking)
+		{
+			if (peer->state.amInterested && chance(random) < settings.unchokeChance)
+			{
+				peer->state.peerChoking = false;
+				measurePicker([&]() { downloader->evaluateNextRequests(&active); });
+			}
+		}
+		else if (chance(random) < settings.chokeChance)
+		{
+			peer->state.peerChoking = true;
+			peer->chokeGeneration++;
+			peer->pendingRequests = 0;
+		}
+	}
+
+	schedule(now + settings.chokeRoundInterval * TimeUnit, [this]() { chokeRound(); });
+}
+
+void mtt::SwarmSimulator::tick()
+{
+	uint32_t queueSum = 0;
+
+	for (auto& active : activePeers)
+	{
+		auto peer = static_cast<SimulatedPeer*>(active.comm);
+
+		auto& last = lastDownloaded[peer->id];
+		active.downloadSpeed = active.downloaded - last;
+		last = active.downloaded;
+
+		queueSum += peer->pendingRequests;
+		result.maxRequestQueue = std::max(result.maxRequestQueue, peer->pendingRequests);
+	}
+
+	queueSamplesSum += queueSum;
+	queueSamplesCount += (uint32_t)activePeers.size();
+
+	schedule(now + TimeUnit, [this]() { tick(); });
+}
+
+mtt::ActivePeer* mtt::SwarmSimulator::getActivePeer(SimulatedPeer* p)
+{
+	for (auto& peer : activePeers)
+		if (peer.comm == p)
+			return &peer;
+
+	return nullptr;
+}
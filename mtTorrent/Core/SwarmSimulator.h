@@ -0,0 +1,165 @@
+#pragma once
+
+#include "Downloader.h"
+#include "PeerCommunication.h"
+#include <queue>
+#include <random>
+
+namespace mtt
+{
+	struct SwarmSimulationSettings
+	{
+		uint32_t piecesCount = 512;
+		uint32_t pieceSize = 256 * 1024;
+
+		uint32_t peersCount = 50;
+		float seedersRatio = 0.1f;
+		float minPeerProgress = 0.f;
+		float maxPeerProgress = 0.9f;
+
+		//bytes per second
+		uint32_t minPeerBandwidth = 50 * 1024;
+		uint32_t maxPeerBandwidth = 1024 * 1024;
+
+		//milliseconds, one way
+		uint32_t minPeerLatency = 10;
+		uint32_t maxPeerLatency = 300;
+
+		//chance that peer unchokes us after we get interested, checked every choke round
+		float unchokeChance = 0.8f;
+		//chance that unchoked peer chokes us again, checked every choke round
+		float chokeChance = 0.05f;
+		uint32_t chokeRoundInterval = 10;
+
+		//average seconds before peer leaves and gets replaced, 0 disables churn
+		uint32_t averagePeerLifetime = 0;
+
+		uint32_t maxSimulatedTime = 3600;
+		uint32_t randomSeed = 1;
+	};
+
+	struct SwarmSimulationResult
+	{
+		bool finished = false;
+		double completionTime = 0;
+
+		uint64_t receivedBytes = 0;
+		//blocks of pieces already finished
+		uint64_t wastedBytes = 0;
+		//blocks received again for unfinished piece
+		uint64_t duplicateBytes = 0;
+
+		uint32_t maxRequestQueue = 0;
+		float averageRequestQueue = 0;
+
+		double pickerTimeMs = 0;
+		uint32_t pickerCalls = 0;
+
+		uint32_t peersJoined = 0;
+		uint32_t peersLeft = 0;
+	};
+
+	/*
+	Deterministic virtual time swarm, runs Downloader against synthetic peers without any network or disk access, finished pieces are only counted in progress.
+	Message handling mirrors FileTransfer.
+	*/
+	class SwarmSimulator
+	{
+	public:
+
+		SwarmSimulator(const SwarmSimulationSettings&);
+		~SwarmSimulator();
+
+		SwarmSimulationResult run();
+
+	private:
+
+		class SimulatedPeer : public PeerCommunication
+		{
+		public:
+
+			SimulatedPeer(SwarmSimulator& sim, uint32_t id);
+
+			virtual void setInterested(bool enabled) override;
+			virtual void requestPieceBlock(PieceBlockInfo& pieceInfo) override;
+			virtual std::string getAddressName() override;
+
+			uint32_t id;
+			uint32_t bandwidth = 0;
+			uint64_t latency = 0;
+			uint64_t uploadFreeTime = 0;
+			uint32_t chokeGeneration = 0;
+			uint32_t pendingRequests = 0;
+			bool online = true;
+
+		private:
+
+			SwarmSimulator& sim;
+		};
+
+		class NullListener : public IPeerListener
+		{
+		public:
+			virtual void handshakeFinished(PeerCommunication*) override {}
+			virtual void connectionClosed(PeerCommunication*, int) override {}
+			virtual void messageReceived(PeerCommunication*, PeerMessage&) override {}
+			virtual void extHandshakeFinished(PeerCommunication*) override {}
+			virtual void metadataPieceReceived(PeerCommunication*, ext::UtMetadata::Message&) override {}
+			virtual void pexReceived(PeerCommunication*, ext::PeerExchange::Message&) override {}
+			virtual void progressUpdated(PeerCommunication*) override {}
+			virtual void sendQueueLow(PeerCommunication*) override {}
+		}
+		listener;
+
+		struct Event
+		{
+			uint64_t time;
+			uint64_t order;
+			std::function<void()> action;
+
+			bool operator<(const Event& r) const
+			{
+				return time != r.time ? time > r.time : order > r.order;
+			}
+		};
+		std::priority_queue<Event> events;
+		uint64_t eventsCounter = 0;
+		uint64_t now = 0;
+		void schedule(uint64_t time, std::function<void()> action);
+
+		void createTorrent();
+		void fillBlockData(uint32_t idx, uint32_t begin, uint8_t* data, uint32_t size);
+
+		void addPeer();
+		void removePeer(SimulatedPeer*);
+		void onRequest(SimulatedPeer*, PieceBlockInfo&);
+		void onBlock(SimulatedPeer*, PieceBlockInfo&);
+		void onInterested(SimulatedPeer*);
+		void chokeRound();
+		void tick();
+
+		ActivePeer* getActivePeer(SimulatedPeer*);
+		std::vector<ActivePeer> activePeers;
+		std::vector<std::unique_ptr<SimulatedPeer>> peers;
+
+		struct ReceivedPiece
+		{
+			std::vector<bool> blocks;
+		};
+		std::vector<ReceivedPiece> received;
+		std::vector<uint32_t> lastDownloaded;
+
+		template<typename F>
+		void measurePicker(F func);
+
+		uint64_t queueSamplesSum = 0;
+		uint32_t queueSamplesCount = 0;
+
+		SwarmSimulationSettings settings;
+		SwarmSimulationResult result;
+		std::mt19937 random;
+
+		TorrentPtr torrent;
+		std::unique_ptr<Downloader> downloader;
+	};
+}
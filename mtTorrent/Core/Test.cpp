@@ -14,6 +14,17 @@
 #include "MetadataDownload.h"
 #include "FileTransfer.h"
 #include "utils/HexEncoding.h"
+#include "SwarmSimulator.h"
+#include "TorrentCreator.h"
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <openssl/sha.h>
+#include <psapi.h>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <stdexcept>
 
 using namespace mtt;
 
@@ -21,6 +32,7 @@ using namespace mtt;
 #define WAITFOR2(x, y) { while (!(x)) { y; Sleep(50);} }
 
 #define TEST_LOG(x) WRITE_LOG(LogTypeTest, x)
+#define TEST_CHECK(x) { if (!(x)) { TEST_LOG("Check failed: " #x); throw std::runtime_error("Check failed: " #x); } }
 
 void testInit()
 {
@@ -300,6 +312,140 @@ void TorrentTest::testStorageLoad()
 	outStorage.flush();
 }
 
+size_t getSystemCacheSize()
+{
+	PERFORMANCE_INFORMATION info;
+	if (!GetPerformanceInfo(&info, sizeof(info)))
+		return 0;
+
+	return info.SystemCache * info.PageSize;
+}
+
+void TorrentTest::testStorageDirectIo()
+{
+	//write whole synthetic torrent, then read it back in random order as when seeding
+	const uint32_t piecesCount = 4096;
+
+	mtt::TorrentInfo info;
+	info.pieceSize = 1024 * 1024;
+	info.files.push_back({ { "directio.bin" }, (size_t)info.pieceSize * piecesCount, 0, 0, piecesCount - 1, info.pieceSize });
+
+	auto memoryMapping = mtt::config::internal_.storage.memoryMapping;
+
+	auto runBenchmark = [&](const char* name, bool directIo)
+	{
+		mtt::config::internal_.storage.directIo = directIo;
+		//compared with buffered io, not with mapped files
+		mtt::config::internal_.storage.memoryMapping = false;
+
+		DownloadSelection selection;
+		selection.files.push_back({ true, info.files.front() });
+
+		mtt::Storage storage;
+		storage.init(info);
+		storage.setPath("D:\\test");
+		storage.preallocateSelection(selection);
+
+		auto cacheStart = getSystemCacheSize();
+		auto start = std::chrono::steady_clock::now();
+
+		mtt::DownloadedPiece piece;
+		for (uint32_t i = 0; i < piecesCount; i++)
+		{
+			piece.init(i, info.pieceSize, info.pieceSize / BlockRequestMaxSize);
+			memset(piece.data.data(), (int)i, piece.data.size());
+			storage.storePiece(piece);
+		}
+		storage.flush();
+
+		auto written = std::chrono::steady_clock::now();
+
+		std::mt19937 random(1);
+		for (uint32_t i = 0; i < piecesCount; i++)
+			storage.getPieceData(random() % piecesCount);
+
+		auto read = std::chrono::steady_clock::now();
+		auto cacheEnd = getSystemCacheSize();
+
+		auto sizeMB = (info.pieceSize / (1024.0 * 1024)) * piecesCount;
+		TEST_LOG(name << ": write " << sizeMB / std::chrono::duration<double>(written - start).count() << " MB/s, random read "
+			<< sizeMB / std::chrono::duration<double>(read - written).count() << " MB/s, system cache grew " << ((int64_t)cacheEnd - (int64_t)cacheStart) / (1024 * 1024) << " MB");
+
+		storage.deleteAll();
+	};
+
+	runBenchmark("page cache", false);
+	runBenchmark("direct io", true);
+
+	mtt::config::internal_.storage.directIo = false;
+	mtt::config::internal_.storage.memoryMapping = memoryMapping;
+}
+
+void TorrentTest::testStorageConcurrency()
+{
+	//threads store and read pieces of different files at once, as with many peers of one torrent
+	const uint32_t filesCount = 8;
+	const uint32_t filePieces = 64;
+
+	mtt::TorrentInfo info;
+	info.pieceSize = 1024 * 1024;
+	for (uint32_t i = 0; i < filesCount; i++)
+		info.files.push_back({ { "concurrency" + std::to_string(i) + ".bin" }, (size_t)info.pieceSize * filePieces, i * filePieces, 0, (i + 1) * filePieces - 1, info.pieceSize });
+
+	DownloadSelection selection;
+	for (auto& f : info.files)
+		selection.files.push_back({ true, f });
+
+	for (uint32_t threadsCount : { 1, 2, 4, 8 })
+	{
+		mtt::Storage storage;
+		storage.init(info);
+		storage.setPath("D:\\test");
+		storage.preallocateSelection(selection);
+
+		auto runThreads = [&](std::function<void(uint32_t)> func)
+		{
+			auto start = std::chrono::steady_clock::now();
+
+			std::vector<std::thread> threads;
+			for (uint32_t t = 0; t < threadsCount; t++)
+				threads.emplace_back([&, t]()
+					{
+						for (uint32_t f = t; f < filesCount; f += threadsCount)
+							for (uint32_t i = f * filePieces; i < (f + 1) * filePieces; i++)
+								func(i);
+					});
+
+			for (auto& t : threads)
+				t.join();
+
+			return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		};
+
+		auto writeTime = runThreads([&](uint32_t i)
+			{
+				mtt::DownloadedPiece piece;
+				piece.init(i, info.pieceSize, info.pieceSize / BlockRequestMaxSize);
+				memset(piece.data.data(), (int)i, piece.data.size());
+				storage.storePiece(piece);
+			});
+		storage.flush();
+
+		std::atomic<uint32_t> corrupted(0);
+		auto readTime = runThreads([&](uint32_t i)
+			{
+				auto data = storage.getPieceData(i);
+				if (data->empty() || data->front() != (uint8_t)i || data->back() != (uint8_t)i)
+					corrupted++;
+			});
+
+		auto sizeMB = (info.pieceSize / (1024.0 * 1024)) * filesCount * filePieces;
+		TEST_LOG(threadsCount << " threads: write " << sizeMB / writeTime << " MB/s, read " << sizeMB / readTime << " MB/s, corrupted pieces " << corrupted);
+
+		storage.deleteAll();
+	}
+}
+
 void TorrentTest::testPeerListen()
 {
 	auto torrent = mtt::TorrentFileParser::parseFile("D:\\wifi.torrent");
@@ -441,6 +587,60 @@ void TorrentTest::testTorrentFileSerialization()
 	ok = memcmp(torrent.info.hash, torrentOut.info.hash, 20) == 0;
 }
 
+void TorrentTest::testTorrentCreation()
+{
+	//pieces straddle both files and last one is shorter
+	const uint32_t pieceSize = 64 * 1024;
+	const size_t fileSizes[] = { 300000, 100000 };
+
+	auto root = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	boost::filesystem::create_directories(root / "creation");
+
+	DataBuffer data;
+	for (size_t i = 0; i < 2; i++)
+	{
+		DataBuffer fileData(fileSizes[i]);
+		for (size_t pos = 0; pos < fileData.size(); pos++)
+			fileData[pos] = (uint8_t)(pos * 7 + i);
+
+		boost::filesystem::ofstream fileOut(root / "creation" / ("file" + std::to_string(i) + ".bin"), std::ios_base::binary);
+		fileOut.write((const char*)fileData.data(), fileData.size());
+
+		data.insert(data.end(), fileData.begin(), fileData.end());
+	}
+
+	mtt::TorrentCreationSettings settings;
+	settings.path = (root / "creation").string();
+	settings.pieceSize = pieceSize;
+	settings.announce = "udp://tracker.test:6969/announce";
+	settings.threads = 2;
+
+	std::string torrentFileData;
+	mtt::TorrentFileInfo created;
+	mtt::TorrentCreator creator(settings);
+	auto status = creator.create(torrentFileData, created);
+
+	auto parsed = mtt::TorrentFileParser::parse((const uint8_t*)torrentFileData.data(), torrentFileData.size());
+	boost::filesystem::remove_all(root);
+
+	TEST_CHECK(status == mtt::Status::Success);
+	TEST_CHECK(parsed.info.name == "creation");
+	TEST_CHECK(parsed.info.files.size() == 2);
+	TEST_CHECK(parsed.info.fullSize == data.size());
+	TEST_CHECK(parsed.info.pieceSize == pieceSize);
+	TEST_CHECK(parsed.info.pieces.size() == (data.size() + pieceSize - 1) / pieceSize);
+	TEST_CHECK(memcmp(parsed.info.hash, created.info.hash, 20) == 0);
+
+	for (size_t i = 0; i < parsed.info.pieces.size(); i++)
+	{
+		uint8_t hash[20];
+		auto pos = i * pieceSize;
+		SHA1(data.data() + pos, std::min<size_t>(pieceSize, data.size() - pos), hash);
+
+		TEST_CHECK(memcmp(parsed.info.pieces[i].hash, hash, 20) == 0);
+	}
+}
+
 void TorrentTest::bigTestGetTorrentFileByLink()
 {
 	std::string link = "magnet:?xt=urn:btih:5AYWR2LK3ORHWRI2Y6BVBUX6QAUF2SDP&tr=http://nyaa.tracker.wf:7777/announce&tr=udp://tracker.coppersurfer.tk:6969/announce&tr=udp://tracker.internetwarriors.net:1337/announce&tr=udp://tracker.leechersparadise.org:6969/announce&tr=udp://tracker.opentrackr.org:1337/announce&tr=udp://open.stealth.si:80/announce&tr=udp://p4p.arenabg.com:1337/announce&tr=udp://mgtracker.org:6969/announce&tr=udp://tracker.tiny-vps.com:6969/announce&tr=udp://peerfect.org:6969/announce&tr=http://share.camoe.cn:8080/announce&tr=http://t.nyaatracker.com:80/announce&tr=https://open.kickasstracker.com:443/announce";//GetClipboardText();
@@ -767,6 +967,43 @@ void idealLocalTest()
 	TEST_LOG("Finished");
 }
 
+void TorrentTest::testSwarmSimulation()
+{
+	auto runSimulation = [](const char* name, mtt::SwarmSimulationSettings& settings)
+	{
+		mtt::SwarmSimulator simulator(settings);
+		auto result = simulator.run();
+
+		TEST_LOG(name << ": finished " << result.finished << ", time " << result.completionTime << "s, received " << result.receivedBytes
+			<< ", wasted " << result.wastedBytes << ", duplicate " << result.duplicateBytes << ", max queue " << result.maxRequestQueue << ", avg queue " << result.averageRequestQueue
+			<< ", picker " << result.pickerTimeMs << "ms/" << result.pickerCalls << " calls, peers joined " << result.peersJoined << ", left " << result.peersLeft);
+
+		//pieces are requested from more peers at once and blocks of finished ones arent cancelled, limits only catch regressions
+		uint64_t dataSize = (uint64_t)settings.pieceSize * settings.piecesCount;
+		TEST_CHECK(result.finished);
+		TEST_CHECK(result.wastedBytes <= 4 * dataSize);
+		TEST_CHECK(result.duplicateBytes <= dataSize / 4);
+	};
+
+	mtt::SwarmSimulationSettings settings;
+	runSimulation("default", settings);
+
+	settings.averagePeerLifetime = 60;
+	runSimulation("churn", settings);
+
+	settings.peersCount = 2000;
+	settings.piecesCount = 4096;
+	settings.pieceSize = 64 * 1024;
+	runSimulation("big swarm", settings);
+
+	settings = mtt::SwarmSimulationSettings();
+	settings.minPeerBandwidth = 5 * 1024;
+	settings.maxPeerBandwidth = 30 * 1024;
+	settings.chokeChance = 0.3f;
+	settings.unchokeChance = 0.3f;
+	runSimulation("slow stingy peers", settings);
+}
+
 void TorrentTest::start()
 {
 	testTorrentFileSerialization();
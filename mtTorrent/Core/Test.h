@@ -34,6 +34,10 @@ public:
 	virtual void pexReceived(mtt::PeerCommunication*, mtt::ext::PeerExchange::Message&) override
 	{
 	}
+
+	virtual void sendQueueLow(mtt::PeerCommunication*) override
+	{
+	}
 };
 
 class TorrentTest : public BasicPeerListener, public mtt::dht::ResultsListener
@@ -48,12 +52,16 @@ public:
 	void testTrackers();
 	void testStorageLoad();
 	void testStorageCheck();
+	void testStorageDirectIo();
+	void testStorageConcurrency();
 	void testGetCountry();
 	void testPeerListen();
 	void testDhtTable();
 	void testTorrentFileSerialization();
+	void testTorrentCreation();
 	void bigTestGetTorrentFileByLink();
 	void idealMagnetLinkTest();
+	void testSwarmSimulation();
 
 	void start();
 
@@ -6,6 +6,9 @@
 #include "FileTransfer.h"
 #include "State.h"
 #include "utils/HexEncoding.h"
+#include <openssl/sha.h>
+#include <chrono>
+#include <thread>
 
 mtt::TorrentPtr mtt::Torrent::fromFile(std::string filepath)
 {
@@ -39,10 +42,21 @@ mtt::TorrentPtr mtt::Torrent::fromSavedState(std::string name)
 {
 	if (auto ptr = fromFile(mtt::config::internal_.programFolderPath + mtt::config::internal_.stateFolder + "\\" + name + ".torrent"))
 	{
-		TorrentState state(ptr->files.progress.pieces);
+		std::vector<uint8_t> pieces;
+		TorrentState state(pieces);
 		if (state.loadState(name))
 		{
-			ptr->files.progress.recheckPieces();
+			if (!state.downloadPath.empty() && state.downloadPath != ptr->files.storage.getPath())
+			{
+				ptr->files.storage.setPath(state.downloadPath);
+				ptr->files.storage.init(ptr->infoFile.info);
+			}
+
+			//files already moved before restart stay where they are
+			if (!state.movePath.empty())
+				ptr->files.storage.restoreMove(state.movePath);
+
+			ptr->files.progress.fromList(pieces);
 
 			if (ptr->files.selection.files.size() == state.files.size())
 			{
@@ -50,13 +64,57 @@ mtt::TorrentPtr mtt::Torrent::fromSavedState(std::string name)
 				{
 					ptr->files.selection.files[i].selected = state.files[i].selected;
 				}
+
+				ptr->files.progress.select(ptr->files.selection);
 			}
 
+			ptr->files.storage.setPreallocationMode((PreallocationMode)state.preallocation);
+			ptr->setTransferLimits(state.downloadLimit, state.uploadLimit);
+
 			if (state.lastStateTime != 0)
+			{
 				ptr->checked = true;
 
+				//pieces of files touched since last save need recheck, everything else resumes as saved
+				if (state.fastResume && ptr->files.selection.files.size() == state.files.size())
+				{
+					auto fingerprints = ptr->files.storage.getFileFingerprints();
+					std::vector<bool> changed(fingerprints.size());
+					bool anyChanged = false;
+
+					for (size_t i = 0; i < fingerprints.size(); i++)
+					{
+						changed[i] = !(fingerprints[i] == state.files[i].fingerprint);
+						anyChanged |= changed[i];
+					}
+
+					if (anyChanged)
+					{
+						ptr->changedFiles = changed;
+						ptr->checked = false;
+					}
+				}
+			}
+
+			if (state.seedMode)
+			{
+				//unverified content changed since save, nothing of it can be trusted
+				if (!ptr->changedFiles.empty())
+				{
+					ptr->changedFiles.clear();
+					ptr->checked = false;
+				}
+				else if (!state.unverifiedPieces.empty())
+					ptr->restoreSeedMode(state.unverifiedPieces);
+				else
+					ptr->enableSeedMode();
+			}
+
 			if (state.started)
 				ptr->start();
+
+			if (!state.movePath.empty())
+				ptr->moveFiles(state.movePath);
 		}
 
 		return ptr;
@@ -65,15 +123,40 @@ mtt::TorrentPtr mtt::Torrent::fromSavedState(std::string name)
 	return nullptr;
 }
 
+void mtt::Torrent::setTransferLimits(uint32_t maxDownloadSpeed, uint32_t maxUploadSpeed)
+{
+	downloadLimit.setLimit(maxDownloadSpeed);
+	uploadLimit.setLimit(maxUploadSpeed);
+}
+
 void mtt::Torrent::save()
 {
-	TorrentState saveState(files.progress.pieces);
-	saveState.downloadPath = mtt::config::external.defaultDirectory;
+	//pieces which could be lost from system cache are downloaded again after crash, instead of missing after check
+	auto durableProgress = files.progress;
+	for (auto idx : files.storage.getUnsyncedPieces())
+		durableProgress.removePiece(idx);
+
+	auto pieces = durableProgress.toList();
+	TorrentState saveState(pieces);
+	saveState.downloadPath = files.storage.getPath();
+	saveState.movePath = files.storage.getMovePath();
 	saveState.lastStateTime = checked ? (uint32_t)::time(0) : 0;
 	saveState.started = state == State::Started;
+	saveState.preallocation = (uint32_t)files.storage.getPreallocationMode();
+	{
+		std::lock_guard<std::mutex> guard(seedModeMutex);
+
+		saveState.seedMode = !unverifiedPieces.empty();
+		if (saveState.seedMode)
+			saveState.unverifiedPieces.assign(unverifiedPieces.wireData(), unverifiedPieces.wireData() + unverifiedPieces.wireSize());
+	}
+	saveState.downloadLimit = downloadLimit.getLimit();
+	saveState.uploadLimit = uploadLimit.getLimit();
 
-	for (auto& f : files.selection.files)
-		saveState.files.push_back({ f.selected });
+	auto fingerprints = files.storage.getFileFingerprints();
+
+	for (size_t i = 0; i < files.selection.files.size(); i++)
+		saveState.files.push_back({ files.selection.files[i].selected, i < fingerprints.size() ? fingerprints[i] : FileFingerprint() });
 
 	saveState.saveState(hashString());
 }
@@ -130,19 +213,25 @@ bool mtt::Torrent::start()
 	if (files.selection.files.empty())
 		return false;
 
-	lastError = files.prepareSelection();
+	lastError = Status::Success;
 
-	if (lastError != mtt::Status::Success)
-		return false;
+	state = State::Started;
 
-	service.start(2);
+	//files layout is set before queued check runs
+	if (!selectionPrepared && !preallocating)
+		prepareSelection();
 
-	state = State::Started;
+	service.start(2);
 
-	if (checking)
+	if (checking || preallocating)
 		return true;
 
 	fileTransfer->start();
+	startSeedCheck();
+
+	//move interrupted by stop
+	if (!relocating && !files.storage.getMovePath().empty())
+		moveFiles(files.storage.getMovePath());
 
 	return true;
 }
@@ -174,6 +263,34 @@ void mtt::Torrent::stop()
 		checking = false;
 	}
 
+	{
+		std::lock_guard<std::mutex> guard(checkStateMutex);
+
+		//also allocation of files selected while running
+		if (preallocationState)
+			preallocationState->rejected = true;
+
+		preallocating = false;
+	}
+
+	if (relocating)
+	{
+		std::lock_guard<std::mutex> guard(checkStateMutex);
+
+		if (relocationState)
+			relocationState->rejected = true;
+
+		relocating = false;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(checkStateMutex);
+
+		if (seedCheckState)
+			seedCheckState->rejected = true;
+	}
+	seedCheckWorker.stop();
+
 	service.stop();
 	state = State::Stopped;
 	lastError = Status::Success;
@@ -196,6 +313,9 @@ std::shared_ptr<mtt::PiecesCheck> mtt::Torrent::checkFiles(std::function<void(st
 		{
 			files.progress.fromList(check->pieces);
 			checked = true;
+			changedFiles.clear();
+
+			save();
 		}
 
 		if (state == State::Started)
@@ -206,12 +326,111 @@ std::shared_ptr<mtt::PiecesCheck> mtt::Torrent::checkFiles(std::function<void(st
 
 	checking = true;
 	std::lock_guard<std::mutex> guard(checkStateMutex);
-	checkState = files.storage.checkStoredPiecesAsync(infoFile.info.pieces, service.io, checkFunc);
+
+	if (!changedFiles.empty())
+		checkState = files.storage.checkChangedPiecesAsync(infoFile.info.pieces, files.progress.toList(), changedFiles, service.io, checkFunc);
+	else
+		checkState = files.storage.checkStoredPiecesAsync(infoFile.info.pieces, service.io, checkFunc);
+
 	return checkState;
 }
 
+void mtt::Torrent::prepareSelection()
+{
+	auto prepareFunc = [this](std::shared_ptr<PreallocationState> prepare)
+	{
+		{
+			std::lock_guard<std::mutex> guard(checkStateMutex);
+
+			//replaced by preparation of newer selection
+			if (preallocationState == prepare)
+				preallocationState.reset();
+		}
+
+		if (prepare->rejected)
+			return;
+
+		preallocating = false;
+		lastError = prepare->result;
+
+		if (lastError != Status::Success)
+		{
+			state = State::Stopped;
+			return;
+		}
+
+		selectionPrepared = true;
+
+		if (state == State::Started)
+			start();
+	};
+
+	preallocating = true;
+	std::lock_guard<std::mutex> guard(checkStateMutex);
+
+	if (preallocationState)
+		preallocationState->rejected = true;
+
+	preallocationState = files.prepareSelection(service.io, prepareFunc);
+}
+
+std::shared_ptr<mtt::RelocationState> mtt::Torrent::moveFiles(const std::string& path)
+{
+	auto moveFunc = [this](std::shared_ptr<RelocationState> move)
+	{
+		{
+			std::lock_guard<std::mutex> guard(checkStateMutex);
+			relocationState.reset();
+		}
+
+		relocating = false;
+
+		if (move->rejected)
+			return;
+
+		lastError = move->result;
+		save();
+	};
+
+	std::lock_guard<std::mutex> guard(checkStateMutex);
+
+	if (relocating)
+		return relocationState;
+
+	relocating = true;
+
+	//runs also while torrent is stopped
+	service.start(2);
+	relocationState = files.storage.moveAsync(path, service.io, moveFunc);
+
+	return relocationState;
+}
+
+float mtt::Torrent::relocationProgress()
+{
+	std::lock_guard<std::mutex> guard(checkStateMutex);
+
+	if (relocationState && relocationState->bytesCount)
+		return relocationState->bytesDone / (float)relocationState->bytesCount;
+	else
+		return 1;
+}
+
+float mtt::Torrent::preallocationProgress()
+{
+	std::lock_guard<std::mutex> guard(checkStateMutex);
+
+	if (preallocationState && preallocationState->bytesCount)
+		return preallocationState->bytesDone / (float)preallocationState->bytesCount;
+	else
+		return 1;
+}
+
 void mtt::Torrent::checkFiles()
 {
+	//requested by user, nothing is trusted
+	changedFiles.clear();
+
 	checkFiles([](std::shared_ptr<PiecesCheck>) {});
 }
 
@@ -242,17 +461,202 @@ bool mtt::Torrent::selectFiles(std::vector<bool>& s)
 
 	files.select(files.selection);
 
+	if (state != State::Started)
+	{
+		//storage gets new layout at next start
+		selectionPrepared = false;
+		return true;
+	}
+
+	//transfer waits for layout, prepared again with new selection
+	if (preallocating)
+	{
+		prepareSelection();
+		return true;
+	}
+
+	{
+		auto prepareFunc = [this](std::shared_ptr<PreallocationState> prepare)
+		{
+			{
+				std::lock_guard<std::mutex> guard(checkStateMutex);
+
+				if (preallocationState == prepare)
+					preallocationState.reset();
+			}
+
+			if (!prepare->rejected)
+				lastError = prepare->result;
+		};
+
+		std::lock_guard<std::mutex> guard(checkStateMutex);
+
+		//newly selected files are allocated in background or at first write, previous allocation is not needed anymore
+		if (preallocationState)
+			preallocationState->rejected = true;
+
+		preallocationState = files.prepareSelection(service.io, prepareFunc);
+		lastError = preallocationState->result;
+	}
+
+	if (fileTransfer)
+		fileTransfer->reevaluate();
+
+	return lastError == Status::Success;
+}
+
+void mtt::Torrent::setPreallocationMode(PreallocationMode mode)
+{
+	files.storage.setPreallocationMode(mode);
+
+	//used with next selection change or start
+	save();
+}
+
+void mtt::Torrent::enableSeedMode()
+{
+	{
+		std::lock_guard<std::mutex> guard(seedModeMutex);
+
+		unverifiedPieces.init(infoFile.info.pieces.size(), true);
+		seedCheckPos = 0;
+	}
+
+	for (uint32_t i = 0; i < infoFile.info.pieces.size(); i++)
+		files.progress.addPiece(i);
+
+	checked = true;
+	changedFiles.clear();
+
 	if (state == State::Started)
+		startSeedCheck();
+}
+
+void mtt::Torrent::restoreSeedMode(const std::vector<uint8_t>& unverified)
+{
 	{
-		lastError = files.prepareSelection();
+		std::lock_guard<std::mutex> guard(seedModeMutex);
 
-		if (fileTransfer)
-			fileTransfer->reevaluate();
+		//pieces verified or dropped before restart stay so, progress is loaded from state
+		unverifiedPieces.fromWire(unverified.data(), unverified.size(), infoFile.info.pieces.size());
+		seedCheckPos = 0;
+	}
 
-		return lastError == Status::Success;
+	checked = true;
+	changedFiles.clear();
+}
+
+bool mtt::Torrent::seedMode()
+{
+	std::lock_guard<std::mutex> guard(seedModeMutex);
+
+	return !unverifiedPieces.empty();
+}
+
+bool mtt::Torrent::verifySeedPiece(uint32_t index, const DataBuffer& data)
+{
+	{
+		std::lock_guard<std::mutex> guard(seedModeMutex);
+
+		if (index >= unverifiedPieces.size() || !unverifiedPieces.get(index))
+			return true;
 	}
 
-	return true;
+	uint8_t hash[SHA_DIGEST_LENGTH];
+	SHA1(data.data(), data.size(), hash);
+
+	bool valid = memcmp(hash, infoFile.info.pieces[index].hash, SHA_DIGEST_LENGTH) == 0;
+	seedPieceVerified(index, valid);
+
+	return valid;
+}
+
+void mtt::Torrent::startSeedCheck()
+{
+	//without speed pieces are verified only by uploads
+	if (!seedMode() || !mtt::config::internal_.storage.seedCheckSpeed)
+		return;
+
+	std::lock_guard<std::mutex> guard(checkStateMutex);
+
+	if (seedCheckState && !seedCheckState->rejected && seedCheckState->piecesChecked < seedCheckState->piecesCount)
+		return;
+
+	//previous sweep finished or was rejected, its worker ends right after
+	seedCheckWorker.stop();
+
+	auto check = std::make_shared<PiecesCheck>();
+	check->piecesCount = (uint32_t)infoFile.info.pieces.size();
+	seedCheckState = check;
+
+	seedCheckWorker.io.post([this, check]() { checkSeedPieces(*check); });
+	seedCheckWorker.start(1, true);
+}
+
+void mtt::Torrent::checkSeedPieces(PiecesCheck& check)
+{
+	auto start = std::chrono::steady_clock::now();
+	uint64_t checkedBytes = 0;
+
+	while (!check.rejected)
+	{
+		uint32_t idx = 0;
+
+		{
+			std::lock_guard<std::mutex> guard(seedModeMutex);
+
+			while (seedCheckPos < unverifiedPieces.size() && !unverifiedPieces.get(seedCheckPos))
+				seedCheckPos++;
+
+			if (seedCheckPos >= unverifiedPieces.size())
+				break;
+
+			idx = seedCheckPos++;
+		}
+
+		bool valid = files.storage.checkStoredPiece(idx, infoFile.info.pieces[idx].hash);
+		service.io.post([this, idx, valid]() { seedPieceVerified(idx, valid); });
+		check.piecesChecked = idx + 1;
+
+		//limited speed, uploads keep most of disk time
+		checkedBytes += infoFile.info.pieceSize;
+
+		if (auto speed = mtt::config::internal_.storage.seedCheckSpeed)
+		{
+			auto expected = std::chrono::milliseconds(checkedBytes * 1000 / speed);
+			auto elapsed = std::chrono::steady_clock::now() - start;
+
+			if (elapsed < expected)
+				std::this_thread::sleep_for(expected - elapsed);
+		}
+	}
+
+	check.piecesChecked = check.piecesCount;
+}
+
+void mtt::Torrent::seedPieceVerified(uint32_t index, bool valid)
+{
+	{
+		std::lock_guard<std::mutex> guard(seedModeMutex);
+
+		if (index >= unverifiedPieces.size() || !unverifiedPieces.get(index))
+			return;
+
+		unverifiedPieces.reset(index);
+
+		//seed mode ends with last verified piece
+		if (unverifiedPieces.count() == 0)
+			unverifiedPieces.clear();
+	}
+
+	if (!valid)
+	{
+		//missing from now, downloaded again as any other piece
+		files.progress.removePiece(index);
+
+		if (fileTransfer)
+			service.io.post([this]() { fileTransfer->reevaluate(); });
+	}
 }
 
 bool mtt::Torrent::finished()
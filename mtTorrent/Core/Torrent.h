@@ -2,6 +2,8 @@
 
 #include "Interface.h"
 #include "utils/ServiceThreadpool.h"
+#include "utils/BandwidthManager.h"
+#include "utils/Bitset.h"
 #include "Files.h"
 #include <functional>
 
@@ -23,6 +25,8 @@ namespace mtt
 		}
 		state = State::Stopped;
 		bool checking = false;
+		bool preallocating = false;
+		bool relocating = false;
 		Status lastError = Status::Success;
 
 		static TorrentPtr fromFile(std::string filepath);
@@ -37,9 +41,21 @@ namespace mtt
 		void checkFiles();
 		std::shared_ptr<PiecesCheck> checkFiles(std::function<void(std::shared_ptr<PiecesCheck>)> onFinish);
 		float checkingProgress();
+		float preallocationProgress();
 		bool filesChecked();
 
 		bool selectFiles(std::vector<bool>&);
+		void setPreallocationMode(PreallocationMode);
+
+		//files are copied to new directory in background while torrent keeps using old ones, continues after restart when stopped
+		std::shared_ptr<RelocationState> moveFiles(const std::string& path);
+		float relocationProgress();
+
+		//all pieces are assumed present, each is verified when first uploaded or by slow background check
+		void enableSeedMode();
+		bool seedMode();
+		//false when piece failed verification and was dropped from progress
+		bool verifySeedPiece(uint32_t index, const DataBuffer& data);
 
 		std::string name();
 		float currentProgress();
@@ -59,6 +75,11 @@ namespace mtt
 		TorrentFileInfo infoFile;
 		ServiceThreadpool service;
 
+		BandwidthChannel uploadLimit;
+		BandwidthChannel downloadLimit;
+		//bytes per second shared by all peers of torrent, 0 is unlimited
+		void setTransferLimits(uint32_t maxDownloadSpeed, uint32_t maxUploadSpeed);
+
 		std::unique_ptr<Peers> peers;
 		std::unique_ptr<FileTransfer> fileTransfer;
 		std::unique_ptr<MetadataDownload> utmDl;
@@ -70,6 +91,24 @@ namespace mtt
 		std::mutex checkStateMutex;
 		std::shared_ptr<mtt::PiecesCheck> checkState;
 		bool checked = false;
+		//files changed since saved state, only their pieces get checked
+		std::vector<bool> changedFiles;
 		void init();
+
+		std::shared_ptr<mtt::PreallocationState> preallocationState;
+		std::shared_ptr<mtt::RelocationState> relocationState;
+		bool selectionPrepared = false;
+		void prepareSelection();
+
+		std::mutex seedModeMutex;
+		Bitset unverifiedPieces;
+		uint32_t seedCheckPos = 0;
+		//background sweep runs on own worker, only results are posted to torrent io
+		ServiceThreadpool seedCheckWorker{ 0 };
+		std::shared_ptr<PiecesCheck> seedCheckState;
+		void startSeedCheck();
+		void checkSeedPieces(PiecesCheck& check);
+		void restoreSeedMode(const std::vector<uint8_t>& unverified);
+		void seedPieceVerified(uint32_t index, bool valid);
 	};
 }
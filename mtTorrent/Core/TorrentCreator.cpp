@@ -0,0 +1,286 @@
+#include "TorrentCreator.h"
+#include "utils/TorrentFileParser.h"
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <openssl/sha.h>
+#include <algorithm>
+#include <thread>
+
+#define CREATOR_LOG(x) WRITE_LOG(LogTypeFileParser, x)
+
+mtt::TorrentCreator::TorrentCreator(const TorrentCreationSettings& s) : settings(s), hashedBytes(0), cancelled(false)
+{
+}
+
+mtt::Status mtt::TorrentCreator::create(std::string& torrentFileData, TorrentFileInfo& out)
+{
+	fileInfo = TorrentFileInfo();
+	filePaths.clear();
+	hashQueue.clear();
+	freePieces.clear();
+	readFinished = false;
+	hashedBytes = 0;
+	cancelled = false;
+
+	auto status = listFiles();
+	if (status != Status::Success)
+		return status;
+
+	auto& info = fileInfo.info;
+
+	if (settings.pieceSize)
+	{
+		//power of two, at least one block
+		if (settings.pieceSize < BlockRequestMaxSize || (settings.pieceSize & (settings.pieceSize - 1)))
+			return Status::E_InvalidInput;
+
+		info.pieceSize = settings.pieceSize;
+	}
+	else
+	{
+		info.pieceSize = 256 * 1024;
+
+		while (info.pieceSize < 16 * 1024 * 1024 && info.fullSize / info.pieceSize > 2000)
+			info.pieceSize *= 2;
+	}
+
+	info.pieces.resize((info.fullSize + info.pieceSize - 1) / info.pieceSize);
+
+	fileInfo.announce = settings.announce;
+	fileInfo.announceList = settings.announceList;
+	if (fileInfo.announce.empty() && !fileInfo.announceList.empty())
+		fileInfo.announce = fileInfo.announceList.front();
+
+	auto threadsCount = settings.threads ? settings.threads : std::max(1u, std::thread::hardware_concurrency());
+
+	//reading goes on while all workers are hashing
+	for (uint32_t i = 0; i < threadsCount + 2; i++)
+		freePieces.emplace_back(new ReadPiece());
+
+	std::vector<std::thread> workers;
+	for (uint32_t i = 0; i < threadsCount; i++)
+		workers.emplace_back([this]() { hashPieces(); });
+
+	status = readPieces();
+
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		readFinished = true;
+	}
+	cv.notify_all();
+
+	for (auto& w : workers)
+		w.join();
+
+	freePieces.clear();
+
+	if (status == Status::Success && cancelled)
+		status = Status::I_Stopped;
+
+	if (status != Status::Success)
+		return status;
+
+	if (settings.onProgress)
+		settings.onProgress(hashedBytes, info.fullSize);
+
+	torrentFileData = fileInfo.createTorrentFileData();
+	out = TorrentFileParser::parse((const uint8_t*)torrentFileData.data(), torrentFileData.size());
+
+	return Status::Success;
+}
+
+void mtt::TorrentCreator::cancel()
+{
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		cancelled = true;
+	}
+	cv.notify_all();
+}
+
+mtt::Status mtt::TorrentCreator::listFiles()
+{
+	auto path = settings.path;
+	while (!path.empty() && (path.back() == '/' || path.back() == '\\'))
+		path.pop_back();
+
+	boost::system::error_code ec;
+	boost::filesystem::path root(path);
+	auto& info = fileInfo.info;
+
+	info.name = root.filename().string();
+
+	if (boost::filesystem::is_regular_file(root, ec))
+	{
+		File file = {};
+		file.path.push_back(info.name);
+		file.size = (size_t)boost::filesystem::file_size(root, ec);
+
+		if (ec)
+		{
+			CREATOR_LOG("Failed to get size of file " << path << ": " << ec.message());
+			return Status::E_InvalidInput;
+		}
+
+		info.files.push_back(file);
+		filePaths.push_back(path);
+	}
+	else if (boost::filesystem::is_directory(root, ec))
+	{
+		std::vector<boost::filesystem::path> found;
+
+		for (boost::filesystem::recursive_directory_iterator it(root, ec), end; !ec && it != end; it.increment(ec))
+		{
+			if (boost::filesystem::is_regular_file(it->status()))
+				found.push_back(it->path());
+		}
+
+		if (ec)
+		{
+			CREATOR_LOG("Failed to list directory " << path << ": " << ec.message());
+			return Status::E_InvalidInput;
+		}
+
+		//same content always gives same torrent
+		std::sort(found.begin(), found.end());
+
+		for (auto& p : found)
+		{
+			File file = {};
+			file.path.push_back(info.name);
+
+			for (auto& part : boost::filesystem::path(p.string().substr(path.length() + 1)))
+				file.path.push_back(part.string());
+
+			file.size = (size_t)boost::filesystem::file_size(p, ec);
+
+			if (ec)
+			{
+				CREATOR_LOG("Failed to get size of file " << p.string() << ": " << ec.message());
+				return Status::E_InvalidInput;
+			}
+
+			info.files.push_back(file);
+			filePaths.push_back(p.string());
+		}
+	}
+
+	for (auto& f : info.files)
+		info.fullSize += f.size;
+
+	if (info.name.empty() || info.fullSize == 0)
+	{
+		CREATOR_LOG("No data to create torrent from " << settings.path);
+		return Status::E_InvalidInput;
+	}
+
+	return Status::Success;
+}
+
+mtt::Status mtt::TorrentCreator::readPieces()
+{
+	auto& info = fileInfo.info;
+
+	boost::filesystem::ifstream file;
+	size_t nextFile = 0;
+	uint64_t fileRemaining = 0;
+
+	for (uint32_t i = 0; i < info.pieces.size(); i++)
+	{
+		std::unique_ptr<ReadPiece> piece;
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [this]() { return !freePieces.empty() || cancelled; });
+
+			if (cancelled)
+				return Status::I_Stopped;
+
+			piece = std::move(freePieces.back());
+			freePieces.pop_back();
+		}
+
+		piece->index = i;
+		piece->data.resize((size_t)std::min<uint64_t>(info.pieceSize, info.fullSize - (uint64_t)i * info.pieceSize));
+
+		size_t pos = 0;
+		while (pos < piece->data.size())
+		{
+			if (fileRemaining == 0)
+			{
+				auto idx = nextFile++;
+				fileRemaining = info.files[idx].size;
+
+				file.close();
+				if (fileRemaining)
+				{
+					file.open(filePaths[idx], std::ios_base::binary);
+
+					if (!file)
+					{
+						CREATOR_LOG("Failed to open file " << filePaths[idx]);
+						return Status::E_InvalidInput;
+					}
+				}
+
+				continue;
+			}
+
+			auto size = (size_t)std::min<uint64_t>(fileRemaining, piece->data.size() - pos);
+			file.read((char*)piece->data.data() + pos, size);
+
+			if ((size_t)file.gcount() != size)
+			{
+				CREATOR_LOG("File changed while reading " << filePaths[nextFile - 1]);
+				return Status::E_InvalidInput;
+			}
+
+			pos += size;
+			fileRemaining -= size;
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			hashQueue.push_back(std::move(piece));
+		}
+		cv.notify_all();
+
+		if (settings.onProgress)
+			settings.onProgress(hashedBytes, info.fullSize);
+	}
+
+	return Status::Success;
+}
+
+void mtt::TorrentCreator::hashPieces()
+{
+	auto& pieces = fileInfo.info.pieces;
+
+	while (true)
+	{
+		std::unique_ptr<ReadPiece> piece;
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [this]() { return !hashQueue.empty() || readFinished; });
+
+			if (hashQueue.empty())
+				return;
+
+			piece = std::move(hashQueue.front());
+			hashQueue.pop_front();
+		}
+
+		if (!cancelled)
+		{
+			SHA1(piece->data.data(), piece->data.size(), pieces[piece->index].hash);
+			hashedBytes += piece->data.size();
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			freePieces.push_back(std::move(piece));
+		}
+		cv.notify_all();
+	}
+}
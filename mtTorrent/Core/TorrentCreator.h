@@ -0,0 +1,71 @@
+#pragma once
+
+#include "Interface.h"
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+
+namespace mtt
+{
+	struct TorrentCreationSettings
+	{
+		//file or directory
+		std::string path;
+
+		//0 picks size by full size
+		uint32_t pieceSize = 0;
+
+		std::string announce;
+		std::vector<std::string> announceList;
+
+		//hashing threads, 0 uses all cores
+		uint32_t threads = 0;
+
+		//called from creating thread, hashed bytes of full size
+		std::function<void(uint64_t, uint64_t)> onProgress;
+	};
+
+	/*
+	Creates torrent file from existing data. Files are read in order by single thread with piece sized reads,
+	pieces straddling files are assembled there and hashed by worker threads.
+	*/
+	class TorrentCreator
+	{
+	public:
+
+		TorrentCreator(const TorrentCreationSettings&);
+
+		//blocks until all pieces are hashed, fileInfo is parsed back from created bencoded data
+		Status create(std::string& torrentFileData, TorrentFileInfo& fileInfo);
+
+		//can be called from any thread while creating, create returns I_Stopped
+		void cancel();
+
+	private:
+
+		Status listFiles();
+		Status readPieces();
+		void hashPieces();
+
+		TorrentCreationSettings settings;
+		TorrentFileInfo fileInfo;
+		std::vector<std::string> filePaths;
+
+		struct ReadPiece
+		{
+			uint32_t index;
+			DataBuffer data;
+		};
+
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::deque<std::unique_ptr<ReadPiece>> hashQueue;
+		std::vector<std::unique_ptr<ReadPiece>> freePieces;
+		bool readFinished = false;
+
+		std::atomic<uint64_t> hashedBytes;
+		std::atomic<bool> cancelled;
+	};
+}
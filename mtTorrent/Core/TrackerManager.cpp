@@ -147,8 +147,20 @@ void mtt::TrackerManager::onAnnounce(AnnounceResponse& resp, Tracker* t)
 	if(auto trackerInfo = findTrackerInfo(t))
 	{
 		trackerInfo->retryCount = 0;
-		trackerInfo->timer->schedule(resp.interval);
-		trackerInfo->comm->info.nextAnnounce = (uint32_t)time(0) + resp.interval;
+
+		auto interval = resp.interval;
+
+		//v2 announce follows right after v1 one
+		if (torrent->infoFile.info.hasV2 && !t->announcingV2)
+		{
+			t->announcingV2 = true;
+			interval = 1;
+		}
+		else
+			t->announcingV2 = false;
+
+		trackerInfo->timer->schedule(interval);
+		trackerInfo->comm->info.nextAnnounce = (uint32_t)time(0) + interval;
 	}
 
 	if(announceCallback)
@@ -1,23 +1,419 @@
 #include "Uploader.h"
 #include "Torrent.h"
 #include "PeerCommunication.h"
+#include "Downloader.h"
+#include "Configuration.h"
+#include "MemoryGovernor.h"
+#include <algorithm>
+#include <cmath>
 
 mtt::Uploader::Uploader(TorrentPtr t)
 {
 	torrent = t;
 }
 
+mtt::Uploader::~Uploader()
+{
+	reset();
+}
+
 void mtt::Uploader::isInterested(PeerCommunication* p)
 {
-	p->setChoke(false);
+	std::lock_guard<std::mutex> guard(chokeMutex);
+
+	if (!p->state.amChoking)
+		return;
+
+	//free slots are filled right away, otherwise peer waits for next choke round
+	if (unchokedPeers.size() < getUploadSlots())
+	{
+		unchokedPeers.push_back(p);
+		p->setChoke(false);
+	}
 }
 
-bool mtt::Uploader::pieceRequest(PeerCommunication* p, PieceBlockInfo& info)
+bool mtt::Uploader::pieceRequest(PeerCommunication* p, PieceBlockInfo& request)
 {
-	auto block = torrent->files.storage.getPieceBlock(info);
-	p->sendPieceBlock(block);
-	uploaded += info.length;
+	if (p->state.amChoking)
+		return false;
+
+	//index and range come from peer, checked before any lookup
+	auto& info = torrent->infoFile.info;
+	if (request.index >= info.pieces.size() || request.length == 0 || request.length > BlockRequestMaxSize
+		|| (uint64_t)request.begin + request.length > info.getPieceSize(request.index) || !torrent->files.progress.hasPiece(request.index))
+		return false;
+
+	std::lock_guard<std::mutex> guard(requestsMutex);
+
+	auto queue = getRequestsQueue(p);
+	if (!queue)
+	{
+		RequestsQueue newQueue;
+		newQueue.peer = p;
+		requestsQueues.push_back(newQueue);
+		queue = &requestsQueues.back();
+	}
+
+	//without fast extension there is no reject message, request over limit is dropped and peer has to ask again
+	if (queue->requests.size() >= mtt::config::internal_.upload.maxPeerRequests)
+		return false;
+
+	queue->requests.push_back(request);
+	startProcessing();
 
 	return true;
 }
 
+void mtt::Uploader::cancelRequest(PeerCommunication* p, PieceBlockInfo& info)
+{
+	std::lock_guard<std::mutex> guard(requestsMutex);
+
+	if (auto queue = getRequestsQueue(p))
+	{
+		for (auto it = queue->requests.begin(); it != queue->requests.end(); it++)
+		{
+			if (it->index == info.index && it->begin == info.begin && it->length == info.length)
+			{
+				queue->requests.erase(it);
+				break;
+			}
+		}
+	}
+}
+
+void mtt::Uploader::sendQueueLow(PeerCommunication* p)
+{
+	std::lock_guard<std::mutex> guard(requestsMutex);
+
+	auto queue = getRequestsQueue(p);
+	if (queue && !queue->requests.empty())
+		startProcessing();
+}
+
+void mtt::Uploader::refreshChoking(std::vector<ActivePeer>& peers)
+{
+	{
+		std::lock_guard<std::mutex> guard(requestsMutex);
+
+		for (auto& peer : peers)
+			if (auto queue = getRequestsQueue(peer.comm))
+			{
+				peer.uploaded += queue->uploaded;
+				queue->uploaded = 0;
+			}
+
+		if (memoryThrottled)
+		{
+			memoryThrottled = false;
+			startProcessing();
+		}
+	}
+
+	uint32_t uploadSpeed = 0;
+	for (auto& peer : peers)
+		uploadSpeed += peer.uploadSpeed;
+
+	if (uploadSpeed > uploadCapacity)
+		uploadCapacity = uploadSpeed;
+	else
+		uploadCapacity -= (uploadCapacity - uploadSpeed) / 64;
+
+	if (secondsToChokeRound > 0)
+	{
+		secondsToChokeRound--;
+		return;
+	}
+
+	secondsToChokeRound = mtt::config::internal_.choking.chokeRoundInterval - 1;
+
+	chokeRound(peers);
+}
+
+void mtt::Uploader::removePeer(PeerCommunication* p)
+{
+	{
+		std::lock_guard<std::mutex> guard(chokeMutex);
+
+		auto it = std::find(unchokedPeers.begin(), unchokedPeers.end(), p);
+		if (it != unchokedPeers.end())
+			unchokedPeers.erase(it);
+
+		if (optimisticUnchoke == p)
+			optimisticUnchoke = nullptr;
+	}
+
+	std::lock_guard<std::mutex> guard(requestsMutex);
+
+	for (auto it = requestsQueues.begin(); it != requestsQueues.end(); it++)
+	{
+		if (it->peer == p)
+		{
+			releasePiece(*it);
+			requestsQueues.erase(it);
+			break;
+		}
+	}
+}
+
+void mtt::Uploader::reset()
+{
+	std::lock_guard<std::mutex> guard(chokeMutex);
+
+	unchokedPeers.clear();
+	optimisticUnchoke = nullptr;
+	secondsToChokeRound = 0;
+	secondsToOptimisticUnchoke = 0;
+
+	std::lock_guard<std::mutex> rGuard(requestsMutex);
+
+	for (auto& queue : requestsQueues)
+		releasePiece(queue);
+
+	requestsQueues.clear();
+}
+
+void mtt::Uploader::chokeRound(std::vector<ActivePeer>& peers)
+{
+	std::lock_guard<std::mutex> guard(chokeMutex);
+
+	std::vector<ActivePeer*> candidates;
+	for (auto& peer : peers)
+		if (peer.comm->state.peerInterested && peer.comm->isEstablished())
+			candidates.push_back(&peer);
+
+	//reciprocate to peers giving us most, when seeding prefer peers we can upload to fastest
+	if (torrent->selectionFinished())
+		std::sort(candidates.begin(), candidates.end(), [](const ActivePeer* l, const ActivePeer* r) { return l->uploadSpeed > r->uploadSpeed; });
+	else
+		std::sort(candidates.begin(), candidates.end(), [](const ActivePeer* l, const ActivePeer* r) { return l->downloadSpeed > r->downloadSpeed; });
+
+	auto slots = std::min((uint32_t)candidates.size(), getUploadSlots());
+
+	std::vector<PeerCommunication*> unchoke;
+	for (uint32_t i = 0; i < slots; i++)
+		unchoke.push_back(candidates[i]->comm);
+
+	if (optimisticUnchoke && std::find_if(candidates.begin(), candidates.end(), [this](const ActivePeer* p) { return p->comm == optimisticUnchoke; }) == candidates.end())
+		optimisticUnchoke = nullptr;
+
+	if (secondsToOptimisticUnchoke <= mtt::config::internal_.choking.chokeRoundInterval || !optimisticUnchoke)
+	{
+		secondsToOptimisticUnchoke = mtt::config::internal_.choking.optimisticUnchokeInterval;
+		optimisticUnchoke = nullptr;
+
+		if (candidates.size() > slots)
+			optimisticUnchoke = candidates[slots + rand() % (candidates.size() - slots)]->comm;
+	}
+	else
+		secondsToOptimisticUnchoke -= mtt::config::internal_.choking.chokeRoundInterval;
+
+	if (optimisticUnchoke && std::find(unchoke.begin(), unchoke.end(), optimisticUnchoke) == unchoke.end())
+		unchoke.push_back(optimisticUnchoke);
+
+	for (auto& peer : peers)
+	{
+		bool choke = std::find(unchoke.begin(), unchoke.end(), peer.comm) == unchoke.end();
+
+		//choked peer has to request again after unchoke
+		if (choke && !peer.comm->state.amChoking)
+			clearRequests(peer.comm);
+
+		peer.comm->setChoke(choke);
+	}
+
+	unchokedPeers = unchoke;
+}
+
+uint32_t mtt::Uploader::getUploadSlots()
+{
+	//rule of thumb, square root of upload capacity in KB/s
+	auto slots = (uint32_t)std::sqrt(uploadCapacity / 1024 * 0.6f);
+
+	return std::max(mtt::config::internal_.choking.minUploadSlots, std::min(slots, mtt::config::internal_.choking.maxUploadSlots));
+}
+
+mtt::Uploader::RequestsQueue* mtt::Uploader::getRequestsQueue(PeerCommunication* p)
+{
+	for (auto& queue : requestsQueues)
+		if (queue.peer == p)
+			return &queue;
+
+	return nullptr;
+}
+
+void mtt::Uploader::clearRequests(PeerCommunication* p)
+{
+	std::lock_guard<std::mutex> guard(requestsMutex);
+
+	if (auto queue = getRequestsQueue(p))
+	{
+		queue->requests.clear();
+		queue->deficit = 0;
+		releasePiece(*queue);
+		queue->pieceIdx = -1;
+	}
+}
+
+void mtt::Uploader::processRequests()
+{
+	PeerCommunication* optimistic = nullptr;
+	{
+		std::lock_guard<std::mutex> guard(chokeMutex);
+		optimistic = optimisticUnchoke;
+	}
+
+	std::lock_guard<std::mutex> guard(requestsMutex);
+
+	bool pending = false;
+	const auto watermark = mtt::config::internal_.upload.sendQueueWatermark;
+
+	for (size_t i = 0; i < requestsQueues.size(); i++)
+	{
+		auto& queue = requestsQueues[(nextQueueIdx + i) % requestsQueues.size()];
+
+		//peer socket is full, continue after sendQueueLow, or after piece is loaded
+		if (queue.requests.empty() || queue.loading || queue.peer->getSendQueueSize() >= watermark)
+			continue;
+
+		//regular unchokes get twice the share of optimistic unchoke
+		uint32_t weight = queue.peer == optimistic ? 1 : 2;
+		queue.deficit += weight * BlockRequestMaxSize;
+
+		bool waiting = false;
+
+		while (!queue.requests.empty() && queue.requests.front().length <= queue.deficit && queue.peer->getSendQueueSize() < watermark)
+		{
+			auto info = queue.requests.front();
+
+			//released piece data is loaded again
+			if (info.index != queue.pieceIdx || !queue.pieceData)
+			{
+				if (!startPiece(queue, info.index))
+					memoryThrottled = true;
+
+				waiting = true;
+				break;
+			}
+
+			queue.requests.pop_front();
+			queue.deficit -= info.length;
+
+			if (queue.pieceData->size() < info.begin + info.length)
+				continue;
+
+			queue.peer->sendPieceBlock(info, queue.pieceData);
+			queue.uploaded += info.length;
+			uploaded += info.length;
+		}
+
+		if (queue.requests.empty())
+		{
+			queue.deficit = 0;
+			releasePiece(queue);
+		}
+		else if (!waiting)
+			pending = true;
+	}
+
+	if (!requestsQueues.empty())
+		nextQueueIdx = (nextQueueIdx + 1) % requestsQueues.size();
+
+	processing = false;
+
+	if (pending)
+		startProcessing();
+}
+
+bool mtt::Uploader::startPiece(RequestsQueue& queue, uint32_t idx)
+{
+	releasePiece(queue);
+
+	auto size = torrent->infoFile.info.getPieceSize(idx);
+	if (!MemoryGovernor::get().reserve(MemoryCategory::UploadPieces, size))
+	{
+		//idle uploader always gets one piece, so seeding goes on even when downloads take whole budget
+		bool idle = std::none_of(requestsQueues.begin(), requestsQueues.end(), [](const RequestsQueue& q) { return q.reserved != 0; });
+
+		if (!idle)
+		{
+			queue.pieceIdx = -1;
+			return false;
+		}
+
+		MemoryGovernor::get().forceReserve(MemoryCategory::UploadPieces, size);
+	}
+
+	queue.reserved = size;
+
+	//serve other queued blocks of this piece next, so piece is read and sent at once
+	std::stable_partition(queue.requests.begin(), queue.requests.end(), [idx](const PieceBlockInfo& r) { return r.index == idx; });
+
+	if (queue.pieceIdx != (uint32_t)-1 && idx == queue.pieceIdx + 1)
+		queue.sequentialPieces++;
+	else
+		queue.sequentialPieces = 0;
+
+	queue.pieceIdx = idx;
+	queue.loading = true;
+
+	//disk read and verification dont block other peers requests
+	auto peer = queue.peer;
+	torrent->service.io.post([this, peer, idx]() { loadPiece(peer, idx); });
+
+	if (queue.sequentialPieces == 0)
+		return true;
+
+	//peer downloads in order, read following pieces to cache before they get requested
+	auto& pieces = torrent->files.progress;
+	for (uint32_t i = idx + 1; i <= idx + mtt::config::internal_.upload.readAheadPieces && i < pieces.pieces.size(); i++)
+	{
+		if (pieces.hasPiece(i) && !queue.peer->info.pieces.hasPiece(i))
+			torrent->service.io.post([this, i]() { torrent->files.storage.preloadPiece(i); });
+	}
+
+	return true;
+}
+
+void mtt::Uploader::loadPiece(PeerCommunication* peer, uint32_t idx)
+{
+	std::shared_ptr<const DataBuffer> data = torrent->files.storage.getPieceData(idx);
+
+	//piece added in seed mode is verified before its first block leaves, invalid piece gets no blocks sent
+	if (!torrent->verifySeedPiece(idx, *data))
+		data = std::make_shared<DataBuffer>();
+
+	std::lock_guard<std::mutex> guard(requestsMutex);
+
+	//queue could be cleared or switched to other piece meanwhile
+	auto queue = getRequestsQueue(peer);
+	if (!queue || !queue->loading || queue->pieceIdx != idx)
+		return;
+
+	queue->pieceData = data;
+	queue->loading = false;
+
+	//all its requests were cancelled meanwhile
+	if (queue->requests.empty())
+		releasePiece(*queue);
+	else
+		startProcessing();
+}
+
+void mtt::Uploader::releasePiece(RequestsQueue& queue)
+{
+	if (queue.reserved)
+		MemoryGovernor::get().release(MemoryCategory::UploadPieces, queue.reserved);
+
+	queue.reserved = 0;
+	queue.pieceData.reset();
+	queue.loading = false;
+}
+
+void mtt::Uploader::startProcessing()
+{
+	if (!processing)
+	{
+		processing = true;
+		torrent->service.io.post(std::bind(&Uploader::processRequests, this));
+	}
+}
@@ -1,23 +1,82 @@
 #pragma once
 #include "Interface.h"
+#include <mutex>
+#include <deque>
 
 namespace mtt
 {
 	class PeerCommunication;
+	struct ActivePeer;
 
 	class Uploader
 	{
 	public:
 
 		Uploader(TorrentPtr);
+		~Uploader();
 
 		void isInterested(PeerCommunication* p);
-		bool pieceRequest(PeerCommunication* p, PieceBlockInfo& info);
+		//queues request, false if rejected
+		bool pieceRequest(PeerCommunication* p, PieceBlockInfo& request);
+		void cancelRequest(PeerCommunication* p, PieceBlockInfo& info);
+		void sendQueueLow(PeerCommunication* p);
+
+		//called every second with updated speeds, runs choke rounds in configured intervals
+		void refreshChoking(std::vector<ActivePeer>& peers);
+		void removePeer(PeerCommunication* p);
+		void reset();
 
 		size_t uploaded = 0;
 
 	private:
 
+		void chokeRound(std::vector<ActivePeer>& peers);
+		uint32_t getUploadSlots();
+
+		struct RequestsQueue
+		{
+			PeerCommunication* peer = nullptr;
+			std::deque<PieceBlockInfo> requests;
+			uint32_t deficit = 0;
+			uint32_t uploaded = 0;
+
+			//currently served piece, kept so its blocks dont go through cache again
+			std::shared_ptr<const DataBuffer> pieceData;
+			uint32_t pieceIdx = -1;
+			uint32_t sequentialPieces = 0;
+			//size of pieceData counted in MemoryGovernor
+			uint32_t reserved = 0;
+			//pieceData is being read, blocks wait for it
+			bool loading = false;
+		};
+		std::vector<RequestsQueue> requestsQueues;
+		std::mutex requestsMutex;
+		RequestsQueue* getRequestsQueue(PeerCommunication* p);
+		void clearRequests(PeerCommunication* p);
+		//reserves piece and starts its load, false when memory budget doesnt allow to load piece now and other queue already has one
+		bool startPiece(RequestsQueue& queue, uint32_t idx);
+		//reads and verifies piece outside of requestsMutex, then continues serving queue of peer
+		void loadPiece(PeerCommunication* peer, uint32_t idx);
+		void releasePiece(RequestsQueue& queue);
+		//queued piece waits for memory, processing is retried with choking refresh
+		bool memoryThrottled = false;
+
+		//one deficit round robin round over queued requests of peers with free send queue, reposted while any is served
+		void processRequests();
+		void startProcessing();
+		bool processing = false;
+		size_t nextQueueIdx = 0;
+
+		std::vector<PeerCommunication*> unchokedPeers;
+		PeerCommunication* optimisticUnchoke = nullptr;
+		std::mutex chokeMutex;
+
+		uint32_t secondsToChokeRound = 0;
+		uint32_t secondsToOptimisticUnchoke = 0;
+
+		//highest measured upload speed, slowly decaying
+		uint32_t uploadCapacity = 0;
+
 		TorrentPtr torrent;
 	};
 }
\ No newline at end of file
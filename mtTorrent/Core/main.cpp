@@ -4,6 +4,9 @@
 #include <string>
 //#include <RiotRestApi.h>
 #include <Test.h>
+#include <StorageBenchmark.h>
+#include <TorrentCreator.h>
+#include <fstream>
 
 #ifndef STANDALONE
 
@@ -37,6 +40,104 @@ int main(int argc, char* argv[])
 
 	try
 	{
+		//storage-benchmark [key=value ...], prints json result
+		if (argc > 1 && std::string(argv[1]) == "storage-benchmark")
+		{
+			mtt::StorageBenchmarkSettings settings;
+
+			for (int i = 2; i < argc; i++)
+			{
+				std::string arg = argv[i];
+				auto pos = arg.find('=');
+				if (pos == std::string::npos)
+					continue;
+
+				auto key = arg.substr(0, pos);
+				auto value = arg.substr(pos + 1);
+
+				if (key == "path")
+					settings.path = value;
+				else if (key == "pieceSize")
+					settings.pieceSize = std::stoul(value);
+				else if (key == "totalSize")
+					settings.totalSize = std::stoull(value);
+				else if (key == "filesCount")
+					settings.filesCount = std::stoul(value);
+				else if (key == "fileSizeRatio")
+					settings.fileSizeRatio = std::stof(value);
+				else if (key == "preallocation")
+					settings.preallocation = (mtt::PreallocationMode)std::stoul(value);
+				else if (key == "randomReads")
+					settings.randomReads = std::stoul(value);
+				else if (key == "randomSeed")
+					settings.randomSeed = std::stoul(value);
+				else if (key == "directIo")
+					settings.directIo = std::stoul(value) != 0;
+				else if (key == "overlappedIo")
+					settings.overlappedIo = std::stoul(value) != 0;
+				else if (key == "memoryMapping")
+					settings.memoryMapping = std::stoul(value) != 0;
+				else if (key == "durability")
+					settings.durability = (mtt::config::Durability)std::stoul(value);
+			}
+
+			mtt::StorageBenchmark benchmark(settings);
+			std::cout << benchmark.run().toJson() << "\n";
+
+			return 0;
+		}
+
+		//create-torrent path output [key=value ...]
+		if (argc > 3 && std::string(argv[1]) == "create-torrent")
+		{
+			mtt::TorrentCreationSettings settings;
+			settings.path = argv[2];
+
+			for (int i = 4; i < argc; i++)
+			{
+				std::string arg = argv[i];
+				auto pos = arg.find('=');
+				if (pos == std::string::npos)
+					continue;
+
+				auto key = arg.substr(0, pos);
+				auto value = arg.substr(pos + 1);
+
+				if (key == "pieceSize")
+					settings.pieceSize = std::stoul(value);
+				else if (key == "threads")
+					settings.threads = std::stoul(value);
+				else if (key == "tracker")
+					settings.announceList.push_back(value);
+			}
+
+			uint32_t lastPercent = 0;
+			settings.onProgress = [&](uint64_t done, uint64_t size)
+			{
+				auto percent = (uint32_t)(done * 100 / size);
+				if (percent != lastPercent)
+					std::cout << percent << "%\r";
+				lastPercent = percent;
+			};
+
+			std::string data;
+			mtt::TorrentFileInfo info;
+			mtt::TorrentCreator creator(settings);
+
+			if (creator.create(data, info) != mtt::Status::Success)
+			{
+				std::cout << "Failed to create torrent\n";
+				return 1;
+			}
+
+			std::ofstream file(argv[3], std::ios_base::binary);
+			file << data;
+
+			std::cout << "Created " << info.info.pieces.size() << " pieces\n";
+
+			return 0;
+		}
+
 		TorrentTest test;
 		test.start();
 	}
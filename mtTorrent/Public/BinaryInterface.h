@@ -28,7 +28,7 @@ namespace mtBI
 	{
 		Init,
 		Deinit,
-		AddFromFile,	//char*, uint8_t[20]
+		AddFromFile,	//AddFromFileRequest, uint8_t[20]
 		AddFromMetadata, //char*, uint8_t[20]
 		Start,	//uint8_t[20], null
 		Stop,	//uint8_t[20], null
@@ -46,6 +46,10 @@ namespace mtBI
 		GetTorrentFilesSelection, //SourceId, TorrentFilesSelection
 		SetTorrentFilesSelection, //TorrentFilesSelectionRequest, null
 		AddPeer,	//AddPeerRequest, null
+		GetMemoryUsage,	//null, MemoryUsageInfo
+		GetTorrentTransferLimits,	//uint8_t[20], TorrentTransferLimits
+		SetTorrentTransferLimits,	//TorrentTransferLimits, null
+		SetTorrentPreallocationMode,	//TorrentPreallocationModeRequest, null
 	};
 
 	struct SourceId
@@ -61,6 +65,20 @@ namespace mtBI
 		bool dhtEnabled;
 		string directory;
 		uint32_t maxConnections;
+		//bytes per second, 0 is unlimited
+		uint32_t maxDownloadSpeed;
+		uint32_t maxUploadSpeed;
+	};
+
+	struct MemoryUsageInfo
+	{
+		//bytes, 0 is unlimited
+		uint64_t budget;
+		uint64_t used;
+		uint64_t downloadPieces;
+		uint64_t uploadPieces;
+		uint64_t readCache;
+		uint64_t writeCache;
 	};
 
 	struct MagnetLinkProgress
@@ -76,6 +94,13 @@ namespace mtBI
 		std::vector<string> logs;
 	};
 
+	struct AddFromFileRequest
+	{
+		const char* filename;
+		//all pieces assumed present and verified lazily, for data already on disk
+		bool seedMode;
+	};
+
 	struct RemoveTorrentRequest
 	{
 		uint8_t hash[20];
@@ -106,6 +131,21 @@ namespace mtBI
 		string addr;
 	};
 
+	struct TorrentTransferLimits
+	{
+		uint8_t hash[20];
+		//bytes per second, 0 is unlimited
+		uint32_t maxDownloadSpeed;
+		uint32_t maxUploadSpeed;
+	};
+
+	struct TorrentPreallocationModeRequest
+	{
+		uint8_t hash[20];
+		//0 sparse, 1 reserved by filesystem, 2 written with zeros
+		uint32_t mode;
+	};
+
 	struct TorrentFilesSelectionRequest
 	{
 		uint8_t hash[20];
@@ -147,6 +187,8 @@ namespace mtBI
 		bool utmActive;
 		bool checking;
 		float checkingProgress;
+		bool preallocating;
+		float preallocationProgress;
 		mtt::Status activeStatus;
 	};
 
@@ -0,0 +1,126 @@
+#include "BandwidthManager.h"
+#include <algorithm>
+
+//allow at most this part of second limit to accumulate while idle
+const uint32_t MaxBurstDivider = 4;
+
+void BandwidthChannel::setLimit(uint32_t bytesPerSecond)
+{
+	//limit can change while streams are charged
+	std::lock_guard<std::mutex> guard(BandwidthManager::get().mutex);
+
+	limit = bytesPerSecond;
+	quota = std::min<int64_t>(quota, limit / MaxBurstDivider);
+}
+
+uint32_t BandwidthChannel::getLimit() const
+{
+	std::lock_guard<std::mutex> guard(BandwidthManager::get().mutex);
+
+	return limit;
+}
+
+void BandwidthChannel::refill(std::chrono::steady_clock::time_point now)
+{
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - lastRefill).count();
+
+	if (elapsed <= 0)
+		return;
+
+	lastRefill = now;
+
+	if (limit)
+		quota = std::min<int64_t>(quota + (int64_t)limit * elapsed / 1000, limit / MaxBurstDivider);
+}
+
+bool BandwidthChannel::available() const
+{
+	return limit == 0 || quota > 0;
+}
+
+BandwidthManager& BandwidthManager::get()
+{
+	static BandwidthManager manager;
+
+	return manager;
+}
+
+bool BandwidthManager::transferred(const BandwidthChannels& channels, uint32_t bytes, void* owner, std::function<void()> onAvailable)
+{
+	std::lock_guard<std::mutex> guard(mutex);
+
+	refill(channels);
+
+	for (auto c : channels)
+		if (c && c->limit)
+			c->quota -= bytes;
+
+	//dont overtake streams already waiting for same channels
+	if (available(channels) && !queued(channels))
+		return true;
+
+	waiting.push_back({ channels, owner, onAvailable });
+
+	return false;
+}
+
+void BandwidthManager::cancel(void* owner)
+{
+	std::lock_guard<std::mutex> guard(mutex);
+
+	waiting.remove_if([owner](const Waiting& w) { return w.owner == owner; });
+}
+
+void BandwidthManager::process()
+{
+	std::vector<std::function<void()>> ready;
+
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+
+		for (auto& w : waiting)
+			refill(w.channels);
+
+		for (auto it = waiting.begin(); it != waiting.end();)
+		{
+			if (available(it->channels))
+			{
+				ready.push_back(it->onAvailable);
+				it = waiting.erase(it);
+			}
+			else
+				it++;
+		}
+	}
+
+	for (auto& f : ready)
+		f();
+}
+
+void BandwidthManager::refill(const BandwidthChannels& channels)
+{
+	auto now = std::chrono::steady_clock::now();
+
+	for (auto c : channels)
+		if (c)
+			c->refill(now);
+}
+
+bool BandwidthManager::available(const BandwidthChannels& channels)
+{
+	for (auto c : channels)
+		if (c && !c->available())
+			return false;
+
+	return true;
+}
+
+bool BandwidthManager::queued(const BandwidthChannels& channels)
+{
+	for (auto& w : waiting)
+		for (auto c : channels)
+			if (c && c->limit && std::find(w.channels.begin(), w.channels.end(), c) != w.channels.end())
+				return true;
+
+	return false;
+}
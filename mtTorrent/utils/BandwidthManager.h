@@ -0,0 +1,74 @@
+#pragma once
+
+#include <mutex>
+#include <list>
+#include <array>
+#include <chrono>
+#include <functional>
+
+/*
+Token bucket limiting transfer rate, 0 limit means unlimited.
+Transfers are charged after they happen, channel with negative quota blocks further transfers until refilled.
+*/
+class BandwidthChannel
+{
+public:
+
+	void setLimit(uint32_t bytesPerSecond);
+	uint32_t getLimit() const;
+
+private:
+
+	friend class BandwidthManager;
+
+	void refill(std::chrono::steady_clock::time_point now);
+	bool available() const;
+
+	uint32_t limit = 0;
+	int64_t quota = 0;
+	std::chrono::steady_clock::time_point lastRefill;
+};
+
+//peer, torrent and global channel, missing channels are nullptr
+using BandwidthChannels = std::array<BandwidthChannel*, 3>;
+
+/*
+Shares channels between streams, waiting streams are served in order of arrival, so every peer gets its turn
+once channels it uses have quota again.
+*/
+class BandwidthManager
+{
+public:
+
+	static BandwidthManager& get();
+
+	//charges transferred bytes, returns false if caller needs to wait for onAvailable before next transfer
+	bool transferred(const BandwidthChannels& channels, uint32_t bytes, void* owner, std::function<void()> onAvailable);
+	void cancel(void* owner);
+
+	//refill channels and serve waiting requests, waiting streams call this periodically
+	void process();
+
+	static const uint32_t RefreshInterval = 50;
+
+	BandwidthChannel globalUpload;
+	BandwidthChannel globalDownload;
+
+private:
+
+	friend class BandwidthChannel;
+
+	struct Waiting
+	{
+		BandwidthChannels channels;
+		void* owner;
+		std::function<void()> onAvailable;
+	};
+	std::list<Waiting> waiting;
+	//guards all channels
+	std::mutex mutex;
+
+	void refill(const BandwidthChannels& channels);
+	bool available(const BandwidthChannels& channels);
+	bool queued(const BandwidthChannels& channels);
+};
@@ -0,0 +1,266 @@
+#include "Bitset.h"
+#include <algorithm>
+#include <cstring>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+static inline size_t popcount64(uint64_t v)
+{
+#ifdef _MSC_VER
+	return __popcnt((uint32_t)v) + __popcnt((uint32_t)(v >> 32));
+#else
+	return __builtin_popcountll(v);
+#endif
+}
+
+//word in wire order with first bit as highest bit
+static inline uint64_t wireOrder(uint64_t v)
+{
+#ifdef _MSC_VER
+	return _byteswap_uint64(v);
+#else
+	return __builtin_bswap64(v);
+#endif
+}
+
+static inline uint32_t leadingZeros64(uint64_t v)
+{
+#ifdef _MSC_VER
+	unsigned long idx;
+	if (_BitScanReverse(&idx, (unsigned long)(v >> 32)))
+		return 31 - idx;
+	_BitScanReverse(&idx, (unsigned long)v);
+	return 63 - idx;
+#else
+	return __builtin_clzll(v);
+#endif
+}
+
+#ifdef __AVX2__
+static inline __m256i popcount256(__m256i v)
+{
+	const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i lowMask = _mm256_set1_epi8(0x0f);
+
+	auto lo = _mm256_and_si256(v, lowMask);
+	auto hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), lowMask);
+	auto bytesCount = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+
+	return _mm256_sad_epu8(bytesCount, _mm256_setzero_si256());
+}
+
+template<bool Have, bool Wanted>
+static inline __m256i interesting256(const uint64_t* peer, const uint64_t* have, const uint64_t* wanted, size_t i)
+{
+	auto v = _mm256_loadu_si256((const __m256i*)(peer + i));
+
+	if (Have)
+		v = _mm256_andnot_si256(_mm256_loadu_si256((const __m256i*)(have + i)), v);
+	if (Wanted)
+		v = _mm256_and_si256(v, _mm256_loadu_si256((const __m256i*)(wanted + i)));
+
+	return v;
+}
+#endif
+
+template<bool Have, bool Wanted>
+static inline uint64_t interesting64(const uint64_t* peer, const uint64_t* have, const uint64_t* wanted, size_t i)
+{
+	auto v = peer[i];
+
+	if (Have)
+		v &= ~have[i];
+	if (Wanted)
+		v &= wanted[i];
+
+	return v;
+}
+
+template<bool Have, bool Wanted>
+static size_t countKernel(const uint64_t* peer, const uint64_t* have, const uint64_t* wanted, size_t words)
+{
+	size_t i = 0;
+	size_t sum = 0;
+
+#ifdef __AVX2__
+	auto acc = _mm256_setzero_si256();
+
+	for (; i + 4 <= words; i += 4)
+		acc = _mm256_add_epi64(acc, popcount256(interesting256<Have, Wanted>(peer, have, wanted, i)));
+
+	sum += (size_t)_mm256_extract_epi64(acc, 0) + (size_t)_mm256_extract_epi64(acc, 1) + (size_t)_mm256_extract_epi64(acc, 2) + (size_t)_mm256_extract_epi64(acc, 3);
+#endif
+
+	for (; i < words; i++)
+		sum += popcount64(interesting64<Have, Wanted>(peer, have, wanted, i));
+
+	return sum;
+}
+
+template<bool Have, bool Wanted>
+static size_t nextKernel(const uint64_t* peer, const uint64_t* have, const uint64_t* wanted, size_t words, size_t from)
+{
+	size_t i = from / 64;
+
+	if (i >= words)
+		return Bitset::npos;
+
+	auto v = wireOrder(interesting64<Have, Wanted>(peer, have, wanted, i)) & (~0ULL >> (from % 64));
+
+	if (v)
+		return i * 64 + leadingZeros64(v);
+
+	i++;
+
+#ifdef __AVX2__
+	for (; i + 4 <= words; i += 4)
+	{
+		auto v256 = interesting256<Have, Wanted>(peer, have, wanted, i);
+
+		if (!_mm256_testz_si256(v256, v256))
+			break;
+	}
+#endif
+
+	for (; i < words; i++)
+	{
+		v = interesting64<Have, Wanted>(peer, have, wanted, i);
+
+		if (v)
+			return i * 64 + leadingZeros64(wireOrder(v));
+	}
+
+	return Bitset::npos;
+}
+
+void Bitset::init(size_t count, bool value)
+{
+	bits = count;
+	words.assign((count + 63) / 64, value ? ~0ULL : 0);
+
+	clearUnusedBits();
+}
+
+void Bitset::resize(size_t count)
+{
+	bits = count;
+	words.resize((count + 63) / 64, 0);
+
+	clearUnusedBits();
+}
+
+void Bitset::clear()
+{
+	bits = 0;
+	words.clear();
+}
+
+size_t Bitset::size() const
+{
+	return bits;
+}
+
+bool Bitset::empty() const
+{
+	return bits == 0;
+}
+
+bool Bitset::get(size_t idx) const
+{
+	return (wireData()[idx / 8] & (0x80 >> (idx % 8))) != 0;
+}
+
+void Bitset::set(size_t idx)
+{
+	((uint8_t*)words.data())[idx / 8] |= (0x80 >> (idx % 8));
+}
+
+void Bitset::reset(size_t idx)
+{
+	((uint8_t*)words.data())[idx / 8] &= ~(0x80 >> (idx % 8));
+}
+
+size_t Bitset::count() const
+{
+	return countKernel<false, false>(words.data(), nullptr, nullptr, words.size());
+}
+
+void Bitset::fromWire(const uint8_t* data, size_t dataSize, size_t count)
+{
+	init(count);
+	memcpy(words.data(), data, std::min(dataSize, wireSize()));
+
+	clearUnusedBits();
+}
+
+const uint8_t* Bitset::wireData() const
+{
+	return (const uint8_t*)words.data();
+}
+
+size_t Bitset::wireSize() const
+{
+	return (bits + 7) / 8;
+}
+
+size_t Bitset::countInteresting(const Bitset& peer, const Bitset& have, const Bitset& wanted)
+{
+	auto words = std::min(peer.words.size(), have.words.size());
+
+	if (wanted.empty())
+		return countKernel<true, false>(peer.words.data(), have.words.data(), nullptr, words)
+			+ countKernel<false, false>(peer.words.data() + words, nullptr, nullptr, peer.words.size() - words);
+
+	auto wantedWords = std::min(peer.words.size(), wanted.words.size());
+	words = std::min(words, wantedWords);
+
+	return countKernel<true, true>(peer.words.data(), have.words.data(), wanted.words.data(), words)
+		+ countKernel<false, true>(peer.words.data() + words, nullptr, wanted.words.data() + words, wantedWords - words);
+}
+
+size_t Bitset::nextInteresting(const Bitset& peer, const Bitset& have, const Bitset& wanted, size_t from)
+{
+	auto words = std::min(peer.words.size(), have.words.size());
+	size_t idx = npos;
+
+	if (wanted.empty())
+	{
+		idx = nextKernel<true, false>(peer.words.data(), have.words.data(), nullptr, words, from);
+
+		if (idx == npos)
+			idx = nextKernel<false, false>(peer.words.data(), nullptr, nullptr, peer.words.size(), std::max(from, words * 64));
+	}
+	else
+	{
+		auto wantedWords = std::min(peer.words.size(), wanted.words.size());
+		words = std::min(words, wantedWords);
+		idx = nextKernel<true, true>(peer.words.data(), have.words.data(), wanted.words.data(), words, from);
+
+		if (idx == npos)
+			idx = nextKernel<false, true>(peer.words.data(), nullptr, wanted.words.data(), wantedWords, std::max(from, words * 64));
+	}
+
+	return idx;
+}
+
+size_t Bitset::countCommon(const Bitset& l, const Bitset& r)
+{
+	return countKernel<false, true>(l.words.data(), nullptr, r.words.data(), std::min(l.words.size(), r.words.size()));
+}
+
+void Bitset::clearUnusedBits()
+{
+	auto data = (uint8_t*)words.data();
+	auto usedBytes = wireSize();
+
+	memset(data + usedBytes, 0, words.size() * 8 - usedBytes);
+
+	if (bits % 8)
+		data[bits / 8] &= (uint8_t)(0xFF << (8 - bits % 8));
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/*
+Bits packed in 64bit words, stored in BitTorrent wire order (bytes in sequence, highest bit first)
+so wire bitfield is just a copy of the underlying memory.
+*/
+class Bitset
+{
+public:
+
+	static const size_t npos = (size_t)-1;
+
+	void init(size_t count, bool value = false);
+	void resize(size_t count);
+	void clear();
+
+	size_t size() const;
+	bool empty() const;
+
+	bool get(size_t idx) const;
+	void set(size_t idx);
+	void reset(size_t idx);
+
+	size_t count() const;
+
+	void fromWire(const uint8_t* data, size_t dataSize, size_t count);
+	const uint8_t* wireData() const;
+	size_t wireSize() const;
+
+	//count of bits set in peer, not set in have and set in wanted, empty wanted means everything is wanted
+	static size_t countInteresting(const Bitset& peer, const Bitset& have, const Bitset& wanted);
+	//first index from position with bit set in peer, not set in have and set in wanted
+	static size_t nextInteresting(const Bitset& peer, const Bitset& have, const Bitset& wanted, size_t from);
+	//count of bits set in both
+	static size_t countCommon(const Bitset& l, const Bitset& r);
+
+private:
+
+	void clearUnusedBits();
+
+	std::vector<uint64_t> words;
+	size_t bits = 0;
+};
@@ -0,0 +1,64 @@
+#include "MerkleTree.h"
+#include <openssl/sha.h>
+#include <cstring>
+
+mtt::MerkleTree::Hash mtt::MerkleTree::hashBlock(const uint8_t* data, size_t size)
+{
+	Hash out;
+	SHA256(data, size, out.data());
+
+	return out;
+}
+
+size_t mtt::MerkleTree::getLeavesCount(size_t count)
+{
+	size_t leaves = 1;
+
+	while (leaves < count)
+		leaves *= 2;
+
+	return leaves;
+}
+
+static mtt::MerkleTree::Hash hashPair(const mtt::MerkleTree::Hash& left, const mtt::MerkleTree::Hash& right)
+{
+	uint8_t data[64];
+	memcpy(data, left.data(), 32);
+	memcpy(data + 32, right.data(), 32);
+
+	return mtt::MerkleTree::hashBlock(data, sizeof(data));
+}
+
+mtt::MerkleTree::Hash mtt::MerkleTree::getPadHash(size_t leavesCount)
+{
+	Hash pad = {};
+
+	for (size_t i = 1; i < leavesCount; i *= 2)
+		pad = hashPair(pad, pad);
+
+	return pad;
+}
+
+mtt::MerkleTree::Hash mtt::MerkleTree::getRoot(std::vector<Hash> layer, size_t leavesCount, const Hash& pad)
+{
+	if (layer.empty())
+		return pad;
+
+	auto currentPad = pad;
+
+	while (leavesCount > 1)
+	{
+		//missing right sibling is whole padded subtree
+		if (layer.size() % 2)
+			layer.push_back(currentPad);
+
+		for (size_t i = 0; i < layer.size() / 2; i++)
+			layer[i] = hashPair(layer[2 * i], layer[2 * i + 1]);
+
+		layer.resize(layer.size() / 2);
+		currentPad = hashPair(currentPad, currentPad);
+		leavesCount /= 2;
+	}
+
+	return layer.front();
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <array>
+
+namespace mtt
+{
+	//SHA-256 merkle trees of BEP 52, leaves are hashes of 16kB blocks of single file
+	namespace MerkleTree
+	{
+		const uint32_t BlockSize = 16 * 1024;
+
+		using Hash = std::array<uint8_t, 32>;
+
+		Hash hashBlock(const uint8_t* data, size_t size);
+
+		//smallest power of two not less than count
+		size_t getLeavesCount(size_t count);
+
+		//root of subtree with given count of zero leaves
+		Hash getPadHash(size_t leavesCount);
+
+		//root of hashes padded with pad hashes up to leavesCount (power of two)
+		Hash getRoot(std::vector<Hash> layer, size_t leavesCount, const Hash& pad = Hash());
+	}
+}
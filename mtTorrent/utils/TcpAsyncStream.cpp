@@ -3,7 +3,7 @@
 
 #define TCP_LOG(x) WRITE_LOG(LogTypeTcp, x)
 
-TcpAsyncStream::TcpAsyncStream(boost::asio::io_service& io) : io_service(io), socket(io), timeoutTimer(io)
+TcpAsyncStream::TcpAsyncStream(boost::asio::io_service& io) : bandwidthTimer(io), socket(io), timeoutTimer(io), io_service(io)
 {
 }
 
@@ -63,6 +63,7 @@ void TcpAsyncStream::close()
 	onConnectCallback = nullptr;
 	onReceiveCallback = nullptr;
 	onCloseCallback = nullptr;
+	onWriteQueueLowCallback = nullptr;
 
 	if (state == Disconnected)
 		return;
@@ -72,14 +73,46 @@ void TcpAsyncStream::close()
 
 void TcpAsyncStream::write(const DataBuffer& data)
 {
-	io_service.post(std::bind(&TcpAsyncStream::do_write, this, data));
+	{
+		std::lock_guard<std::mutex> guard(write_msgs_mutex);
+		writeQueueSize += data.size();
+	}
+
+	io_service.post(std::bind(&TcpAsyncStream::do_write, this, WriteMessage{ data }));
+}
+
+void TcpAsyncStream::write(const DataBuffer& data, std::shared_ptr<const DataBuffer> payload, size_t payloadPos, size_t payloadSize)
+{
+	WriteMessage msg{ data, payload, payloadPos, payloadSize };
+
+	{
+		std::lock_guard<std::mutex> guard(write_msgs_mutex);
+		writeQueueSize += msg.size();
+	}
+
+	io_service.post(std::bind(&TcpAsyncStream::do_write, this, std::move(msg)));
 }
 
 void TcpAsyncStream::prepareWrite(const DataBuffer& data)
 {
 	std::lock_guard<std::mutex> guard(write_msgs_mutex);
 
-	write_msgs.push_back(data);
+	write_msgs.push_back({ data });
+	writeQueueSize += data.size();
+}
+
+size_t TcpAsyncStream::getWriteQueueSize()
+{
+	std::lock_guard<std::mutex> guard(write_msgs_mutex);
+
+	return writeQueueSize;
+}
+
+void TcpAsyncStream::setWriteQueueLowWatermark(size_t size)
+{
+	std::lock_guard<std::mutex> guard(write_msgs_mutex);
+
+	writeQueueLowWatermark = size;
 }
 
 DataBuffer TcpAsyncStream::getReceivedData()
@@ -106,6 +139,15 @@ tcp::endpoint& TcpAsyncStream::getEndpoint()
 	return info.endpoint;
 }
 
+void TcpAsyncStream::setBandwidthChannels(BandwidthChannel* parentUpload, BandwidthChannel* parentDownload)
+{
+	auto& manager = BandwidthManager::get();
+
+	uploadChannels = { &uploadLimit, parentUpload, &manager.globalUpload };
+	downloadChannels = { &downloadLimit, parentDownload, &manager.globalDownload };
+	limitBandwidth = true;
+}
+
 void TcpAsyncStream::connectByHostname()
 {
 	state = Connecting;
@@ -129,7 +171,7 @@ void TcpAsyncStream::setAsConnected()
 	info.endpoint = socket.remote_endpoint();
 	info.endpointInitialized = true;
 
-	socket.async_receive(boost::asio::buffer(recv_buffer), std::bind(&TcpAsyncStream::handle_receive, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+	start_receive();
 
 	check_write();
 
@@ -163,6 +205,18 @@ void TcpAsyncStream::postFail(std::string place, const boost::system::error_code
 	state = Disconnected;
 	timeoutTimer.cancel();
 
+	if (limitBandwidth)
+	{
+		BandwidthManager::get().cancel(this);
+		bandwidthTimer.cancel();
+		waitingUpload = waitingDownload = false;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(write_msgs_mutex);
+		writing = false;
+	}
+
 	{
 		std::lock_guard<std::mutex> guard(callbackMutex);
 
@@ -225,32 +279,23 @@ void TcpAsyncStream::check_write()
 {
 	std::lock_guard<std::mutex> guard(write_msgs_mutex);
 
-	if (!write_msgs.empty())
-	{
-		boost::asio::async_write(socket,
-			boost::asio::buffer(write_msgs.front().data(), write_msgs.front().size()),
-			std::bind(&TcpAsyncStream::handle_write, shared_from_this(), std::placeholders::_1));
-	}
+	if (!write_msgs.empty() && !writing)
+		start_write();
 }
 
-void TcpAsyncStream::do_write(DataBuffer data)
+void TcpAsyncStream::do_write(WriteMessage msg)
 {
 	std::lock_guard<std::mutex> guard(write_msgs_mutex);
 
-	write_msgs.push_back(data);
+	auto size = msg.size();
+	write_msgs.push_back(std::move(msg));
 
 	if (state == Connected)
 	{
-		TCP_LOG("writing " << data.size() << " bytes");
+		TCP_LOG("writing " << size << " bytes");
 
-		bool write_in_progress = write_msgs.size() > 1;
-
-		if (!write_in_progress)
-		{
-			boost::asio::async_write(socket,
-				boost::asio::buffer(write_msgs.front().data(), write_msgs.front().size()),
-				std::bind(&TcpAsyncStream::handle_write, shared_from_this(), std::placeholders::_1));
-		}
+		if (!writing)
+			start_write();
 	}
 	else if (state != Connecting)
 	{
@@ -265,18 +310,75 @@ void TcpAsyncStream::do_write(DataBuffer data)
 	}
 }
 
-void TcpAsyncStream::handle_write(const boost::system::error_code& error)
+void TcpAsyncStream::start_write()
+{
+	writing = true;
+
+	auto& msg = write_msgs.front();
+	std::array<boost::asio::const_buffer, 2> buffers = {
+		boost::asio::const_buffer(msg.data.data(), msg.data.size()),
+		boost::asio::const_buffer(msg.payload ? msg.payload->data() + msg.payloadPos : nullptr, msg.payloadSize) };
+
+	boost::asio::async_write(socket,
+		buffers,
+		std::bind(&TcpAsyncStream::handle_write, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+}
+
+void TcpAsyncStream::resume_write()
+{
+	std::lock_guard<std::mutex> guard(write_msgs_mutex);
+
+	waitingUpload = false;
+
+	if (!write_msgs.empty() && state == Connected)
+		start_write();
+	else
+		writing = false;
+}
+
+void TcpAsyncStream::handle_write(const boost::system::error_code& error, std::size_t bytes_transferred)
 {
 	if (!error)
 	{
-		std::lock_guard<std::mutex> guard(write_msgs_mutex);
+		bool queueLow = false;
 
-		write_msgs.pop_front();
-		if (!write_msgs.empty())
 		{
-			boost::asio::async_write(socket,
-				boost::asio::buffer(write_msgs.front().data(), write_msgs.front().size()),
-				std::bind(&TcpAsyncStream::handle_write, shared_from_this(), std::placeholders::_1));
+			std::lock_guard<std::mutex> guard(write_msgs_mutex);
+
+			auto lastSize = writeQueueSize;
+			writeQueueSize -= write_msgs.front().size();
+			write_msgs.pop_front();
+
+			queueLow = lastSize >= writeQueueLowWatermark && writeQueueSize < writeQueueLowWatermark;
+
+			bool waiting = false;
+			if (limitBandwidth)
+			{
+				auto self = shared_from_this();
+				auto onAvailable = [self]() { self->io_service.post(std::bind(&TcpAsyncStream::resume_write, self)); };
+
+				if (!BandwidthManager::get().transferred(uploadChannels, (uint32_t)bytes_transferred, this, onAvailable))
+				{
+					waitingUpload = waiting = true;
+					waitForBandwidth();
+				}
+			}
+
+			if (!waiting)
+			{
+				if (!write_msgs.empty())
+					start_write();
+				else
+					writing = false;
+			}
+		}
+
+		if (queueLow)
+		{
+			std::lock_guard<std::mutex> guard(callbackMutex);
+
+			if (onWriteQueueLowCallback)
+				onWriteQueueLowCallback();
 		}
 	}
 	else
@@ -285,6 +387,12 @@ void TcpAsyncStream::handle_write(const boost::system::error_code& error)
 	}
 }
 
+void TcpAsyncStream::start_receive()
+{
+	socket.async_receive(boost::asio::buffer(recv_buffer),
+		std::bind(&TcpAsyncStream::handle_receive, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+}
+
 void TcpAsyncStream::handle_receive(const boost::system::error_code& error, std::size_t bytes_transferred)
 {
 	TCP_LOG("received " << bytes_transferred << " bytes");
@@ -294,8 +402,29 @@ void TcpAsyncStream::handle_receive(const boost::system::error_code& error, std:
 		appendData(recv_buffer.data(), bytes_transferred);
 
 		timeoutTimer.expires_from_now(boost::posix_time::seconds(60));
-		socket.async_receive(boost::asio::buffer(recv_buffer),
-			std::bind(&TcpAsyncStream::handle_receive, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+
+		if (limitBandwidth)
+		{
+			auto self = shared_from_this();
+			auto onAvailable = [self]()
+			{
+				self->io_service.post([self]()
+					{
+						self->waitingDownload = false;
+						self->start_receive();
+					});
+			};
+
+			if (BandwidthManager::get().transferred(downloadChannels, (uint32_t)bytes_transferred, this, onAvailable))
+				start_receive();
+			else
+			{
+				waitingDownload = true;
+				waitForBandwidth();
+			}
+		}
+		else
+			start_receive();
 
 		{
 			std::lock_guard<std::mutex> guard(callbackMutex);
@@ -330,3 +459,31 @@ void TcpAsyncStream::checkTimeout()
 
 	timeoutTimer.async_wait(std::bind(&TcpAsyncStream::checkTimeout, shared_from_this()));
 }
+
+void TcpAsyncStream::waitForBandwidth()
+{
+	std::lock_guard<std::mutex> guard(bandwidth_mutex);
+
+	if (bandwidthTimerActive)
+		return;
+
+	bandwidthTimerActive = true;
+	bandwidthTimer.expires_from_now(boost::posix_time::milliseconds(BandwidthManager::RefreshInterval));
+	bandwidthTimer.async_wait(std::bind(&TcpAsyncStream::handle_bandwidth_timer, shared_from_this(), std::placeholders::_1));
+}
+
+void TcpAsyncStream::handle_bandwidth_timer(const boost::system::error_code& error)
+{
+	{
+		std::lock_guard<std::mutex> guard(bandwidth_mutex);
+		bandwidthTimerActive = false;
+	}
+
+	if (error || state == Disconnected)
+		return;
+
+	BandwidthManager::get().process();
+
+	if (waitingUpload || waitingDownload)
+		waitForBandwidth();
+}
@@ -1,12 +1,14 @@
 #pragma once
 
 #include "utils\Network.h"
+#include "utils\BandwidthManager.h"
 #include <mutex>
 #include <future>
 #include <memory>
 #include <array>
 #include <functional>
 #include <deque>
+#include <atomic>
 
 class TcpAsyncServer;
 
@@ -28,8 +30,15 @@ public:
 	void close();
 
 	void write(const DataBuffer& data);
+	//writes data followed by part of shared payload, payload is sent without copying
+	void write(const DataBuffer& data, std::shared_ptr<const DataBuffer> payload, size_t payloadPos, size_t payloadSize);
 	void prepareWrite(const DataBuffer& data);
 
+	//bytes waiting to be written to socket
+	size_t getWriteQueueSize();
+	//onWriteQueueLowCallback is called when write queue drops under this size
+	void setWriteQueueLowWatermark(size_t size);
+
 	DataBuffer getReceivedData();
 	void consumeData(size_t size);
 
@@ -37,10 +46,16 @@ public:
 	std::function<void()> onConnectCallback;
 	std::function<void()> onReceiveCallback;
 	std::function<void(int)> onCloseCallback;
+	std::function<void()> onWriteQueueLowCallback;
 
 	std::string& getHostname();
 	tcp::endpoint& getEndpoint();
 
+	//enables rate limiting through own, optional parent and global channels
+	void setBandwidthChannels(BandwidthChannel* parentUpload, BandwidthChannel* parentDownload);
+	BandwidthChannel uploadLimit;
+	BandwidthChannel downloadLimit;
+
 protected:
 
 	void connectByHostname();
@@ -55,14 +70,42 @@ protected:
 	void handle_connect(const boost::system::error_code& err);
 	void do_close();
 
+	struct WriteMessage
+	{
+		DataBuffer data;
+		std::shared_ptr<const DataBuffer> payload;
+		size_t payloadPos = 0;
+		size_t payloadSize = 0;
+
+		size_t size() const { return data.size() + payloadSize; }
+	};
+
 	void check_write();
-	void do_write(DataBuffer data);
+	void do_write(WriteMessage msg);
+	void start_write();
+	void resume_write();
 	std::mutex write_msgs_mutex;
-	std::deque<DataBuffer> write_msgs;
-	void handle_write(const boost::system::error_code& error);
+	std::deque<WriteMessage> write_msgs;
+	size_t writeQueueSize = 0;
+	size_t writeQueueLowWatermark = 0;
+	bool writing = false;
+	void handle_write(const boost::system::error_code& error, std::size_t bytes_transferred);
 
 	std::array<char, 10*1024> recv_buffer;
+	void start_receive();
 	void handle_receive(const boost::system::error_code& error, std::size_t bytes_transferred);
+
+	bool limitBandwidth = false;
+	BandwidthChannels uploadChannels = {};
+	BandwidthChannels downloadChannels = {};
+	//set from asio handlers and bandwidth callbacks
+	std::atomic<bool> waitingUpload { false };
+	std::atomic<bool> waitingDownload { false };
+	void waitForBandwidth();
+	void handle_bandwidth_timer(const boost::system::error_code& error);
+	std::mutex bandwidth_mutex;
+	boost::asio::deadline_timer bandwidthTimer;
+	bool bandwidthTimerActive = false;
 	void appendData(char* data, size_t size);
 	std::mutex receiveBuffer_mutex;
 	DataBuffer receiveBuffer;
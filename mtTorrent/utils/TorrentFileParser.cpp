@@ -2,6 +2,7 @@
 #include <iostream>
 #include <openssl/sha.h>
 #include <boost/filesystem.hpp>
+#include "MerkleTree.h"
 
 #define TPARSER_LOG(x) WRITE_LOG(LogTypeFileParser, x)
 
@@ -9,6 +10,7 @@ using namespace mtt;
 
 bool generateInfoHash(BencodeParser& parsed, TorrentFileInfo&);
 void loadTorrentFileInfo(BencodeParser& parsed, TorrentFileInfo&);
+void loadTorrentInfoV2(BencodeParser& parsed, const char* dataEnd, TorrentFileInfo&);
 TorrentInfo parseTorrentInfo(const BencodeParser::Object* info);
 
 TorrentFileInfo TorrentFileParser::parse(const uint8_t* data, size_t length)
@@ -21,6 +23,7 @@ TorrentFileInfo TorrentFileParser::parse(const uint8_t* data, size_t length)
 	
 	loadTorrentFileInfo(parser, out);
 	generateInfoHash(parser, out);
+	loadTorrentInfoV2(parser, (const char*)data + length, out);
 
 	return out;
 }
@@ -160,6 +163,9 @@ mtt::TorrentInfo mtt::TorrentFileParser::parseTorrentInfo(const uint8_t* data, s
 
 		SHA1((const unsigned char*)infoStart, infoEnd - infoStart, (unsigned char*)&info.hash[0]);
 
+		if (info.hasV2)
+			SHA256((const unsigned char*)infoStart, infoEnd - infoStart, (unsigned char*)&info.hashV2[0]);
+
 		return info;
 	}
 	else
@@ -207,11 +213,14 @@ mtt::TorrentInfo parseTorrentInfo(const BencodeParser::Object* infoDictionary)
 			}
 
 			size_t size = file->getBigInt("length");
-			auto startId = getPieceIndex(sizeSum, info.pieceSize);
+			auto startId = static_cast<uint32_t>(sizeSum / info.pieceSize);
 			auto startPos = sizeSum % info.pieceSize;
 			sizeSum += size;
 			auto endId = getPieceIndex(sizeSum, info.pieceSize);
 			auto endPos = sizeSum % info.pieceSize;
+			//file ending on piece boundary ends with full piece
+			if (endPos == 0 && sizeSum)
+				endPos = info.pieceSize;
 
 			info.files.push_back({ path,  size, startId, (uint32_t)startPos, endId, (uint32_t)endPos });
 			file = file->getNextSibling();
@@ -223,6 +232,8 @@ mtt::TorrentInfo parseTorrentInfo(const BencodeParser::Object* infoDictionary)
 	{
 		size_t size = infoDictionary->getBigInt("length");
 		auto endPos = size % info.pieceSize;
+		if (endPos == 0 && size)
+			endPos = info.pieceSize;
 		info.name = infoDictionary->getTxt("name");
 		info.files.push_back({ { info.name }, size, 0, 0, static_cast<uint32_t>(info.pieces.size() - 1), (uint32_t)endPos });
 
@@ -237,9 +248,168 @@ mtt::TorrentInfo parseTorrentInfo(const BencodeParser::Object* infoDictionary)
 		info.lastPieceLastBlockSize = info.lastPieceSize - (info.lastPieceLastBlockIndex * BlockRequestMaxSize);
 	}
 
+	if (infoDictionary->getInt("meta version") == 2)
+	{
+		//storage checking and piece requests are built on v1 pieces
+		if (info.pieces.empty())
+		{
+			TPARSER_LOG("Torrent without v1 pieces is not supported");
+			return mtt::TorrentInfo();
+		}
+
+		info.hasV2 = true;
+	}
+
 	auto piecesCount = info.pieces.size();
 	auto addExpected = piecesCount % 8 > 0 ? 1 : 0; //8 pieces in byte
 	info.expectedBitfieldSize = piecesCount / 8 + addExpected;
 
 	return info;
 }
+
+//bencoded value of dictionary item
+static std::string getRawItem(const BencodeParser::Object* dict, const char* name, const char* dataEnd)
+{
+	auto len = strlen(name);
+
+	for (auto key = dict->getFirstItem(); key; key = (key + 1)->getNextSibling())
+	{
+		if (key->info.equals(name, len))
+		{
+			auto start = key->info.data + key->info.size;
+
+			BencodeParser parser;
+			if (parser.parse((const uint8_t*)start, dataEnd - start))
+				return std::string(start, parser.bodyEnd);
+
+			break;
+		}
+	}
+
+	return std::string();
+}
+
+static void loadFileTree(const BencodeParser::Object* dir, const std::string& path, std::map<std::string, std::string>& roots)
+{
+	for (auto key = dir->getFirstItem(); key; key = (key + 1)->getNextSibling())
+	{
+		auto value = key + 1;
+
+		if (!value->isMap())
+			continue;
+
+		if (key->info.size == 0)
+		{
+			auto root = value->getTxtItem("pieces root");
+
+			if (root && root->size == 32)
+				roots[path] = std::string(root->data, root->size);
+		}
+		else
+			loadFileTree(value, path.empty() ? key->getTxt() : path + "/" + key->getTxt(), roots);
+	}
+}
+
+static const BencodeParser::Object::Item* getPieceLayer(const BencodeParser::Object* layers, const std::string& root)
+{
+	if (layers)
+	{
+		for (auto key = layers->getFirstItem(); key; key = (key + 1)->getNextSibling())
+		{
+			if (key->info.size == 32 && memcmp(key->info.data, root.data(), 32) == 0 && (key + 1)->isText())
+				return &(key + 1)->info;
+		}
+	}
+
+	return nullptr;
+}
+
+void loadTorrentInfoV2(BencodeParser& parser, const char* dataEnd, TorrentFileInfo& fileInfo)
+{
+	auto& info = fileInfo.info;
+	auto root = parser.getRoot();
+
+	if (!info.hasV2 || !root || !root->isMap())
+		return;
+
+	auto infoDictionary = root->getDictItem("info");
+	auto fileTree = infoDictionary ? infoDictionary->getDictItem("file tree") : nullptr;
+
+	fileInfo.infoData = getRawItem(root, "info", dataEnd);
+	fileInfo.pieceLayers = getRawItem(root, "piece layers", dataEnd);
+	SHA256((const unsigned char*)fileInfo.infoData.data(), fileInfo.infoData.size(), info.hashV2);
+
+	if (!fileTree || info.pieceSize < MerkleTree::BlockSize)
+		return;
+
+	std::map<std::string, std::string> roots;
+	loadFileTree(fileTree, "", roots);
+
+	auto layers = root->getDictItem("piece layers");
+	auto leavesPerPiece = info.pieceSize / MerkleTree::BlockSize;
+	bool multiFile = infoDictionary->getListItem("files") != nullptr;
+
+	info.piecesV2.resize(info.pieces.size());
+
+	for (auto& file : info.files)
+	{
+		std::string path;
+		for (size_t i = multiFile ? 1 : 0; i < file.path.size(); i++)
+			path += (path.empty() ? "" : "/") + file.path[i];
+
+		auto it = roots.find(path);
+		if (it == roots.end() || file.size == 0)
+			continue;
+
+		//hybrid torrent pads files to piece boundaries
+		if (file.startPiecePos != 0)
+		{
+			TPARSER_LOG("Unaligned file in hybrid torrent " << path);
+			info.piecesV2.clear();
+			return;
+		}
+
+		auto& piecesRoot = it->second;
+		uint32_t filePieces = (uint32_t)((file.size + info.pieceSize - 1) / info.pieceSize);
+
+		if (file.startPieceIndex + filePieces > info.piecesV2.size())
+			continue;
+
+		if (filePieces == 1)
+		{
+			auto& piece = info.piecesV2[file.startPieceIndex];
+			memcpy(piece.hash, piecesRoot.data(), 32);
+			memcpy(piece.piecesRoot, piecesRoot.data(), 32);
+			piece.leavesCount = (uint32_t)MerkleTree::getLeavesCount((file.size + MerkleTree::BlockSize - 1) / MerkleTree::BlockSize);
+			piece.firstLeaf = 0;
+			piece.dataSize = (uint32_t)file.size;
+			continue;
+		}
+
+		auto layer = getPieceLayer(layers, piecesRoot);
+		if (!layer || layer->size != (int)(filePieces * 32))
+			continue;
+
+		//piece layers are outside of info dictionary, check them against its roots
+		std::vector<MerkleTree::Hash> hashes(filePieces);
+		for (uint32_t i = 0; i < filePieces; i++)
+			memcpy(hashes[i].data(), layer->data + i * 32, 32);
+
+		auto layerRoot = MerkleTree::getRoot(hashes, MerkleTree::getLeavesCount(filePieces), MerkleTree::getPadHash(leavesPerPiece));
+		if (memcmp(layerRoot.data(), piecesRoot.data(), 32) != 0)
+		{
+			TPARSER_LOG("Invalid piece layer of file " << path);
+			continue;
+		}
+
+		for (uint32_t i = 0; i < filePieces; i++)
+		{
+			auto& piece = info.piecesV2[file.startPieceIndex + i];
+			memcpy(piece.hash, hashes[i].data(), 32);
+			memcpy(piece.piecesRoot, piecesRoot.data(), 32);
+			piece.leavesCount = leavesPerPiece;
+			piece.firstLeaf = i * leavesPerPiece;
+			piece.dataSize = (uint32_t)std::min<uint64_t>(info.pieceSize, file.size - (uint64_t)i * info.pieceSize);
+		}
+	}
+}